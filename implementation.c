@@ -28,6 +28,7 @@
 
 */
 
+#include <assert.h>
 #include <stddef.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
@@ -62,8 +63,8 @@
    region of size fssize pointed to by fsptr reads as zero-bytes. When
    a backup-file is used and the filesystem is mounted again, certain
    parts of the memory, which have previously been written, may read
-   as non-zero bytes. The size of the memory region is at least 2048
-   bytes.
+   as non-zero bytes. The size of the memory region is at least 
+   MIN_FS_SIZE bytes.
 
    CAUTION:
 
@@ -237,291 +238,568 @@
 
 /* (2) START memory allocation implementation */
 
-void add_to_free_memory(void *fsptr, list_t *ll, data_block_t *new_block) {
-    data_block_t *current_block;
-    fs_offset current_offset = ll->head;
-    fs_offset new_block_offset = pointer_to_offset(fsptr, new_block);
-
-    // Check if the new allocation comes before the first space in the linked list
-    if (current_offset > new_block_offset) {
-        // Update the head of the linked list
-        ll->head = new_block_offset;
-
-        // Check if we can merge the new allocation with the first space in the linked list
-        if ((new_block_offset + sizeof(size_t) + new_block->remaining) == current_offset) {
-            // Merge the spaces
-            current_block = offset_to_pointer(fsptr, current_offset);
-            new_block->remaining += sizeof(size_t) + current_block->remaining;
-            new_block->next = current_block->next;
-        } else {
-            // Couldn't merge, so just add it as the first space and update pointers
-            new_block->next = current_offset;
-        }
-    } else {
-        // Find the position to insert the new allocation
-        current_block = offset_to_pointer(fsptr, current_offset);
-        
-        // Get the last block that is in lower memory than the new allocation
-        while ((current_block->next != 0) && (current_block->next < new_block_offset)) {
-            current_block = offset_to_pointer(fsptr, current_block->next);
-        }
-        
-        current_offset = pointer_to_offset(fsptr, current_block);
-
-        // Check if we can merge the new allocation with the next space
-        fs_offset next_block_offset = current_block->next;
-        if (next_block_offset != 0) {
-            if ((new_block_offset + sizeof(size_t) + new_block->remaining) == next_block_offset) {
-                data_block_t *next_block = offset_to_pointer(fsptr, next_block_offset);
-                new_block->remaining += sizeof(size_t) + next_block->remaining;
-                new_block->next = next_block->next;
-            } else {
-                new_block->next = next_block_offset;
-            }
-        } else {
-            new_block->next = 0;
-        }
+// Helpers to read and write block headers; sizes are multiples of ALLOC_ALIGN,
+// so the low bits of a header carry the ALLOC_* flags
+static inline size_t block_size(data_block_t *block) {
+    return block->header & ~ALLOC_FLAGS;
+}
 
-        // Check if we can merge the new allocation with the previous space
-        if ((current_offset + sizeof(size_t) + current_block->remaining) == new_block_offset) {
-            current_block->remaining += sizeof(size_t) + new_block->remaining;
-            current_block->next = new_block->next;
-        } else {
-            current_block->next = new_block_offset;
-        }
+static inline data_block_t *next_block_of(data_block_t *block) {
+    return (data_block_t *)(((void *)block) + block_size(block));
+}
+
+static inline void set_footer(data_block_t *block) {
+    *((size_t *)(((void *)block) + block_size(block) - sizeof(size_t))) = block_size(block);
+}
+
+void init_allocator(void *fsptr, alloc_stats_t *stats, fs_offset heap_start, size_t fssize) {
+    allocator_t *alloc = get_allocator(fsptr);
+
+    memset(alloc, 0, sizeof(allocator_t));
+    alloc->heap_start = (heap_start + ALLOC_ALIGN - 1) & ~(ALLOC_ALIGN - 1);
+    alloc->heap_end = (fssize - ALLOC_HEADER) & ~(ALLOC_ALIGN - 1);
+
+    // The end sentinel looks like an allocated block to the block in front of it
+    data_block_t *sentinel = offset_to_pointer(fsptr, alloc->heap_end);
+    sentinel->header = ALLOC_IN_USE;
+
+    // Everything in between is one free block; nothing lies in front of it
+    data_block_t *block = offset_to_pointer(fsptr, alloc->heap_start);
+    block->header = (alloc->heap_end - alloc->heap_start) | ALLOC_PREV_IN_USE;
+    set_footer(block);
+    insert_free_block(fsptr, stats, block);
+}
+
+void grow_allocator(void *fsptr, alloc_stats_t *stats, size_t fssize) {
+    allocator_t *alloc = get_allocator(fsptr);
+    fs_offset heap_end = (fssize - ALLOC_HEADER) & ~(ALLOC_ALIGN - 1);
+
+    if ((heap_end < alloc->heap_end) || (heap_end - alloc->heap_end < ALLOC_MIN_BLOCK)) {
+        return;
+    }
+
+    // The new memory was never used, its sentinel needs no saving
+    data_block_t *sentinel = offset_to_pointer(fsptr, heap_end);
+    sentinel->header = ALLOC_IN_USE;
+    dirty_mark(fsptr, sentinel, ALLOC_HEADER);
+
+    // The old sentinel becomes an allocated block over the new memory, which
+    // freeing merges with a free block in front of it
+    data_block_t *block = offset_to_pointer(fsptr, alloc->heap_end);
+    journal_log(fsptr, block, ALLOC_HEADER);
+    block->header = (heap_end - alloc->heap_end) | ALLOC_IN_USE | (block->header & ALLOC_PREV_IN_USE);
+    journal_log(fsptr, &alloc->heap_end, sizeof(fs_offset));
+    alloc->heap_end = heap_end;
+    fs_totals_t *totals = &((superblock_t *)fsptr)->totals;
+    journal_log(fsptr, &totals->used_blocks, sizeof(size_t));
+    totals->used_blocks++;
+    free_impl(fsptr, stats, ((void *)block) + ALLOC_HEADER);
+}
+
+void size_to_list(size_t size, size_t *fl, size_t *sl) {
+    size_t msb = ((size_t)63) - ((size_t)__builtin_clzl(size));
+
+    *fl = msb - ALLOC_FL_SHIFT;
+    *sl = (size >> (msb - ALLOC_SL_LOG2)) & (ALLOC_SL_COUNT - 1);
+}
+
+void insert_free_block(void *fsptr, alloc_stats_t *stats, data_block_t *block) {
+    allocator_t *alloc = get_allocator(fsptr);
+    size_t fl, sl;
+
+    size_to_list(block_size(block), &fl, &sl);
+
+    // Push the block onto the head of its list
+    fs_offset block_offset = pointer_to_offset(fsptr, block);
+    fs_offset head = alloc->free_lists[fl][sl];
+    journal_log(fsptr, block, sizeof(data_block_t));
+    block->next = head;
+    block->prev = 0;
+    if (head != 0) {
+        journal_log(fsptr, offset_to_pointer(fsptr, head), sizeof(data_block_t));
+        ((data_block_t *)offset_to_pointer(fsptr, head))->prev = block_offset;
     }
+    journal_log(fsptr, &alloc->free_lists[fl][sl], sizeof(fs_offset));
+    alloc->free_lists[fl][sl] = block_offset;
+    __atomic_fetch_add(&stats->list_ops, 1, __ATOMIC_RELAXED);
+
+    // free_bytes and free_blocks sit next to each other
+    fs_totals_t *totals = &((superblock_t *)fsptr)->totals;
+    journal_log(fsptr, &totals->free_bytes, 2 * sizeof(size_t));
+    totals->free_bytes += block_size(block);
+    totals->free_blocks++;
+
+    // The list is non-empty now
+    journal_log(fsptr, &alloc->fl_bitmap, sizeof(uint64_t));
+    journal_log(fsptr, &alloc->sl_bitmap[fl], sizeof(uint32_t));
+    alloc->fl_bitmap |= ((uint64_t)1) << fl;
+    alloc->sl_bitmap[fl] |= ((uint32_t)1) << sl;
 }
 
-void extend_avail_block(void *fsptr, data_block_t *before_avail,
-                        data_block_t *org_avail, fs_offset avail_off,
-                        size_t *size) {
-    data_block_t *avail = offset_to_pointer(fsptr, avail_off);
-    data_block_t *temp;
+void remove_free_block(void *fsptr, alloc_stats_t *stats, data_block_t *block) {
+    allocator_t *alloc = get_allocator(fsptr);
+    size_t fl, sl;
 
-    // Check if all size bytes can be accommodated in the available block
-    if (avail->remaining >= *size) {
-        // Check if an AllocateFrom object can be created with the remaining space
-        if (avail->remaining > *size + sizeof(data_block_t)) {
-            // Create a new AllocateFrom object
-            temp = ((void *)avail) + *size;
-            temp->remaining = avail->remaining - *size;
-            temp->next = avail->next;
+    size_to_list(block_size(block), &fl, &sl);
 
-            // Update original available block with final total size
-            org_avail->remaining += *size;
+    // The links and the footer get overwritten once the block is in use
+    journal_log(fsptr, block, sizeof(data_block_t));
+    journal_log(fsptr, ((void *)next_block_of(block)) - sizeof(size_t), sizeof(size_t));
 
-            // Update pointers to add temp into the list of free blocks
-            before_avail->next = avail_off + *size;
-        }
-        // Not enough space to create a new AllocateFrom object
-        else {
-            // Add the entire remaining space of the available block to the original one
-            org_avail->remaining += avail->remaining;
+    // Unlink the block from its neighbours in the list
+    if (block->prev != 0) {
+        journal_log(fsptr, offset_to_pointer(fsptr, block->prev), sizeof(data_block_t));
+        ((data_block_t *)offset_to_pointer(fsptr, block->prev))->next = block->next;
+    } else {
+        journal_log(fsptr, &alloc->free_lists[fl][sl], sizeof(fs_offset));
+        alloc->free_lists[fl][sl] = block->next;
+    }
+    if (block->next != 0) {
+        journal_log(fsptr, offset_to_pointer(fsptr, block->next), sizeof(data_block_t));
+        ((data_block_t *)offset_to_pointer(fsptr, block->next))->prev = block->prev;
+    }
 
-            // Update pointers to skip the available block
-            before_avail->next = avail->next;
+    fs_totals_t *totals = &((superblock_t *)fsptr)->totals;
+    journal_log(fsptr, &totals->free_bytes, 2 * sizeof(size_t));
+    totals->free_bytes -= block_size(block);
+    totals->free_blocks--;
+    __atomic_fetch_add(&stats->list_ops, 1, __ATOMIC_RELAXED);
+
+    // Clear the bitmaps if the list became empty
+    if (alloc->free_lists[fl][sl] == 0) {
+        journal_log(fsptr, &alloc->fl_bitmap, sizeof(uint64_t));
+        journal_log(fsptr, &alloc->sl_bitmap[fl], sizeof(uint32_t));
+        alloc->sl_bitmap[fl] &= ~(((uint32_t)1) << sl);
+        if (alloc->sl_bitmap[fl] == 0) {
+            alloc->fl_bitmap &= ~(((uint64_t)1) << fl);
         }
-        // Reset size as all space is allocated from the available block
-        *size = ((fs_offset)0);
     }
-    // Not enough space in the available block, allocate as much as possible
-    else {
-        // Add the entire remaining space of the available block to the original one
-        org_avail->remaining += avail->remaining;
+}
 
-        // Update pointers to skip the available block
-        before_avail->next = avail->next;
+void add_to_free_memory(void *fsptr, alloc_stats_t *stats, data_block_t *block, int prev_in_use) {
+    size_t size = block_size(block);
+    data_block_t *next = next_block_of(block);
 
-        // Update size to reflect the amount of space allocated from the available block
-        *size -= avail->remaining;
+    // Merge with the block behind, if it is free
+    if (!(next->header & ALLOC_IN_USE)) {
+        remove_free_block(fsptr, stats, next);
+        size += block_size(next);
     }
-}
 
-void *get_memory_block(void *fsptr, list_t *ll, data_block_t *selected_block,
-                     size_t *size) {
-    fs_offset selected_block_offset = ((fs_offset)0);  // Offset for the selected space
-    fs_offset before_current_offset;  // Offset before the current space
-    data_block_t *before_current_block;  // Pointer to the block before the current space
-    fs_offset current_offset;  // Offset of the current space
-    data_block_t *current_block;  // Pointer to the current space
-    data_block_t *before_largest_block = NULL;  // Pointer to the block before the largest block
-    fs_offset largest_offset;  // Offset of the largest block
-    data_block_t *largest_block;  // Pointer to the largest block
-    size_t largest_size;  // Size of the largest block
-    data_block_t *allocated_block = NULL;  // Pointer to the allocated memory block
+    // Merge with the block in front, if it is free: its footer gives its start
+    if (!prev_in_use) {
+        size_t prev_size = *((size_t *)(((void *)block) - sizeof(size_t)));
+        data_block_t *prev = (data_block_t *)(((void *)block) - prev_size);
+        remove_free_block(fsptr, stats, prev);
+        size += prev_size;
+        block = prev;
+        prev_in_use = (block->header & ALLOC_PREV_IN_USE) != 0;
+    }
 
-    before_current_offset = ll->head;
+    // Blocks in front of a free block are always allocated; the footer is
+    // the last word of the block, the header of the block behind follows it
+    journal_log(fsptr, block, ALLOC_HEADER);
+    journal_log(fsptr, ((void *)block) + size - sizeof(size_t), 2 * sizeof(size_t));
+    block->header = size | (prev_in_use ? ALLOC_PREV_IN_USE : 0);
+    set_footer(block);
+    insert_free_block(fsptr, stats, block);
 
-    // If no space is available, return NULL
-    if (!before_current_offset) {
-        return NULL;
+    // Tell the block behind that its neighbour is free
+    next_block_of(block)->header &= ~ALLOC_PREV_IN_USE;
+}
+
+// Cuts a block down to size, freeing the tail if it is large enough to make a block
+static void split_block(void *fsptr, alloc_stats_t *stats, data_block_t *block, size_t size) {
+    size_t total = block_size(block);
+
+    if (total - size >= ALLOC_MIN_BLOCK) {
+        journal_log(fsptr, block, ALLOC_HEADER);
+        journal_log(fsptr, ((void *)block) + size, ALLOC_HEADER);
+        block->header = size | (block->header & ALLOC_FLAGS);
+        data_block_t *rest = next_block_of(block);
+        rest->header = total - size;
+        add_to_free_memory(fsptr, stats, rest, 1);
     }
+}
+
+// Takes a free block off its list and hands out size bytes of it, header included
+static data_block_t *claim_block(void *fsptr, alloc_stats_t *stats, data_block_t *block, size_t size) {
+    remove_free_block(fsptr, stats, block);
 
-    // Ensure the minimum size is sizeof(data_block_t)
-    if (*size < sizeof(data_block_t)) {
-        *size = sizeof(data_block_t);
+    // Mark the block as allocated, also for the block behind it
+    journal_log(fsptr, block, ALLOC_HEADER);
+    journal_log(fsptr, next_block_of(block), ALLOC_HEADER);
+    block->header |= ALLOC_IN_USE;
+    next_block_of(block)->header |= ALLOC_PREV_IN_USE;
+    fs_totals_t *totals = &((superblock_t *)fsptr)->totals;
+    journal_log(fsptr, &totals->used_blocks, sizeof(size_t));
+    totals->used_blocks++;
+    split_block(fsptr, stats, block, size);
+
+    return block;
+}
+
+data_block_t *get_memory_block(void *fsptr, alloc_stats_t *stats, size_t size) {
+    allocator_t *alloc = get_allocator(fsptr);
+    size_t fl, sl;
+
+    // No block can be larger than the heap
+    if (size > (alloc->heap_end - alloc->heap_start)) {
+        return NULL;
     }
 
-    // Check if a selected space is specified
-    if (((void *)selected_block) != fsptr)  {
-        // Calculate the offset for the selected space
-        selected_block_offset = pointer_to_offset(fsptr, selected_block) + sizeof(size_t) + selected_block->remaining;
-        // If the selected space is at the head of the list, extend it
-        if (selected_block_offset == before_current_offset) {
-            extend_avail_block(fsptr, ((void *)ll) - sizeof(size_t), selected_block, selected_block_offset, size);
-            if (*size == ((size_t)0)) {
-                return NULL;
-            }
+    // Round up to the next list boundary: every block of that list fits
+    size_t msb = ((size_t)63) - ((size_t)__builtin_clzl(size));
+    size_t rounded = size + (((size_t)1) << (msb - ALLOC_SL_LOG2)) - 1;
+    size_to_list(rounded, &fl, &sl);
+
+    // First non-empty list of this first level at or above sl, else of a larger first level
+    uint32_t sl_map = (sl < ((size_t)ALLOC_SL_COUNT)) ? (alloc->sl_bitmap[fl] & (~((uint32_t)0) << sl)) : 0;
+    if (sl_map == 0) {
+        uint64_t fl_map = (fl + 1 < ((size_t)ALLOC_FL_COUNT)) ? (alloc->fl_bitmap & (~((uint64_t)0) << (fl + 1))) : 0;
+        if (fl_map == 0) {
+            return NULL;  // The system is out of memory
         }
+        fl = (size_t)__builtin_ctzll(fl_map);
+        sl_map = alloc->sl_bitmap[fl];
     }
+    sl = (size_t)__builtin_ctz(sl_map);
 
-    // Initialize the largest block to the first available block
-    before_current_offset = ll->head;
-    before_current_block = offset_to_pointer(fsptr, before_current_offset);
-    largest_offset = before_current_offset;
-    largest_block = before_current_block;
-    largest_size = before_current_block->remaining;
-    current_offset = before_current_block->next;
+    return claim_block(fsptr, stats, offset_to_pointer(fsptr, alloc->free_lists[fl][sl]), size);
+}
 
-    // Iterate through the list to find the largest available block
-    while (current_offset != ((fs_offset)0)) {
-        current_block = offset_to_pointer(fsptr, current_offset);
-        if ((selected_block_offset == current_offset) || (current_block->remaining > largest_size)) {
-            if (selected_block_offset == current_offset) {
-                extend_avail_block(fsptr, before_current_block, selected_block, selected_block_offset, size);
-                if (*size == ((fs_offset)0)) {
-                    break;
+data_block_t *get_memory_block_below(void *fsptr, alloc_stats_t *stats, size_t size, fs_offset limit) {
+    allocator_t *alloc = get_allocator(fsptr);
+    data_block_t *lowest = NULL;
+    size_t fl, sl;
+
+    // Walk every list that may hold a block of the size, from its own on
+    size_to_list(size, &fl, &sl);
+    for (; fl < ((size_t)ALLOC_FL_COUNT); fl++, sl = 0) {
+        uint32_t sl_map = alloc->sl_bitmap[fl] & (~((uint32_t)0) << sl);
+        for (; sl_map != 0; sl_map &= sl_map - 1) {
+            fs_offset block_offset = alloc->free_lists[fl][__builtin_ctz(sl_map)];
+            while (block_offset != 0) {
+                data_block_t *block = offset_to_pointer(fsptr, block_offset);
+                if ((block_offset < limit) && (block_size(block) >= size) &&
+                    ((lowest == NULL) || (block < lowest))) {
+                    lowest = block;
                 }
-            } else {
-                before_largest_block = before_current_block;
-                largest_offset = current_offset;
-                largest_block = current_block;
-                largest_size = current_block->remaining;
-            }
-        }
-        before_current_offset = current_offset;
-        before_current_block = current_block;
-        current_offset = current_block->next;
-    }
-
-    // Allocate memory from the largest block
-    if ((*size != ((fs_offset)0)) && (largest_block != NULL)) {
-        allocated_block = largest_block;
-        if (largest_block->remaining >= *size) {
-            if (largest_block->remaining > *size + sizeof(data_block_t)) {
-                data_block_t *temp_block = ((void *)largest_block) + sizeof(size_t) + *size;
-                temp_block->remaining = largest_block->remaining - *size - sizeof(size_t);
-                temp_block->next = largest_block->next;
-                if (before_largest_block == NULL) {
-                    ll->head = largest_offset + *size + sizeof(size_t);
-                } else {
-                    before_largest_block->next = largest_offset + *size + sizeof(size_t);
-                }
-                allocated_block->remaining = *size;
-            } else {
-                if (before_largest_block != NULL) {
-                    before_largest_block->next = largest_block->next;
-                } else {
-                    ll->head = ((fs_offset)0);  // The system is out of memory
-                }
-            }
-            *size = ((fs_offset)0);
-        } else {
-            if (before_largest_block == NULL) {
-                // The system has used all available memory and still not enough
-                return NULL;
-            } else {
-                before_largest_block->next = largest_block->next;
-                *size -= largest_block->remaining;
+                block_offset = block->next;
             }
         }
     }
 
-    // Return the allocated memory block
-    if (allocated_block == NULL) {
+    return (lowest != NULL) ? claim_block(fsptr, stats, lowest, size) : NULL;
+}
+
+// Total block size needed to hand out size bytes
+static size_t request_to_block_size(size_t size) {
+    size_t total = (size + ALLOC_HEADER + ALLOC_ALIGN - 1) & ~(ALLOC_ALIGN - 1);
+
+    // Check for overflow
+    if (total < size) {
+        return ~((size_t)0) & ~(ALLOC_ALIGN - 1);
+    }
+    return total < ALLOC_MIN_BLOCK ? ALLOC_MIN_BLOCK : total;
+}
+
+size_t usable_size(void *fsptr, void *ptr) {
+    // Nothing is allocated for NULL
+    if ((ptr == NULL) || (ptr == fsptr)) {
+        return 0;
+    }
+    return block_size((data_block_t *)(ptr - ALLOC_HEADER)) - ALLOC_HEADER;
+}
+
+void *malloc_impl(void *fsptr, alloc_stats_t *stats, size_t *size) {
+    // If size is zero, return NULL
+    if (*size == ((size_t)0)) {
+        return NULL;
+    }
+    __atomic_fetch_add(&stats->malloc_calls, 1, __ATOMIC_RELAXED);
+
+    data_block_t *block = get_memory_block(fsptr, stats, request_to_block_size(*size));
+    if (block == NULL) {
         return NULL;
     }
-    return ((void *)allocated_block) + sizeof(size_t);  // Adjust pointer to skip the size_t header
+
+    *size = ((size_t)0);
+    return ((void *)block) + ALLOC_HEADER;  // Adjust pointer to skip the header
 }
 
-void *malloc_impl(void *fsptr, void *selected_ptr, size_t *size) {
+void *malloc_aligned_impl(void *fsptr, alloc_stats_t *stats, size_t alignment, size_t *size) {
     // If size is zero, return NULL
     if (*size == ((size_t)0)) {
         return NULL;
     }
+    __atomic_fetch_add(&stats->malloc_calls, 1, __ATOMIC_RELAXED);
+
+    // Ask for enough to find an aligned start with room for a free block in front
+    size_t needed = request_to_block_size(*size);
+    if (needed > ~((size_t)0) - alignment - ALLOC_MIN_BLOCK) {
+        return NULL;
+    }
+    data_block_t *block = get_memory_block(fsptr, stats, needed + alignment + ALLOC_MIN_BLOCK);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    // The gap in front of the aligned start is either empty or makes a block
+    fs_offset payload = pointer_to_offset(fsptr, block) + ALLOC_HEADER;
+    fs_offset aligned = (payload + alignment - 1) & ~(alignment - 1);
+    if ((aligned != payload) && (aligned - payload < ALLOC_MIN_BLOCK)) {
+        aligned += alignment;
+    }
 
-    // If selected pointer is NULL, set it to the beginning of the file system
-    if (selected_ptr == NULL) {
-        selected_ptr = fsptr + sizeof(size_t);
+    // Give the gap back to the free lists
+    if (aligned != payload) {
+        int prev_in_use = (block->header & ALLOC_PREV_IN_USE) != 0;
+        data_block_t *moved = offset_to_pointer(fsptr, aligned - ALLOC_HEADER);
+        journal_log(fsptr, moved, ALLOC_HEADER);
+        journal_log(fsptr, block, ALLOC_HEADER);
+        moved->header = (block_size(block) - (aligned - payload)) | ALLOC_IN_USE;
+        block->header = aligned - payload;
+        add_to_free_memory(fsptr, stats, block, prev_in_use);
+        block = moved;
     }
+    split_block(fsptr, stats, block, needed);
 
-    // Call get_memory_block to allocate memory block
-    return get_memory_block(fsptr, get_free_memory_pointer(fsptr),
-                            selected_ptr - sizeof(size_t), size);
+    *size = ((size_t)0);
+    return ((void *)block) + ALLOC_HEADER;
 }
 
-void *realloc_impl(void *fsptr, void *orig_ptr, size_t *size) {
+void *realloc_impl(void *fsptr, alloc_stats_t *stats, void *orig_ptr, size_t *size) {
+    __atomic_fetch_add(&stats->realloc_calls, 1, __ATOMIC_RELAXED);
+
     // If size is 0, free the original pointer and return NULL
     if (*size == ((size_t)0)) {
-        free_impl(fsptr, orig_ptr);
+        free_impl(fsptr, stats, orig_ptr);
         return NULL;
     }
 
-    list_t *ll = get_free_memory_pointer(fsptr);
-
     // If orig_ptr is NULL, allocate memory equivalent to a call to malloc(size)
-    if (orig_ptr == fsptr) {
-        // Allocate memory with malloc for size bytes
-        return get_memory_block(fsptr, ll, fsptr, size);
-    }
-
-    // Calculate the data block pointer
-    data_block_t *alloc = (data_block_t *)((void *)orig_ptr - sizeof(size_t));
-    data_block_t *temp;
-    void *new_ptr = NULL;
-
-    // If the new size is less than the original size but not enough to create a new memory block
-    if ((alloc->remaining >= *size) && (alloc->remaining < (*size + sizeof(data_block_t)))) {
-        // Keep the original memory block
-        new_ptr = orig_ptr;
-    }
-    // If the new size is less than the original size and enough to create a new memory block
-    else if (alloc->remaining > *size) {
-        // Create a new memory block for the remaining memory
-        temp = (data_block_t *)(orig_ptr + *size);
-        temp->remaining = alloc->remaining - *size - sizeof(size_t);
-        temp->next = 0;  // Offset of zero
-        add_to_free_memory(fsptr, ll, temp);
-        // Update the remaining space
-        alloc->remaining = *size;
-        // Keep the original memory block
-        new_ptr = orig_ptr;
-    }
-    // If the new size is greater than the original size
-    else {
-        // Allocate a new memory block
-        new_ptr = get_memory_block(fsptr, ll, fsptr, size);
-        // Check if memory allocation failed
-        if (*size == 0) {
-            return NULL;
-        }
-        // Copy contents of the original memory block to the new memory block
-        memcpy(new_ptr, orig_ptr, alloc->remaining);
-        // Free the original memory block
-        add_to_free_memory(fsptr, ll, alloc);
+    if ((orig_ptr == NULL) || (orig_ptr == fsptr)) {
+        return malloc_impl(fsptr, stats, size);
+    }
+
+    data_block_t *block = (data_block_t *)(orig_ptr - ALLOC_HEADER);
+    size_t needed = request_to_block_size(*size);
+    size_t total = block_size(block);
+
+    // Shrinking, or growing within the rounding: cut the block in place
+    if (needed <= total) {
+        split_block(fsptr, stats, block, needed);
+        *size = ((size_t)0);
+        return orig_ptr;
+    }
+
+    // Growing: first try to take over the free block behind
+    data_block_t *next = next_block_of(block);
+    if ((!(next->header & ALLOC_IN_USE)) && (total + block_size(next) >= needed)) {
+        remove_free_block(fsptr, stats, next);
+        journal_log(fsptr, block, ALLOC_HEADER);
+        journal_log(fsptr, ((void *)next) + block_size(next), ALLOC_HEADER);
+        block->header += block_size(next);
+        next_block_of(block)->header |= ALLOC_PREV_IN_USE;
+        split_block(fsptr, stats, block, needed);
+        *size = ((size_t)0);
+        return orig_ptr;
+    }
+
+    // Allocate a new memory block
+    size_t new_size = *size;
+    void *new_ptr = malloc_impl(fsptr, stats, &new_size);
+    // Check if memory allocation failed (*size is only reset on success)
+    if (new_ptr == NULL) {
+        return NULL;
     }
 
+    // Copy contents of the original memory block to the new memory block
+    memcpy(new_ptr, orig_ptr, total - ALLOC_HEADER);
+    __atomic_fetch_add(&stats->realloc_moved, total - ALLOC_HEADER, __ATOMIC_RELAXED);
+    dirty_mark(fsptr, new_ptr, total - ALLOC_HEADER);
+    // Free the original memory block
+    free_impl(fsptr, stats, orig_ptr);
+
+    *size = ((size_t)0);
     return new_ptr;
 }
 
-void free_impl(void *fsptr, void *ptr) {
+size_t free_memory_size(void *fsptr) {
+    return ((superblock_t *)fsptr)->totals.free_bytes;
+}
+
+size_t largest_free_block(void *fsptr) {
+    allocator_t *alloc = get_allocator(fsptr);
+    size_t largest = 0;
+
+    if (alloc->fl_bitmap == 0) {
+        return 0;
+    }
+
+    // Every block of the highest non-empty list is larger than all blocks of the others
+    size_t fl = ((size_t)63) - ((size_t)__builtin_clzll(alloc->fl_bitmap));
+    size_t sl = ((size_t)31) - ((size_t)__builtin_clz(alloc->sl_bitmap[fl]));
+    for (fs_offset block_offset = alloc->free_lists[fl][sl]; block_offset != 0;) {
+        data_block_t *block = offset_to_pointer(fsptr, block_offset);
+        largest = block_size(block) > largest ? block_size(block) : largest;
+        block_offset = block->next;
+    }
+
+    return largest;
+}
+
+unsigned int free_fragmentation(void *fsptr) {
+    size_t free_bytes = ((superblock_t *)fsptr)->totals.free_bytes;
+    size_t largest = largest_free_block(fsptr);
+
+    return (free_bytes == 0) ? 0 : (unsigned int)(1000 - (largest * 1000) / free_bytes);
+}
+
+void free_impl(void *fsptr, alloc_stats_t *stats, void *ptr) {
     // If ptr is NULL, do nothing
-    if (ptr == NULL) {
+    if ((ptr == NULL) || (ptr == fsptr)) {
+        return;
+    }
+    __atomic_fetch_add(&stats->free_calls, 1, __ATOMIC_RELAXED);
+
+    // Step back from the pointer to the block header
+    data_block_t *block = (data_block_t *)(ptr - ALLOC_HEADER);
+    int prev_in_use = (block->header & ALLOC_PREV_IN_USE) != 0;
+    journal_log(fsptr, block, ALLOC_HEADER);
+    block->header &= ~ALLOC_FLAGS;
+    fs_totals_t *totals = &((superblock_t *)fsptr)->totals;
+    journal_log(fsptr, &totals->used_blocks, sizeof(size_t));
+    totals->used_blocks--;
+    add_to_free_memory(fsptr, stats, block, prev_in_use);
+}
+
+// Slabs keep their objects behind the header
+static inline void *slab_objects(slab_t *slab) {
+    return ((void *)slab) + SLAB_HEADER;
+}
+
+static void slab_list_insert(void *fsptr, slab_cache_t *cache, slab_t *slab) {
+    fs_offset slab_offset = pointer_to_offset(fsptr, slab);
+
+    journal_log(fsptr, slab, sizeof(slab_t));
+    slab->next = cache->partial;
+    slab->prev = 0;
+    if (cache->partial != 0) {
+        journal_log(fsptr, offset_to_pointer(fsptr, cache->partial), sizeof(slab_t));
+        ((slab_t *)offset_to_pointer(fsptr, cache->partial))->prev = slab_offset;
+    }
+    journal_log(fsptr, cache, sizeof(slab_cache_t));
+    cache->partial = slab_offset;
+}
+
+static void slab_list_remove(void *fsptr, slab_cache_t *cache, slab_t *slab) {
+    if (slab->prev != 0) {
+        journal_log(fsptr, offset_to_pointer(fsptr, slab->prev), sizeof(slab_t));
+        ((slab_t *)offset_to_pointer(fsptr, slab->prev))->next = slab->next;
+    } else {
+        journal_log(fsptr, cache, sizeof(slab_cache_t));
+        cache->partial = slab->next;
+    }
+    if (slab->next != 0) {
+        journal_log(fsptr, offset_to_pointer(fsptr, slab->next), sizeof(slab_t));
+        ((slab_t *)offset_to_pointer(fsptr, slab->next))->prev = slab->prev;
+    }
+}
+
+void init_slabs(void *fsptr) {
+    superblock_t *sb = (superblock_t *)fsptr;
+    size_t object_sizes[SLAB_KINDS] = {sizeof(inode_t)};
+
+    for (size_t kind = 0; kind < ((size_t)SLAB_KINDS); kind++) {
+        slab_cache_t *cache = &sb->slabs[kind];
+        cache->object_size = object_sizes[kind];
+        cache->objects_per_slab = (SLAB_SIZE - ALLOC_HEADER - SLAB_HEADER) / object_sizes[kind];
+        if (cache->objects_per_slab > SLAB_MAX_OBJECTS) {
+            cache->objects_per_slab = SLAB_MAX_OBJECTS;
+        }
+        cache->partial = 0;
+    }
+}
+
+slab_t *slab_of(void *fsptr, void *object) {
+    return offset_to_pointer(fsptr, pointer_to_offset(fsptr, object) & ~(SLAB_SIZE - 1));
+}
+
+void *slab_alloc(void *fsptr, alloc_stats_t *stats, int kind, void *hint) {
+    slab_cache_t *cache = &((superblock_t *)fsptr)->slabs[kind];
+    slab_t *slab = NULL;
+
+    // Prefer the slab of the hint, then any slab with free objects
+    if (hint != NULL) {
+        slab = slab_of(fsptr, hint);
+        if ((slab->kind != ((uint32_t)kind)) || (slab->num_used >= cache->objects_per_slab)) {
+            slab = NULL;
+        }
+    }
+    if ((slab == NULL) && (cache->partial != 0)) {
+        slab = offset_to_pointer(fsptr, cache->partial);
+    }
+
+    // Carve a new slab out of the heap; its allocator header ends the previous
+    // SLAB_SIZE window, so consecutive slabs can sit back to back
+    if (slab == NULL) {
+        size_t ask_size = SLAB_SIZE - ALLOC_HEADER;
+        slab = malloc_aligned_impl(fsptr, stats, SLAB_SIZE, &ask_size);
+        if (slab == NULL) {
+            return NULL;
+        }
+        memset(slab, 0, sizeof(slab_t));
+        slab->kind = (uint32_t)kind;
+        dirty_mark(fsptr, slab, sizeof(slab_t));
+        slab_list_insert(fsptr, cache, slab);
+    }
+
+    // Take the lowest free object; all objects below objects_per_slab, so a
+    // non-full slab always has one there
+    size_t word = (~slab->used[0] != 0) ? 0 : 1;
+    size_t bit = (size_t)__builtin_ctzll(~slab->used[word]);
+    journal_log(fsptr, slab, sizeof(slab_t));
+    slab->used[word] |= ((uint64_t)1) << bit;
+    slab->num_used++;
+    size_t *num_objects = &((superblock_t *)fsptr)->totals.num_objects[kind];
+    journal_log(fsptr, num_objects, sizeof(size_t));
+    (*num_objects)++;
+    if (slab->num_used == cache->objects_per_slab) {
+        slab_list_remove(fsptr, cache, slab);
+    }
+
+    return slab_objects(slab) + ((word * 64) + bit) * cache->object_size;
+}
+
+void slab_free(void *fsptr, alloc_stats_t *stats, void *object) {
+    // If object is NULL, do nothing
+    if ((object == NULL) || (object == fsptr)) {
         return;
     }
 
-    // Adjust ptr by size_t to start on the size of pointer
-    add_to_free_memory(fsptr, get_free_memory_pointer(fsptr), ptr - sizeof(size_t));
+    slab_t *slab = slab_of(fsptr, object);
+    slab_cache_t *cache = &((superblock_t *)fsptr)->slabs[slab->kind];
+    size_t index = ((size_t)(object - slab_objects(slab))) / cache->object_size;
+
+    // A full slab gets room again
+    if (slab->num_used == cache->objects_per_slab) {
+        slab_list_insert(fsptr, cache, slab);
+    }
+    journal_log(fsptr, slab, sizeof(slab_t));
+    slab->used[index / 64] &= ~(((uint64_t)1) << (index % 64));
+    slab->num_used--;
+    size_t *num_objects = &((superblock_t *)fsptr)->totals.num_objects[slab->kind];
+    journal_log(fsptr, num_objects, sizeof(size_t));
+    (*num_objects)--;
+
+    // Give empty slabs back, but keep the last one around so that a single
+    // create/delete cycle does not allocate and free a slab each time
+    if ((slab->num_used == 0) && ((slab->next != 0) || (slab->prev != 0))) {
+        slab_list_remove(fsptr, cache, slab);
+        free_impl(fsptr, stats, slab);
+    }
 }
 
 /* (2) END memory allocation implementation*/
@@ -538,504 +816,1907 @@ fs_offset pointer_to_offset (void *fsptr, void *pointer) {
 void *offset_to_pointer (void *fsptr, fs_offset my_offset){
       void *pointer = fsptr + my_offset;
 
-      // Check for overflow
-      if (pointer < fsptr){
-            return NULL;      
-      }
-      return pointer;
-}
+      // Check for overflow
+      if (pointer < fsptr){
+            return NULL;      
+      }
+      return pointer;
+}
+
+allocator_t *get_allocator(void *fsptr) {
+  return &((superblock_t *)fsptr)->allocator;
+}
+
+// Bits of the pages from first up to last that live in word of the dirty map
+static inline uint64_t dirty_word_mask(size_t word, size_t first, size_t last) {
+    uint64_t mask = ~((uint64_t)0);
+
+    if (word == first / 64) {
+        mask &= ~((uint64_t)0) << (first % 64);
+    }
+    if (word == last / 64) {
+        mask &= ~((uint64_t)0) >> (63 - (last % 64));
+    }
+    return mask;
+}
+
+void dirty_mark(void *fsptr, void *ptr, size_t size) {
+    superblock_t *sb = (superblock_t *)fsptr;
+
+    // Nothing is tracked before the map is set up on the first mount
+    if ((size == ((size_t)0)) || (sb->dirty_map == 0)) {
+        return;
+    }
+
+    uint64_t *map = offset_to_pointer(fsptr, sb->dirty_map);
+    fs_offset start = pointer_to_offset(fsptr, ptr);
+    size_t first = start >> DIRTY_PAGE_SHIFT;
+    size_t last = (start + size - 1) >> DIRTY_PAGE_SHIFT;
+
+    // Pages are mostly marked already, so only write to the map if that changes it
+    for (size_t word = first / 64; word <= last / 64; word++) {
+        uint64_t mask = dirty_word_mask(word, first, last);
+        if ((__atomic_load_n(&map[word], __ATOMIC_RELAXED) & mask) != mask) {
+            __atomic_fetch_or(&map[word], mask, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int dirty_take(void *fsptr, fs_offset start, size_t size, size_t **rangesptr, size_t *countptr,
+               size_t *capacityptr) {
+    superblock_t *sb = (superblock_t *)fsptr;
+
+    if ((size == ((size_t)0)) || (sb->dirty_map == 0)) {
+        return 1;
+    }
+
+    uint64_t *map = offset_to_pointer(fsptr, sb->dirty_map);
+    size_t first = start >> DIRTY_PAGE_SHIFT;
+    size_t last = (start + size - 1) >> DIRTY_PAGE_SHIFT;
+
+    for (size_t word = first / 64; word <= last / 64; word++) {
+        uint64_t mask = dirty_word_mask(word, first, last);
+        if ((__atomic_load_n(&map[word], __ATOMIC_RELAXED) & mask) == 0) {
+            continue;
+        }
+
+        // A word holds at most 32 runs; make room before clearing any of its bits
+        if (*countptr + 32 > *capacityptr) {
+            size_t capacity = *capacityptr < 64 ? 64 : 2 * (*capacityptr);
+            size_t *ranges = (size_t *)realloc(*rangesptr, 2 * capacity * sizeof(size_t));
+            if (ranges == NULL) {
+                return 0;
+            }
+            *rangesptr = ranges;
+            *capacityptr = capacity;
+        }
+
+        uint64_t bits = __atomic_fetch_and(&map[word], ~mask, __ATOMIC_ACQ_REL) & mask;
+        while (bits != 0) {
+            // Cut the lowest run of set bits off
+            size_t bit = (size_t)__builtin_ctzll(bits);
+            uint64_t shifted = bits >> bit;
+            size_t run = (~shifted == 0) ? 64 - bit : (size_t)__builtin_ctzll(~shifted);
+            bits &= ~((run == 64 ? ~((uint64_t)0) : ((((uint64_t)1) << run) - 1)) << bit);
+
+            fs_offset offset = ((word * 64) + bit) << DIRTY_PAGE_SHIFT;
+            size_t length = run << DIRTY_PAGE_SHIFT;
+            size_t *ranges = *rangesptr;
+            if ((*countptr > 0) && (ranges[2 * (*countptr) - 2] + ranges[2 * (*countptr) - 1] == offset)) {
+                ranges[2 * (*countptr) - 1] += length;
+            } else {
+                ranges[2 * (*countptr)] = offset;
+                ranges[2 * (*countptr) + 1] = length;
+                (*countptr)++;
+            }
+        }
+    }
+
+    return 1;
+}
+
+// Records of a journal start right behind its header
+static inline void *journal_records(journal_t *journal) {
+    return ((void *)journal) + sizeof(journal_t);
+}
+
+void journal_log(void *fsptr, void *ptr, size_t size) {
+    superblock_t *sb = (superblock_t *)fsptr;
+
+    // Nothing is journaled before the journal is set up on the first mount
+    if ((size != ((size_t)0)) && (sb->journal != 0)) {
+        journal_t *journal = offset_to_pointer(fsptr, sb->journal);
+        size_t padded = (size + ALLOC_ALIGN - 1) & ~(ALLOC_ALIGN - 1);
+        size_t needed = padded + sizeof(journal_record_t);
+
+        // Steps are bounded and checkpointed, so a record that does not fit is a bug
+        assert(journal->used + needed <= journal->capacity);
+        if (journal->used + needed <= journal->capacity) {
+            void *record = journal_records(journal) + journal->used;
+            memcpy(record, ptr, size);
+            journal_record_t *trailer = record + padded;
+            trailer->offset = pointer_to_offset(fsptr, ptr);
+            trailer->length = size;
+
+            // The record must be complete before it counts, and count before the change is made
+            __atomic_store_n(&journal->used, journal->used + needed, __ATOMIC_RELEASE);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        }
+    }
+
+    dirty_mark(fsptr, ptr, size);
+}
+
+void journal_commit(void *fsptr) {
+    superblock_t *sb = (superblock_t *)fsptr;
+
+    if (sb->journal == 0) {
+        return;
+    }
+
+    journal_t *journal = offset_to_pointer(fsptr, sb->journal);
+    if (journal->used != 0) {
+        // All changes must be made before the records stop counting
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        __atomic_store_n(&journal->used, 0, __ATOMIC_RELEASE);
+
+        // A sync must not leave a stale open transaction in the backup-file
+        dirty_mark(fsptr, journal, sizeof(journal_t));
+    }
+}
+
+void journal_checkpoint(void *fsptr) {
+    superblock_t *sb = (superblock_t *)fsptr;
+
+    if (sb->journal == 0) {
+        return;
+    }
+
+    journal_t *journal = offset_to_pointer(fsptr, sb->journal);
+    if (journal->used > journal->capacity - JOURNAL_STEP_MAX) {
+        journal_commit(fsptr);
+    }
+}
+
+int journal_replay(void *fsptr) {
+    superblock_t *sb = (superblock_t *)fsptr;
+
+    if (sb->journal == 0) {
+        return 1;
+    }
+
+    // A journal too small for a step could not hold the operations' records
+    journal_t *journal = offset_to_pointer(fsptr, sb->journal);
+    if ((journal->capacity < JOURNAL_STEP_MAX) || (journal->used > journal->capacity)) {
+        return 0;
+    }
+
+    // Undo the records newest first, so that a range changed twice gets its oldest bytes back
+    size_t pos = journal->used;
+    while (pos > 0) {
+        if (pos < sizeof(journal_record_t)) {
+            return 0;
+        }
+        journal_record_t *trailer = journal_records(journal) + pos - sizeof(journal_record_t);
+        size_t padded = (trailer->length + ALLOC_ALIGN - 1) & ~(ALLOC_ALIGN - 1);
+        if ((padded < trailer->length) || (padded > pos - sizeof(journal_record_t)) ||
+            (trailer->offset > sb->size) || (trailer->length > sb->size - trailer->offset)) {
+            return 0;
+        }
+        pos -= sizeof(journal_record_t) + padded;
+        memcpy(offset_to_pointer(fsptr, trailer->offset), journal_records(journal) + pos, trailer->length);
+        dirty_mark(fsptr, offset_to_pointer(fsptr, trailer->offset), trailer->length);
+    }
+
+    journal_commit(fsptr);
+    return 1;
+}
+
+void update_time(void *fsptr, inode_t *node, int set_mod) {
+    // If node is NULL, do nothing
+    if (node == NULL) {
+        return;
+    }
+
+    // Get current time
+    struct timespec ts;
+    if (clock_gettime(CLOCK_REALTIME, &ts) == 0) {
+        // Update access time; reads set it with their lock shared, so both fields are
+        // stored on their own, which at worst pairs the seconds of one reader's time
+        // with the nanoseconds of another's
+        __atomic_store_n(&node->time[0].tv_sec, ts.tv_sec, __ATOMIC_RELAXED);
+        __atomic_store_n(&node->time[0].tv_nsec, ts.tv_nsec, __ATOMIC_RELAXED);
+
+        // Update modification time if set_mod is non-zero
+        if (set_mod) {
+            node->time[1] = ts;
+        }
+    }
+
+    // Every change to an inode comes with new times, so this covers the whole inode;
+    // times are not journaled, as reads set them without being serialized
+    dirty_mark(fsptr, node, sizeof(inode_t));
+}
+
+// Size of a dirty map with one bit per page of a filesystem of fssize bytes
+static size_t dirty_map_size(size_t fssize) {
+    size_t pages = (fssize + (((size_t)1) << DIRTY_PAGE_SHIFT) - 1) >> DIRTY_PAGE_SHIFT;
+
+    return ((pages + 63) / 64) * sizeof(uint64_t);
+}
+
+int mount_filesystem(void *fsptr, alloc_stats_t *stats, size_t fssize, size_t block_size) {
+    superblock_t *sb = (superblock_t *)fsptr;
+
+    // If this is the first mount, initialize the superblock
+    if (sb->magic_number != MAGIC_NUMBER) {
+        // The superblock and the root directory must fit
+        if (fssize < MIN_FS_SIZE) {
+            return 0;
+        }
+
+        // Set general stats; the magic number is only set once all is in place
+        memset(sb, 0, sizeof(superblock_t));
+        sb->version = FORMAT_VERSION;
+        sb->size = fssize;
+        sb->block_size = block_size;
+
+        // The journal comes first, the allocator gets the rest. Free memory is
+        // never read before it is written, so none of it gets zeroed: the pages
+        // of a large image are only touched once they are used
+        fs_offset journal_offset = (sizeof(superblock_t) + ALLOC_ALIGN - 1) & ~(ALLOC_ALIGN - 1);
+        size_t journal_size = fssize / 8 < JOURNAL_SIZE_MAX ? fssize / 8 : JOURNAL_SIZE_MAX;
+        journal_size = journal_size > JOURNAL_SIZE_MIN ? journal_size : JOURNAL_SIZE_MIN;
+        journal_t *journal = offset_to_pointer(fsptr, journal_offset);
+        journal->used = 0;
+        journal->capacity = journal_size - sizeof(journal_t);
+        init_allocator(fsptr, stats, journal_offset + journal_size, fssize);
+        init_slabs(fsptr);
+
+        // Keep one bit per page for the syncs; the map itself never needs writing back
+        size_t map_size = dirty_map_size(fssize);
+        size_t map_ask = map_size;
+        uint64_t *map = malloc_impl(fsptr, stats, &map_ask);
+
+        // Save space for the root directory and its children
+        inode_t *root = slab_alloc(fsptr, stats, SLAB_INODE, NULL);
+        if ((map == NULL) || (root == NULL)) {
+            return 0;
+        }
+        sb->root_directory = pointer_to_offset(fsptr, root); // Store only the offset
+
+        // Set up the root directory
+        root->name_len = ((uint8_t)1); // The name "/" always fits inline
+        memcpy(root->name.inline_name, "/", 2);
+        update_time(fsptr, root, 1); // Update access and modification times
+        root->type = 2; // Set node type to directory
+        root->flags = 0;
+        inode_directory_t *parent_directory = &root->value.directory;
+        parent_directory->num_children = ((size_t)1); // Set number of children (including "..")
+        parent_directory->index = 0; // The hash index gets allocated with the first child
+        parent_directory->index_size = 0;
+        parent_directory->index_deleted = 0;
+        parent_directory->num_subdirs = 0;
+
+        // Set up root's children; the parent of root is root itself
+        if (!dir_children_init(fsptr, stats, parent_directory, sb->root_directory)) {
+            return 0;
+        }
+
+        // Nothing of the new image has been written back yet
+        memset(map, 0xff, map_size);
+        sb->dirty_map = pointer_to_offset(fsptr, map);
+        sb->journal = journal_offset;
+
+        sb->magic_number = MAGIC_NUMBER;
+    }
+
+    // Refuse filesystems written with a layout that cannot be migrated
+    return (sb->version == ((uint32_t)0)) || (sb->version == FORMAT_VERSION);
+}
+
+int grow_filesystem(void *fsptr, alloc_stats_t *stats, size_t fssize) {
+    superblock_t *sb = (superblock_t *)fsptr;
+
+    if (fssize <= sb->size) {
+        return 1;
+    }
+
+    // Give the dirty map a bit for each new page first, so that the growth
+    // itself gets tracked; all pages get written back once more
+    size_t map_size = dirty_map_size(fssize);
+    size_t map_ask = map_size;
+    uint64_t *map = malloc_impl(fsptr, stats, &map_ask);
+    if (map == NULL) {
+        return 0;
+    }
+    memset(map, 0xff, map_size);
+
+    uint64_t *old_map = offset_to_pointer(fsptr, sb->dirty_map);
+    journal_log(fsptr, &sb->size, sizeof(size_t));
+    journal_log(fsptr, &sb->dirty_map, sizeof(fs_offset));
+    sb->size = fssize;
+    sb->dirty_map = pointer_to_offset(fsptr, map);
+    free_impl(fsptr, stats, old_map);
+
+    // Then hand the new memory to the allocator
+    grow_allocator(fsptr, stats, fssize);
+    journal_commit(fsptr);
+
+    return 1;
+}
+
+// Counts an inode and everything below it
+static size_t count_inodes(void *fsptr, inode_t *node) {
+    size_t count = 1;
+
+    if (node->type == 2) {
+        inode_directory_t *directory = &node->value.directory;
+        for (size_t i = ((size_t)1); i < directory->num_children; i++) {
+            count += count_inodes(fsptr, offset_to_pointer(fsptr, *dir_child(fsptr, directory, i)));
+        }
+    }
+
+    return count;
+}
+
+void count_totals(void *fsptr) {
+    superblock_t *sb = (superblock_t *)fsptr;
+    allocator_t *alloc = get_allocator(fsptr);
+    fs_totals_t *totals = &sb->totals;
+
+    memset(totals, 0, sizeof(fs_totals_t));
+    for (fs_offset offset = alloc->heap_start; offset < alloc->heap_end;) {
+        data_block_t *block = offset_to_pointer(fsptr, offset);
+        if (block->header & ALLOC_IN_USE) {
+            totals->used_blocks++;
+        } else {
+            totals->free_bytes += block_size(block);
+            totals->free_blocks++;
+        }
+        offset += block_size(block);
+    }
+    totals->num_objects[SLAB_INODE] = count_inodes(fsptr, offset_to_pointer(fsptr, sb->root_directory));
+    dirty_mark(fsptr, totals, sizeof(fs_totals_t));
+}
+
+// Checks that size bytes at a non-zero offset lie within a version 0 image of oldsize bytes
+static int v0_range_ok(size_t oldsize, fs_offset offset, size_t size) {
+    return (offset != 0) && (offset <= oldsize) && (size <= oldsize - offset);
+}
+
+// Reads size bytes at offset of a version 0 image; its blocks are only 4-byte aligned
+static int v0_read(void *oldptr, size_t oldsize, fs_offset offset, void *dst, size_t size) {
+    if (!v0_range_ok(oldsize, offset, size)) {
+        return 0;
+    }
+
+    memcpy(dst, offset_to_pointer(oldptr, offset), size);
+    return 1;
+}
+
+// Appends "/name" to the path in *pathptr, which is len bytes long, growing it as needed
+static int v0_path_push(char **pathptr, size_t *capacityptr, size_t len, const char *name,
+                        size_t name_len) {
+    if (len + name_len + 2 > *capacityptr) {
+        size_t capacity = 2 * (len + name_len + 2);
+        char *path = (char *)realloc(*pathptr, capacity);
+        if (path == NULL) {
+            return 0;
+        }
+        *pathptr = path;
+        *capacityptr = capacity;
+    }
+
+    (*pathptr)[len] = '/';
+    memcpy(*pathptr + len + 1, name, name_len);
+    (*pathptr)[len + 1 + name_len] = '\0';
+    return 1;
+}
+
+// Copies the data of a version 0 file, kept in a chain of file blocks, into the file path
+static int migrate_file_v0(fs_handle_t *fs, void *oldptr, size_t oldsize, const inode_v0_t *old,
+                           const char *path, size_t *budget, int *errnoptr) {
+    size_t size = old->value.file.size;
+    if (size > oldsize) {
+        *errnoptr = EUCLEAN;  // Structure needs cleaning
+        return 0;
+    }
+    if ((size != 0) && (__myfs_truncate_implem(fs, errnoptr, path, NULL, (off_t)size) != 0)) {
+        return 0;
+    }
+
+    // Each block holds its allocated bytes, the chain ends at offset 0
+    size_t pos = 0;
+    for (fs_offset offset = old->value.file.first_block; (offset != 0) && (pos < size);) {
+        file_block_v0_t block;
+        if ((*budget == 0) || !v0_read(oldptr, oldsize, offset, &block, sizeof(block))) {
+            *errnoptr = EUCLEAN;  // Structure needs cleaning
+            return 0;
+        }
+        (*budget)--;
+        size_t len = (block.allocated < size - pos) ? block.allocated : size - pos;
+        if ((len != 0) && !v0_range_ok(oldsize, block.data, len)) {
+            *errnoptr = EUCLEAN;  // Structure needs cleaning
+            return 0;
+        }
+        const char *data = offset_to_pointer(oldptr, block.data);
+        for (size_t done = 0; done < len;) {
+            int res = __myfs_write_implem(fs, errnoptr, path, NULL, data + done, len - done,
+                                          (off_t)(pos + done));
+            if (res <= 0) {
+                return 0;
+            }
+            done += (size_t)res;
+        }
+        pos += len;
+        offset = block.next;
+    }
+
+    return 1;
+}
+
+// Creates the version 0 inode old at path (of len bytes, empty for root) in the
+// filesystem of the handle fs, along with everything below it. budget bounds the
+// inodes and blocks left to copy, so that a cycle in a damaged image ends the copy
+static int migrate_node_v0(fs_handle_t *fs, void *oldptr, size_t oldsize, const inode_v0_t *old,
+                           char **pathptr, size_t *capacityptr, size_t len, size_t *budget,
+                           int *errnoptr) {
+    const char *path = (len == 0) ? "/" : *pathptr;
+
+    // Two children of the same name only come from a damaged image
+    int res = (len == 0) ? 0 : (old->type == 1) ? __myfs_mknod_implem(fs, errnoptr, path)
+                                                : __myfs_mkdir_implem(fs, errnoptr, path);
+    if (res != 0) {
+        *errnoptr = (*errnoptr == EEXIST) ? EUCLEAN : *errnoptr;
+        return 0;
+    }
+
+    if (old->type == 1) {
+        if (!migrate_file_v0(fs, oldptr, oldsize, old, path, budget, errnoptr)) {
+            return 0;
+        }
+    } else {
+        // Slot 0 of the children array is the parent
+        size_t num_children = old->value.directory.num_children;
+        if ((num_children == 0) || (num_children > oldsize / sizeof(fs_offset)) ||
+            !v0_range_ok(oldsize, old->value.directory.children, num_children * sizeof(fs_offset))) {
+            *errnoptr = EUCLEAN;  // Structure needs cleaning
+            return 0;
+        }
+        for (size_t i = ((size_t)1); i < num_children; i++) {
+            fs_offset offset;
+            inode_v0_t child;
+            if ((*budget == 0) ||
+                !v0_read(oldptr, oldsize, old->value.directory.children + i * sizeof(fs_offset),
+                         &offset, sizeof(fs_offset)) ||
+                !v0_read(oldptr, oldsize, offset, &child, sizeof(child))) {
+                *errnoptr = EUCLEAN;  // Structure needs cleaning
+                return 0;
+            }
+            (*budget)--;
+            size_t name_len = strnlen(child.name, sizeof(child.name));
+            if ((name_len == 0) || (name_len > NAME_MAX_LEN) ||
+                (memchr(child.name, '/', name_len) != NULL) ||
+                (strcmp(child.name, ".") == 0) || (strcmp(child.name, "..") == 0) ||
+                ((child.type != 1) && (child.type != 2))) {
+                *errnoptr = EUCLEAN;  // Structure needs cleaning
+                return 0;
+            }
+            if (!v0_path_push(pathptr, capacityptr, len, child.name, name_len)) {
+                *errnoptr = ENOMEM;  // Out of memory
+                return 0;
+            }
+            if (!migrate_node_v0(fs, oldptr, oldsize, &child, pathptr, capacityptr,
+                                 len + 1 + name_len, budget, errnoptr)) {
+                return 0;
+            }
+            (*pathptr)[len] = '\0';
+        }
+        path = (len == 0) ? "/" : *pathptr;
+    }
+
+    // The copies of the children changed the times, so these go last (unjournaled, see update_time())
+    inode_t *node = resolve_path(fs, path, 0);
+    if (node == NULL) {
+        *errnoptr = ENOENT;  // No such file or directory
+        return 0;
+    }
+    node->time[0] = old->time[0];
+    node->time[1] = old->time[1];
+    dirty_mark(fs->fsptr, node, sizeof(inode_t));
+    return 1;
+}
+
+// Rebuilds a version 0 image in the current layout, see migrate_filesystem()
+static int migrate_from_v0(void *fsptr, size_t fssize, size_t block_size, int *errnoptr) {
+    superblock_v0_t *old_sb = (superblock_v0_t *)fsptr;
+    size_t oldsize = old_sb->size;
+    inode_v0_t root;
+    if ((oldsize > fssize) || !v0_read(fsptr, oldsize, old_sb->root_directory, &root, sizeof(root)) ||
+        (root.type != 2)) {
+        *errnoptr = EUCLEAN;  // Structure needs cleaning
+        return 0;
+    }
+
+    // The new image is made in process memory, next to the old one
+    size_t newsize = oldsize < MIN_FS_SIZE ? MIN_FS_SIZE : oldsize;
+    void *fresh = calloc(1, newsize);
+    size_t capacity = 64;
+    char *path = (char *)malloc(capacity);
+    if ((fresh == NULL) || (path == NULL)) {
+        free(fresh);
+        free(path);
+        *errnoptr = ENOMEM;  // Out of memory
+        return 0;
+    }
+    path[0] = '\0';
+    fs_handle_t *fs = fs_handle_create(fresh, newsize, block_size, errnoptr);
+    int ok = fs != NULL;
+    if (ok) {
+        size_t budget = oldsize / sizeof(file_block_v0_t);
+        ok = migrate_node_v0(fs, fsptr, oldsize, &root, &path, &capacity, 0, &budget, errnoptr);
+        fs_handle_destroy(fs);
+    }
+    if (ok) {
+        memcpy(fsptr, fresh, newsize);
+    }
+    free(path);
+    free(fresh);
+    return ok;
+}
+
+int migrate_filesystem(void *fsptr, size_t fssize, size_t block_size, int *errnoptr) {
+    superblock_t *sb = (superblock_t *)fsptr;
+
+    if ((sb->version == ((uint32_t)0)) && !migrate_from_v0(fsptr, fssize, block_size, errnoptr)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+const char *inode_name(void *fsptr, inode_t *node) {
+    if (node->name_len <= NAME_INLINE_LEN) {
+        return node->name.inline_name;
+    }
+
+    return offset_to_pointer(fsptr, node->name.offset);
+}
+
+int inode_set_name(void *fsptr, alloc_stats_t *stats, inode_t *node, const char *name, size_t len) {
+    journal_log(fsptr, &node->name_len, sizeof(uint8_t));
+    journal_log(fsptr, &node->name, sizeof(node->name));
+
+    if (len <= NAME_INLINE_LEN) {
+        memcpy(node->name.inline_name, name, len);
+        node->name.inline_name[len] = '\0';
+    } else {
+        // Long names live in a block of their own
+        size_t ask_size = len + ((size_t)1);
+        char *ptr = (char *)malloc_impl(fsptr, stats, &ask_size);
+        if ((ask_size != 0) || (ptr == NULL)) {
+            free_impl(fsptr, stats, ptr);
+            return 0;
+        }
+        memcpy(ptr, name, len);
+        ptr[len] = '\0';
+        dirty_mark(fsptr, ptr, len + ((size_t)1));
+        node->name.offset = pointer_to_offset(fsptr, ptr);
+    }
+    node->name_len = (uint8_t)len;
+
+    return 1;
+}
+
+void inode_free_name(void *fsptr, alloc_stats_t *stats, inode_t *node) {
+    if (node->name_len > NAME_INLINE_LEN) {
+        free_impl(fsptr, stats, offset_to_pointer(fsptr, node->name.offset));
+    }
+}
+
+size_t path_length(const char *path) {
+    size_t len = strlen(path);
+
+    // Ignore trailing slashes, but keep the root directory as "/"
+    while ((len > ((size_t)1)) && (path[len - 1] == '/')) {
+        len--;
+    }
+
+    return len;
+}
+
+size_t parent_length(const char *path, size_t len) {
+    // Find the last '/' in the path
+    while ((len > ((size_t)0)) && (path[len - 1] != '/')) {
+        len--;
+    }
+
+    // Drop the '/' itself, unless it is the one of the root directory
+    while ((len > ((size_t)1)) && (path[len - 1] == '/')) {
+        len--;
+    }
+
+    return len == ((size_t)0) ? ((size_t)1) : len;
+}
+
+const char *get_last_token(const char *path, size_t *token_len) {
+    size_t path_len = path_length(path);
+    size_t start = path_len;
+
+    // Find the last '/' in the path
+    while ((start > ((size_t)0)) && (path[start - 1] != '/')) {
+        start--;
+    }
+
+    // The token runs from after that '/' up to the end of the path
+    *token_len = path_len - start;
+
+    return &path[start];
+}
+
+size_t hash_name(const char *name, size_t len) {
+    uint64_t hash = (uint64_t)14695981039346656037ull;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint64_t)((unsigned char)name[i]);
+        hash *= (uint64_t)1099511628211ull;
+    }
+
+    return (size_t)hash;
+}
+
+dir_index_entry_t *dir_index_find(void *fsptr, inode_directory_t *directory,
+                                  const char *name, size_t len) {
+    // Empty directories don't have an index yet
+    if (directory->index == 0) {
+        return NULL;
+    }
+
+    dir_index_entry_t *entries = offset_to_pointer(fsptr, directory->index);
+    size_t mask = directory->index_size - 1;
+    size_t hash = hash_name(name, len);
+
+    // Probe linearly until an empty entry ends the cluster
+    for (size_t i = hash & mask; entries[i].slot != DIR_INDEX_EMPTY; i = (i + 1) & mask) {
+        if ((entries[i].slot != DIR_INDEX_DELETED) && (entries[i].hash == hash)) {
+            // Only compare names on a full hash match
+            inode_t *node = offset_to_pointer(fsptr, *dir_child(fsptr, directory, entries[i].slot));
+            if ((node->name_len == len) && (memcmp(inode_name(fsptr, node), name, len) == 0)) {
+                return &entries[i];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int dir_index_reserve(void *fsptr, alloc_stats_t *stats, inode_directory_t *directory) {
+    size_t live = directory->num_children - 1;  // ".." is not indexed
+
+    // Keep the load (including removed entries) at or below 3/4
+    if (((live + directory->index_deleted + 1) * 4) <= (directory->index_size * 3)) {
+        return 1;
+    }
+
+    // Rebuild at a size that brings the load back to 1/2 at most
+    size_t new_size = DIR_INDEX_MIN_SIZE;
+    while (((live + 1) * 2) > new_size) {
+        new_size *= 2;
+    }
+
+    size_t ask_size = new_size * sizeof(dir_index_entry_t);
+    dir_index_entry_t *new_entries = malloc_impl(fsptr, stats, &ask_size);
+    if ((ask_size != 0) || (new_entries == NULL)) {
+        free_impl(fsptr, stats, new_entries);
+        return 0;
+    }
+    memset(new_entries, 0, new_size * sizeof(dir_index_entry_t));
+
+    // Move the live entries over; their hashes are stored, so no name is read
+    if (directory->index != 0) {
+        dir_index_entry_t *old_entries = offset_to_pointer(fsptr, directory->index);
+        for (size_t i = 0; i < directory->index_size; i++) {
+            if ((old_entries[i].slot != DIR_INDEX_EMPTY) && (old_entries[i].slot != DIR_INDEX_DELETED)) {
+                size_t j = old_entries[i].hash & (new_size - 1);
+                while (new_entries[j].slot != DIR_INDEX_EMPTY) {
+                    j = (j + 1) & (new_size - 1);
+                }
+                new_entries[j] = old_entries[i];
+            }
+        }
+        free_impl(fsptr, stats, old_entries);
+    }
+
+    dirty_mark(fsptr, new_entries, new_size * sizeof(dir_index_entry_t));
+    journal_log(fsptr, directory, sizeof(inode_directory_t));
+    directory->index = pointer_to_offset(fsptr, new_entries);
+    directory->index_size = new_size;
+    directory->index_deleted = 0;
+
+    // The old index may be handed out again by the caller: commit while it is intact
+    journal_commit(fsptr);
+
+    return 1;
+}
+
+void dir_index_insert(void *fsptr, inode_directory_t *directory, size_t hash, size_t slot) {
+    dir_index_entry_t *entries = offset_to_pointer(fsptr, directory->index);
+    size_t mask = directory->index_size - 1;
+    size_t i = hash & mask;
+
+    // Take the first free entry, reusing removed ones
+    while ((entries[i].slot != DIR_INDEX_EMPTY) && (entries[i].slot != DIR_INDEX_DELETED)) {
+        i = (i + 1) & mask;
+    }
+    if (entries[i].slot == DIR_INDEX_DELETED) {
+        journal_log(fsptr, directory, sizeof(inode_directory_t));
+        directory->index_deleted--;
+    }
+
+    journal_log(fsptr, &entries[i], sizeof(dir_index_entry_t));
+    entries[i].hash = hash;
+    entries[i].slot = slot;
+}
+
+void dir_index_free(void *fsptr, alloc_stats_t *stats, inode_directory_t *directory) {
+    journal_log(fsptr, directory, sizeof(inode_directory_t));
+    if (directory->index != 0) {
+        free_impl(fsptr, stats, offset_to_pointer(fsptr, directory->index));
+    }
+    directory->index = 0;
+    directory->index_size = 0;
+    directory->index_deleted = 0;
+}
+
+fs_offset *dir_child(void *fsptr, inode_directory_t *directory, size_t slot) {
+    fs_offset *pages = offset_to_pointer(fsptr, directory->children);
+    fs_offset *page = offset_to_pointer(fsptr, pages[slot / DIR_PAGE_SLOTS]);
+
+    return &page[slot % DIR_PAGE_SLOTS];
+}
+
+// Page table entries past the last page are 0, or a page left over by a failed insertion
+static void dir_pages_clear(void *fsptr, fs_offset *pages, size_t from) {
+    size_t capacity = usable_size(fsptr, pages) / sizeof(fs_offset);
+
+    if (capacity > from) {
+        memset(&pages[from], 0, (capacity - from) * sizeof(fs_offset));
+        dirty_mark(fsptr, &pages[from], (capacity - from) * sizeof(fs_offset));
+    }
+}
+
+int dir_children_init(void *fsptr, alloc_stats_t *stats, inode_directory_t *directory, fs_offset parent) {
+    size_t table_size = sizeof(fs_offset);
+    size_t page_size = 4 * sizeof(fs_offset);  // Room for 4 children at first
+    fs_offset *pages = malloc_impl(fsptr, stats, &table_size);
+    fs_offset *page = malloc_impl(fsptr, stats, &page_size);
+    if ((table_size != 0) || (page_size != 0) || (pages == NULL) || (page == NULL)) {
+        free_impl(fsptr, stats, pages);
+        free_impl(fsptr, stats, page);
+        return 0;
+    }
+
+    pages[0] = pointer_to_offset(fsptr, page);
+    dir_pages_clear(fsptr, pages, 1);
+    dirty_mark(fsptr, pages, sizeof(fs_offset));
+    page[0] = parent;
+    dirty_mark(fsptr, page, sizeof(fs_offset));
+    directory->children = pointer_to_offset(fsptr, pages);
+    return 1;
+}
+
+int dir_children_reserve(void *fsptr, alloc_stats_t *stats, inode_directory_t *directory) {
+    size_t slot = directory->num_children;
+    size_t page_index = slot / DIR_PAGE_SLOTS;
+    fs_offset *pages = offset_to_pointer(fsptr, directory->children);
+
+    if ((slot % DIR_PAGE_SLOTS) != 0) {
+        // The last page grows by doubling until it is full
+        fs_offset *page = offset_to_pointer(fsptr, pages[page_index]);
+        size_t capacity = usable_size(fsptr, page) / sizeof(fs_offset);
+        if (capacity > (slot % DIR_PAGE_SLOTS)) {
+            return 1;
+        }
+        size_t ask_size = (2 * capacity < DIR_PAGE_SLOTS ? 2 * capacity : DIR_PAGE_SLOTS) * sizeof(fs_offset);
+        void *new_page = realloc_impl(fsptr, stats, page, &ask_size);
+        if (ask_size != 0) {
+            return 0;
+        }
+        journal_log(fsptr, &pages[page_index], sizeof(fs_offset));
+        pages[page_index] = pointer_to_offset(fsptr, new_page);
+
+        // The old page may be handed out again by the caller: commit while it is intact
+        journal_commit(fsptr);
+        return 1;
+    }
+
+    // A new page; the page table doubles when it is full, which copies no child
+    size_t table_capacity = usable_size(fsptr, pages) / sizeof(fs_offset);
+    if (page_index == table_capacity) {
+        size_t ask_size = 2 * table_capacity * sizeof(fs_offset);
+        fs_offset *new_pages = realloc_impl(fsptr, stats, pages, &ask_size);
+        if (ask_size != 0) {
+            return 0;
+        }
+        dir_pages_clear(fsptr, new_pages, table_capacity);
+        journal_log(fsptr, &directory->children, sizeof(fs_offset));
+        directory->children = pointer_to_offset(fsptr, new_pages);
+        pages = new_pages;
+        journal_commit(fsptr);
+    }
+    if (pages[page_index] != 0) {
+        return 1;
+    }
+    size_t ask_size = DIR_PAGE_SLOTS * sizeof(fs_offset);
+    fs_offset *page = malloc_impl(fsptr, stats, &ask_size);
+    if ((ask_size != 0) || (page == NULL)) {
+        free_impl(fsptr, stats, page);
+        return 0;
+    }
+    journal_log(fsptr, &pages[page_index], sizeof(fs_offset));
+    pages[page_index] = pointer_to_offset(fsptr, page);
+    return 1;
+}
+
+void dir_children_free(void *fsptr, alloc_stats_t *stats, inode_directory_t *directory) {
+    fs_offset *pages = offset_to_pointer(fsptr, directory->children);
+    size_t capacity = usable_size(fsptr, pages) / sizeof(fs_offset);
+
+    for (size_t i = 0; i < capacity; i++) {
+        if (pages[i] != 0) {
+            free_impl(fsptr, stats, offset_to_pointer(fsptr, pages[i]));
+        }
+    }
+    free_impl(fsptr, stats, pages);
+}
+
+size_t dir_children_allocated(void *fsptr, inode_directory_t *directory) {
+    fs_offset *pages = offset_to_pointer(fsptr, directory->children);
+    size_t last = (directory->num_children - 1) / DIR_PAGE_SLOTS;
+
+    return usable_size(fsptr, pages) + last * DIR_PAGE_SLOTS * sizeof(fs_offset) +
+           usable_size(fsptr, offset_to_pointer(fsptr, pages[last]));
+}
+
+void remove_child(void *fsptr, alloc_stats_t *stats, inode_directory_t *directory, dir_index_entry_t *entry) {
+    size_t slot = entry->slot;
+    size_t last = directory->num_children - 1;
+    fs_offset *child = dir_child(fsptr, directory, slot);
+
+    // Leave a removed marker so that probe sequences stay intact
+    journal_log(fsptr, directory, sizeof(inode_directory_t));
+    journal_log(fsptr, entry, sizeof(dir_index_entry_t));
+    entry->slot = DIR_INDEX_DELETED;
+    directory->index_deleted++;
+    if (((inode_t *)offset_to_pointer(fsptr, *child))->type == 2) {
+        directory->num_subdirs--;
+    }
+
+    // Move the last child into the freed position and repoint its index entry
+    if (slot != last) {
+        fs_offset *last_child = dir_child(fsptr, directory, last);
+        inode_t *moved = offset_to_pointer(fsptr, *last_child);
+        dir_index_entry_t *moved_entry = dir_index_find(fsptr, directory, inode_name(fsptr, moved),
+                                                        moved->name_len);
+        journal_log(fsptr, child, sizeof(fs_offset));
+        journal_log(fsptr, moved_entry, sizeof(dir_index_entry_t));
+        *child = *last_child;
+        moved_entry->slot = slot;
+    }
+
+    directory->num_children--;
+
+    // The last page held only the moved child; a page left over behind it goes too
+    if ((last % DIR_PAGE_SLOTS) == 0) {
+        fs_offset *pages = offset_to_pointer(fsptr, directory->children);
+        size_t capacity = usable_size(fsptr, pages) / sizeof(fs_offset);
+        for (size_t i = last / DIR_PAGE_SLOTS; (i < capacity) && (pages[i] != 0); i++) {
+            free_impl(fsptr, stats, offset_to_pointer(fsptr, pages[i]));
+            journal_log(fsptr, &pages[i], sizeof(fs_offset));
+            pages[i] = 0;
+        }
+    }
+}
+
+inode_t *get_node(void *fsptr, inode_directory_t *directory, const char *child, size_t len) {
+    // Check if the child node is the parent directory
+    if ((len == ((size_t)2)) && (child[0] == '.') && (child[1] == '.')) {
+        // Return the inode of the parent directory
+        return ((inode_t *)offset_to_pointer(fsptr, *dir_child(fsptr, directory, 0)));
+    }
+
+    // Look the child node up in the directory's hash index
+    dir_index_entry_t *entry = dir_index_find(fsptr, directory, child, len);
+    if (entry == NULL) {
+        // Child node not found
+        return NULL;
+    }
+
+    return ((inode_t *)offset_to_pointer(fsptr, *dir_child(fsptr, directory, entry->slot)));
+}
+
+inode_t *resolve_path(fs_handle_t *fs, const char *path, int skip_n_tokens) {
+    void *fsptr = fs->fsptr;
+    dcache_t *dcache = fs->dcache;
+
+    // Check if the path starts at the root directory
+    if (*path != '/') {
+        return NULL;
+    }
+
+    // Start at the root directory
+    inode_t *node = fs->root;
+
+    // Cut the tokens to skip off the end of the path
+    size_t len = path_length(path);
+    for (int i = 0; i < skip_n_tokens; i++) {
+        len = parent_length(path, len);
+    }
+
+    // If the path is just "/", return the root directory inode
+    if (len == ((size_t)1)) {
+        return node;
+    }
+
+    // Try the dentry cache for the path, then for its parent
+    size_t pos = 1;
+    if (dcache != NULL) {
+        fs_offset cached = dcache_lookup(dcache, path, len);
+        if (cached != 0) {
+            return offset_to_pointer(fsptr, cached);
+        }
+        size_t parent_len = parent_length(path, len);
+        if (parent_len > ((size_t)1)) {
+            cached = dcache_lookup(dcache, path, parent_len);
+            if (cached != 0) {
+                node = offset_to_pointer(fsptr, cached);
+                pos = parent_len + 1;
+            }
+        }
+    }
+
+    // Traverse the path tokens in place
+    int cacheable = 1;
+    while (pos < len) {
+        size_t start = pos;
+        while ((pos < len) && (path[pos] != '/')) {
+            pos++;
+        }
+        size_t token_len = pos - start;
+        pos++;
+
+        // Skip empty tokens and "."; stay on the same directory
+        if ((token_len == ((size_t)0)) || ((token_len == ((size_t)1)) && (path[start] == '.'))) {
+            cacheable = 0;
+            continue;
+        }
+
+        // Files cannot have children
+        if (node->type != 2) {
+            return NULL;
+        }
+
+        // Paths through ".." are not cached: they outlive their intermediate directory
+        if ((token_len == ((size_t)2)) && (path[start] == '.') && (path[start + 1] == '.')) {
+            cacheable = 0;
+        }
+
+        node = get_node(fsptr, &node->value.directory, &path[start], token_len);
+        // Check if the child node was successfully retrieved
+        if (node == NULL) {
+            return NULL;
+        }
+    }
+
+    if ((dcache != NULL) && cacheable) {
+        dcache_insert(dcache, path, len, pointer_to_offset(fsptr, node));
+    }
+
+    return node;
+}
+
+inode_t *make_node(fs_handle_t *fs, const char *path, int *errnoptr, int is_file) {
+    void *fsptr = fs->fsptr;
+
+    // Call path solver without the last node name because that is the file name
+    // if valid path name is given
+    inode_t *parent_node = resolve_path(fs, path, 1);
+
+    // Check that the file parent exist
+    if (parent_node == NULL) {
+        *errnoptr = ENOENT;  // No such file or directory
+        return NULL;
+    }
+
+    // Check that the node returned is a directory
+    if (parent_node->type != 2) {
+        *errnoptr = ENOTDIR;  // Not a directory
+        return NULL;
+    }
+
+    // Get directory from node
+    inode_directory_t *parent_directory = &parent_node->value.directory;
+
+    // Get last token which has the filename
+    size_t len;
+    const char *new_node_name = get_last_token(path, &len);
+
+    if (len == 0) {
+        *errnoptr = ENOENT;  // No such file or directory
+        return NULL;
+    }
+
+    if (len > NAME_MAX_LEN) {
+        *errnoptr = ENAMETOOLONG;  // File name too long
+        return NULL;
+    }
+
+    // Check that the parent doesn't contain a node with the same name as the one
+    // we are about to create
+    if (dir_index_find(fsptr, parent_directory, new_node_name, len) != NULL) {
+        *errnoptr = EEXIST;  // File already exists
+        return NULL;
+    }
+
+    // Make the node and put it in the directory child list
+    // First make sure the directory list has a free place to add the node to
+    if (!dir_children_reserve(fsptr, &fs->stats, parent_directory)) {
+        *errnoptr = ENOSPC;  // No space left on device
+        return NULL;
+    }
+
+    // Make room for the new name in the parent's hash index
+    if (!dir_index_reserve(fsptr, &fs->stats, parent_directory)) {
+        *errnoptr = ENOSPC;  // No space left on device
+        return NULL;
+    }
+
+    // Allocate memory for new node, next to its last sibling (or the parent)
+    inode_t *new_node = slab_alloc(fsptr, &fs->stats, SLAB_INODE,
+                                   offset_to_pointer(fsptr, *dir_child(fsptr, parent_directory,
+                                                                       parent_directory->num_children - 1)));
+    if (new_node == NULL) {
+        *errnoptr = ENOSPC;  // No space left on device
+        return NULL;
+    }
+    if (!inode_set_name(fsptr, &fs->stats, new_node, new_node_name, len)) {
+        slab_free(fsptr, &fs->stats, new_node);
+        *errnoptr = ENOSPC;  // No space left on device
+        return NULL;
+    }
+
+    if (is_file) {
+        // Make a node for the file with size of 0, its data kept inline until it grows
+        new_node->type = 1;
+        new_node->flags = INODE_INLINE;
+        new_node->value.file.size = 0;
+    } else {
+        // Make a node for the directory
+        new_node->type = 2;
+        new_node->flags = 0;
+        inode_directory_t *new_directory = &new_node->value.directory;
+        new_directory->num_children = ((size_t) 1);  // Set initial number of children to 1 (for '..')
+        new_directory->index = 0;  // The hash index gets allocated with the first child
+        new_directory->index_size = 0;
+        new_directory->index_deleted = 0;
+        new_directory->num_subdirs = 0;
+
+        // Allocate the children list, its first child points to the parent
+        if (!dir_children_init(fsptr, &fs->stats, new_directory, pointer_to_offset(fsptr, parent_node))) {
+            inode_free_name(fsptr, &fs->stats, new_node);
+            slab_free(fsptr, &fs->stats, new_node);
+            *errnoptr = ENOSPC;  // No space left on device
+            return NULL;
+        }
+    }
+
+    // Initialize node attributes
+    update_time(fsptr, new_node, 1);  // Update node timestamps
+
+    // Add node to directory children and to the directory's hash index
+    fs_offset *child = dir_child(fsptr, parent_directory, parent_directory->num_children);
+    journal_log(fsptr, child, sizeof(fs_offset));
+    *child = pointer_to_offset(fsptr, new_node);
+    dir_index_insert(fsptr, parent_directory, hash_name(new_node_name, len),
+                     parent_directory->num_children);
+    journal_log(fsptr, parent_directory, sizeof(inode_directory_t));
+    parent_directory->num_children++;
+    if (!is_file) {
+        parent_directory->num_subdirs++;
+    }
+    update_time(fsptr, parent_node, 1);
+
+    return new_node;
+}
+
+size_t extent_find(void *fsptr, inode_file_t *file, size_t offset, size_t *cursor) {
+    extent_t *extents = offset_to_pointer(fsptr, file->extents);
+    size_t low = 0;
+    size_t high = file->num_extents;
+
+    // Sequential access stays in the extent of the last access or moves on to the next one
+    if (cursor != NULL) {
+        for (size_t i = *cursor; (i < *cursor + 2) && (i < file->num_extents); i++) {
+            if ((extents[i].start + extents[i].length > offset) &&
+                ((i == 0) || (extents[i - 1].start + extents[i - 1].length <= offset))) {
+                return i;
+            }
+        }
+    }
+
+    // Extents are sorted and disjoint, so their ends are sorted as well
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (extents[mid].start + extents[mid].length > offset) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return low;
+}
+
+// Inserts an extent at position index of a file's extent array, starting at
+// start and backed by data; the array may move to a new block for it
+static extent_t *extent_insert(void *fsptr, alloc_stats_t *stats, inode_file_t *file, size_t index, size_t start, void *data) {
+    extent_t *extents = offset_to_pointer(fsptr, file->extents);
+    size_t max_extents = usable_size(fsptr, extents) / sizeof(extent_t);
+    size_t moved = (file->num_extents - index) * sizeof(extent_t);
+    extent_t *new_extents = NULL;
+
+    // A long move would fill the journal with the old bytes: copy the array
+    // into a new one instead, the old one is gone only once it is freed
+    if (moved > BLOCK_SIZE) {
+        size_t new_max = (file->num_extents == max_extents) ? max_extents * 2 : max_extents;
+        size_t ask_size = new_max * sizeof(extent_t);
+        new_extents = malloc_impl(fsptr, stats, &ask_size);
+        if ((ask_size != 0) || (new_extents == NULL)) {
+            free_impl(fsptr, stats, new_extents);
+            return NULL;  // Moving in place would take too much of the journal
+        }
+        memcpy(new_extents, extents, index * sizeof(extent_t));
+        memcpy(&new_extents[index + 1], &extents[index], moved);
+        free_impl(fsptr, stats, extents);
+    }
+
+    if ((new_extents == NULL) && (file->num_extents == max_extents)) {
+        size_t ask_size = (max_extents == 0 ? EXTENT_MIN_COUNT : max_extents * 2) * sizeof(extent_t);
+        new_extents = realloc_impl(fsptr, stats, extents, &ask_size);
+        if (ask_size != 0) {
+            return NULL;  // The old array is left untouched
+        }
+        if (new_extents == extents) {
+            new_extents = NULL;  // Grown in place
+        }
+    }
+
+    if (new_extents != NULL) {
+        extents = new_extents;
+        if (moved <= BLOCK_SIZE) {
+            memmove(&extents[index + 1], &extents[index], moved);
+        }
+        dirty_mark(fsptr, extents, (file->num_extents + 1) * sizeof(extent_t));
+        journal_log(fsptr, file, FILE_FIELDS_SIZE);
+        file->extents = pointer_to_offset(fsptr, extents);
+    } else {
+        journal_log(fsptr, &extents[index], moved + sizeof(extent_t));
+        memmove(&extents[index + 1], &extents[index], moved);
+        journal_log(fsptr, file, FILE_FIELDS_SIZE);
+    }
+
+    extents[index].start = start;
+    extents[index].length = 0;
+    extents[index].data = pointer_to_offset(fsptr, data);
+    file->allocated += usable_size(fsptr, data);
+    file->num_extents++;
+    return &extents[index];
+}
+
+// Allocates the memory of a new extent: wanted bytes if possible, else the
+// needed ones, else as large a piece as the fragmented heap still has
+static void *extent_alloc(void *fsptr, alloc_stats_t *stats, size_t wanted, size_t needed) {
+    size_t block = ((superblock_t *)fsptr)->block_size;
+    size_t ask = wanted;
+
+    while (1) {
+        size_t ask_size = ask;
+        void *data = malloc_impl(fsptr, stats, &ask_size);
+        if (data != NULL) {
+            return data;
+        }
+        if (ask > needed) {
+            ask = needed;
+        } else if (ask > block) {
+            ask /= 2;
+        } else {
+            return NULL;
+        }
+    }
+}
+
+void file_read(void *fsptr, inode_file_t *file, char *buf, size_t size, size_t offset, size_t *cursor) {
+    extent_t *extents = offset_to_pointer(fsptr, file->extents);
+    size_t i = extent_find(fsptr, file, offset, cursor);
+
+    while (size > 0) {
+        size_t chunk;
+        if ((i < file->num_extents) && (extents[i].start <= offset)) {
+            // Copy out of the extent
+            size_t skip = offset - extents[i].start;
+            chunk = extents[i].length - skip;
+            chunk = chunk < size ? chunk : size;
+            memcpy(buf, offset_to_pointer(fsptr, extents[i].data) + skip, chunk);
+            i++;
+        } else {
+            // Bytes up to the next extent are not stored
+            chunk = (i < file->num_extents) ? extents[i].start - offset : size;
+            chunk = chunk < size ? chunk : size;
+            memset(buf, 0, chunk);
+        }
+        buf += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+
+    if (cursor != NULL) {
+        *cursor = i > 0 ? i - 1 : 0;
+    }
+}
+
+// Block size new extents of a file are rounded to. It grows with the file,
+// from the base size to 4, 64 and 1024 times that once the file holds as much
+static size_t file_block_size(void *fsptr, inode_file_t *file) {
+    size_t block = ((superblock_t *)fsptr)->block_size;
+
+    if (file->allocated >= (block << 10)) {
+        return block << 10;
+    }
+    if (file->allocated >= (block << 6)) {
+        return block << 6;
+    }
+    if (file->allocated >= (block << 2)) {
+        return block << 2;
+    }
+    return block;
+}
+
+size_t file_reserve(void *fsptr, alloc_stats_t *stats, inode_file_t *file, size_t size, size_t offset, size_t *cursor,
+                    int *errnoptr) {
+    extent_t *extents = offset_to_pointer(fsptr, file->extents);
+    size_t end = offset + size;
+    size_t pos = offset;
+    size_t i = extent_find(fsptr, file, pos, cursor);
+    int moved = 0;
+
+    // If pos lies in a gap, the extent in front may still have room for it;
+    // only fill a short gap with zeros there, leave anything longer as a hole
+    if ((i > 0) && ((i == file->num_extents) || (extents[i].start > pos))) {
+        extent_t *prev = &extents[i - 1];
+        size_t prev_end = prev->start + prev->length;
+        if ((pos - prev_end < ((superblock_t *)fsptr)->block_size) &&
+            (pos < prev->start + usable_size(fsptr, offset_to_pointer(fsptr, prev->data)))) {
+            i--;
+        }
+    }
+
+    while (pos < end) {
+        extents = offset_to_pointer(fsptr, file->extents);
+
+        // pos lies in a gap: start a new extent there
+        if ((i == file->num_extents) || (extents[i].start > pos)) {
+            size_t needed = ((i < file->num_extents) && (extents[i].start < end)) ? extents[i].start - pos
+                                                                                 : end - pos;
+            size_t reserve = 0;
+            if ((i == file->num_extents) &&
+                ((i == 0) || (extents[i - 1].start + extents[i - 1].length == pos))) {
+                // Growing the end of the file: reserve as much as it holds already
+                reserve = file->allocated < EXTENT_PREALLOC_MAX ? file->allocated : EXTENT_PREALLOC_MAX;
+            }
+            size_t block = file_block_size(fsptr, file);
+            size_t wanted = (needed + reserve + block - 1) & ~(block - 1);
+            wanted = wanted < needed ? needed : wanted;
+
+            void *data = extent_alloc(fsptr, stats, wanted, needed);
+            fs_offset old_extents = file->extents;
+            if ((data == NULL) || (extent_insert(fsptr, stats, file, i, pos, data) == NULL)) {
+                free_impl(fsptr, stats, data);
+                *errnoptr = ENOSPC;  // No space left on device
+                break;
+            }
+            moved = (file->extents != old_extents);
+            continue;
+        }
+
+        // Fill extent i as far as its capacity and the next extent allow
+        extent_t *extent = &extents[i];
+        char *data = offset_to_pointer(fsptr, extent->data);
+        size_t reach = extent->start + usable_size(fsptr, data);
+        if ((i + 1 < file->num_extents) && (extents[i + 1].start < reach)) {
+            reach = extents[i + 1].start;
+        }
+        size_t chunk_end = end < reach ? end : reach;
+
+        // Unwritten bytes between the extent's end and pos read as zeros
+        size_t extent_end = extent->start + extent->length;
+        if (pos > extent_end) {
+            memset(data + extent->length, 0, pos - extent_end);
+            dirty_mark(fsptr, data + extent->length, pos - extent_end);
+        }
+
+        // So do the bytes that were a hole inside the file before
+        size_t fresh = pos > extent_end ? pos : extent_end;
+        size_t fresh_end = chunk_end < file->size ? chunk_end : file->size;
+        if (fresh < fresh_end) {
+            memset(data + (fresh - extent->start), 0, fresh_end - fresh);
+            dirty_mark(fsptr, data + (fresh - extent->start), fresh_end - fresh);
+        }
+
+        if (chunk_end - extent->start > extent->length) {
+            journal_log(fsptr, extent, sizeof(extent_t));
+            extent->length = chunk_end - extent->start;
+        }
 
-void *get_free_memory_pointer(void *fsptr) {
-  return &((superblock_t *)fsptr)->free_memory;
-}
+        // Grow the file along, so that its extents end within it at every checkpoint
+        pos = chunk_end;
+        if (pos > file->size) {
+            journal_log(fsptr, file, FILE_FIELDS_SIZE);
+            file->size = pos;
+        }
 
-void update_time(inode_t *node, int set_mod) {
-    // If node is NULL, do nothing
-    if (node == NULL) {
-        return;
+        // A moved extent array is free in its old place: nothing allocates before
+        // this, but the next pass may be handed it, so commit while it is intact
+        if (moved) {
+            journal_commit(fsptr);
+            moved = 0;
+        } else {
+            journal_checkpoint(fsptr);
+        }
+        i++;
     }
 
-    // Get current time
-    struct timespec ts;
-    if (clock_gettime(CLOCK_REALTIME, &ts) == 0) {
-        // Update access time
-        node->time[0] = ts;
+    if (cursor != NULL) {
+        *cursor = i > 0 ? i - 1 : 0;
+    }
+    return pos - offset;
+}
 
-        // Update modification time if set_mod is non-zero
-        if (set_mod) {
-            node->time[1] = ts;
+size_t file_segments(void *fsptr, inode_file_t *file, size_t size, size_t offset, size_t *cursor,
+                     size_t *segments) {
+    extent_t *extents = offset_to_pointer(fsptr, file->extents);
+    size_t i = extent_find(fsptr, file, offset, cursor);
+    size_t end = offset + size;
+    size_t count = 0;
+
+    // Same walk as file_read(), recording positions instead of copying
+    for (size_t pos = offset; pos < end; count++) {
+        size_t chunk;
+        if ((i < file->num_extents) && (extents[i].start <= pos)) {
+            size_t skip = pos - extents[i].start;
+            chunk = extents[i].length - skip;
+            segments[2 * count] = extents[i].data + skip;
+            i++;
+        } else {
+            chunk = (i < file->num_extents) ? extents[i].start - pos : end - pos;
+            segments[2 * count] = 0;
         }
+        chunk = chunk < end - pos ? chunk : end - pos;
+        segments[2 * count + 1] = chunk;
+        pos += chunk;
+    }
+
+    if (cursor != NULL) {
+        *cursor = i > 0 ? i - 1 : 0;
     }
+    return count;
 }
 
-void mount_filesystem(void *fsptr, size_t fssize) {
-    superblock_t *sb = (superblock_t *)fsptr;
+size_t file_write(void *fsptr, alloc_stats_t *stats, inode_file_t *file, const char *buf, size_t size, size_t offset,
+                  size_t *cursor, int *errnoptr) {
+    // Look the start up again after the reservation, which may move extents around
+    size_t start_cursor = (cursor != NULL) ? *cursor : 0;
+    size_t reserved = file_reserve(fsptr, stats, file, size, offset, cursor, errnoptr);
+    extent_t *extents = offset_to_pointer(fsptr, file->extents);
+    size_t i = extent_find(fsptr, file, offset, (cursor != NULL) ? &start_cursor : NULL);
+
+    // The whole reserved range is covered by extents now
+    for (size_t pos = offset; pos < offset + reserved; i++) {
+        size_t skip = pos - extents[i].start;
+        size_t chunk = extents[i].length - skip;
+        chunk = chunk < offset + reserved - pos ? chunk : offset + reserved - pos;
+        memcpy(offset_to_pointer(fsptr, extents[i].data) + skip, buf, chunk);
+        dirty_mark(fsptr, offset_to_pointer(fsptr, extents[i].data) + skip, chunk);
+        buf += chunk;
+        pos += chunk;
+    }
 
-    // If this is the first mount, initialize the superblock
-    if (sb->magic_number != MAGIC_NUMBER) {
-        // Set general stats
-        sb->magic_number = MAGIC_NUMBER;
-        sb->size = fssize;
+    return reserved;
+}
 
-        // Save space for the root directory
-        sb->root_directory = sizeof(superblock_t); // Store only the offset
-        inode_t *root = offset_to_pointer(fsptr, sb->root_directory);
+// Frees the extents of a file from the last one down to keep of them; the file
+// stays consistent after each one, so a long run can commit in between
+static void file_drop_extents(void *fsptr, alloc_stats_t *stats, inode_file_t *file, size_t keep) {
+    extent_t *extents = offset_to_pointer(fsptr, file->extents);
+
+    while (file->num_extents > keep) {
+        void *data = offset_to_pointer(fsptr, extents[file->num_extents - 1].data);
+        journal_log(fsptr, file, FILE_FIELDS_SIZE);
+        file->allocated -= usable_size(fsptr, data);
+        file->num_extents--;
+        free_impl(fsptr, stats, data);
+        journal_checkpoint(fsptr);
+    }
+}
 
-        // Set up the root directory
-        memset(root->name, '\0', NAME_MAX_LEN + ((size_t)1)); // Fill name with null characters
-        memcpy(root->name, "/", strlen("/")); // Copy name "/" into node->name
-        update_time(root, 1); // Update access and modification times
-        root->type = 2; // Set node type to directory
-        inode_directory_t *parent_directory = &root->value.directory;
-        parent_directory->num_children = ((size_t)1); // Set number of children (including "..")
+void file_shrink(void *fsptr, alloc_stats_t *stats, inode_file_t *file, size_t size) {
+    extent_t *extents = offset_to_pointer(fsptr, file->extents);
+    size_t i = extent_find(fsptr, file, size, NULL);
+    size_t keep = ((i < file->num_extents) && (extents[i].start < size)) ? i + 1 : i;
+
+    // Free all extents behind the new end
+    file_drop_extents(fsptr, stats, file, keep);
+
+    // Cut the extent holding the new end, the allocator trims its block in place
+    if (keep > i) {
+        void *data = offset_to_pointer(fsptr, extents[i].data);
+        size_t new_length = size - extents[i].start;
+        journal_log(fsptr, file, FILE_FIELDS_SIZE);
+        journal_log(fsptr, &extents[i], sizeof(extent_t));
+        file->allocated -= usable_size(fsptr, data);
+        realloc_impl(fsptr, stats, data, &new_length);
+        file->allocated += usable_size(fsptr, data);
+        extents[i].length = size - extents[i].start;
+    }
 
-        // Set up root's children
-        size_t *children_size = offset_to_pointer(fsptr, sb->root_directory + sizeof(inode_t));
-        *children_size = 4 * sizeof(fs_offset); // Set size of children array header
-        parent_directory->children = pointer_to_offset(fsptr, (void *)children_size + sizeof(size_t));
-        fs_offset *ptr = offset_to_pointer(fsptr, parent_directory->children);
-        *ptr = 0; // Set parent of root to null
+    journal_log(fsptr, file, FILE_FIELDS_SIZE);
+    file->size = size;
+}
 
-        // Set the pointer to the first free block
-        sb->free_memory = parent_directory->children + *children_size;
-        list_t *ll = get_free_memory_pointer(fsptr);
-        data_block_t *fb = offset_to_pointer(fsptr, ll->head);
+void file_free(void *fsptr, alloc_stats_t *stats, inode_file_t *file) {
+    file_drop_extents(fsptr, stats, file, 0);
 
-        // Initialize remaining free space
-        fb->remaining = fssize - sb->free_memory - sizeof(size_t);
-        memset((void *)fb + sizeof(size_t), 0, fb->remaining); // Fill free space with zeros
-    }
+    journal_log(fsptr, file, FILE_FIELDS_SIZE);
+    free_impl(fsptr, stats, offset_to_pointer(fsptr, file->extents));
+    file->extents = 0;
+    file->allocated = 0;
+    file->size = 0;
 }
 
-char *get_last_token(const char *path, unsigned long *token_len) {
-    unsigned long path_len = strlen(path);
-    unsigned long last_slash_index;
+char *file_inline_reserve(void *fsptr, inode_t *node, size_t size, size_t offset) {
+    inode_file_t *file = &node->value.file;
 
-    // Find the last '/' in the path
-    for (last_slash_index = path_len - 1; last_slash_index > 0; last_slash_index--) {
-        if (path[last_slash_index] == '/') {
-            break;
+    // Bytes beyond the size are not the file's, so undoing the growth only takes the size
+    if (offset + size > file->size) {
+        journal_log(fsptr, file, FILE_FIELDS_SIZE);
+        if (offset > file->size) {
+            memset(file->data + file->size, 0, offset - file->size);
         }
+        dirty_mark(fsptr, file->data + file->size, offset + size - file->size);
+        file->size = offset + size;
     }
 
-    // Adjust index to start after the last '/'
-    last_slash_index++;
-
-    // Calculate the length of the last token
-    *token_len = path_len - last_slash_index;
+    return file->data + offset;
+}
 
-    // Allocate memory for the last token
-    void *ptr = malloc((*token_len + 1) * sizeof(char));
+int file_spill(void *fsptr, alloc_stats_t *stats, inode_t *node, size_t end, int *errnoptr) {
+    inode_file_t *file = &node->value.file;
 
-    // Check that malloc was successful
-    if (ptr == NULL){
-      return NULL;
+    if (!(node->flags & INODE_INLINE) || (end <= FILE_INLINE_LEN)) {
+        return 1;
     }
 
-    char *last_token = (char *)ptr;
-    // Copy the last token from the path
-    // strncpy(last_token, &path[last_slash_index], *token_len);
-    strcpy(last_token, &path[last_slash_index]);
-    last_token[*token_len] = '\0';  // Add null terminator
+    // Copy the bytes into an extent of their own first, they stay in the inode until the switch
+    extent_t *extents = NULL;
+    void *data = NULL;
+    if (file->size > 0) {
+        size_t ask_size = EXTENT_MIN_COUNT * sizeof(extent_t);
+        extents = malloc_impl(fsptr, stats, &ask_size);
+        data = (extents != NULL) ? extent_alloc(fsptr, stats, ((superblock_t *)fsptr)->block_size, file->size) : NULL;
+        if (data == NULL) {
+            free_impl(fsptr, stats, extents);
+            *errnoptr = ENOSPC;  // No space left on device
+            return 0;
+        }
+        memcpy(data, file->data, file->size);
+        dirty_mark(fsptr, data, file->size);
+        extents[0].start = 0;
+        extents[0].length = file->size;
+        extents[0].data = pointer_to_offset(fsptr, data);
+        dirty_mark(fsptr, extents, sizeof(extent_t));
+    }
 
-    return last_token; 
+    journal_log(fsptr, &node->flags, sizeof(uint8_t));
+    journal_log(fsptr, file, FILE_FIELDS_SIZE);
+    node->flags &= (uint8_t)~INODE_INLINE;
+    file->num_extents = (data != NULL) ? ((size_t)1) : ((size_t)0);
+    file->extents = pointer_to_offset(fsptr, extents);
+    file->allocated = usable_size(fsptr, data);
+    journal_checkpoint(fsptr);
+    return 1;
 }
 
-char **tokenize(const char token, const char *path, int skip_n_tokens) {
-    int num_tokens = 0;
+void file_unspill(void *fsptr, alloc_stats_t *stats, inode_t *node) {
+    inode_file_t *file = &node->value.file;
 
-    // Count the number of tokens in the path
-    for (const char *c = path; *c != '\0'; c++) {
-        if (*c == token) {
-            num_tokens++;
-        }
+    if ((node->flags & INODE_INLINE) || (file->size > FILE_INLINE_LEN) || (file->num_extents > 1)) {
+        return;
     }
 
-    // Adjust the number of tokens to skip
-    num_tokens -= skip_n_tokens;
+    // Switch over in one go, then free what the file held
+    char buf[FILE_INLINE_LEN];
+    file_read(fsptr, file, buf, file->size, 0, NULL);
+    extent_t *extents = offset_to_pointer(fsptr, file->extents);
+    void *data = (file->num_extents > 0) ? offset_to_pointer(fsptr, extents[0].data) : NULL;
+
+    journal_log(fsptr, &node->flags, sizeof(uint8_t));
+    journal_log(fsptr, file, FILE_FIELDS_SIZE);
+    node->flags |= INODE_INLINE;
+    memcpy(file->data, buf, file->size);
+    dirty_mark(fsptr, file->data, file->size);
+    free_impl(fsptr, stats, data);
+    free_impl(fsptr, stats, extents);
+}
 
-    // Allocate memory for the tokens array
-    char **tokens = (char **)malloc(((size_t)(num_tokens + 1)) * sizeof(char *));
-    if (tokens == NULL) {
-        return NULL; // Memory allocation failed
+inode_t *resolve_handle(fs_handle_t *fs, const char *path, file_handle_t *handle) {
+    // An open handle already knows its inode
+    if (handle != NULL) {
+        return offset_to_pointer(fs->fsptr, handle->node);
     }
+    return resolve_path(fs, path, 0);
+}
 
-    const char *start = &path[1]; // Skip the first character which is '/'
-    const char *end = start;
-    char *token_ptr;
+void file_handle_destroy(file_handle_t *handle) {
+    free(handle);
+}
 
-    // Populate the tokens array
-    for (int i = 0; i < num_tokens; i++) {
-        while ((*end != token) && (*end != '\0')) {
-            end++;
-        }
+dcache_t *dcache_create(void) {
+    // The cache is process memory: it must not be part of the filesystem image
+    dcache_t *dcache = (dcache_t *)calloc(1, sizeof(dcache_t));
+    if (dcache == NULL) {
+        return NULL;
+    }
 
-        // Allocate memory for the token string
-        token_ptr = (char *)malloc(((size_t)(end - start) + ((u_int)1)) * sizeof(char));
-        if (token_ptr == NULL) {
-            // Memory allocation failed, free previously allocated memory and return NULL
-            for (int j = 0; j < i; j++) {
-                free(tokens[j]);
+    for (size_t i = 0; i < DCACHE_LOCKS; i++) {
+        if (pthread_mutex_init(&dcache->locks[i], NULL) != 0) {
+            for (size_t j = 0; j < i; j++) {
+                pthread_mutex_destroy(&dcache->locks[j]);
             }
-            free(tokens);
+            free(dcache);
             return NULL;
         }
-
-        // Copy the token string
-        memcpy(token_ptr, start, ((size_t)(end - start)));
-        token_ptr[end - start] = '\0'; // Null-terminate the token string
-        tokens[i] = token_ptr;
-        start = ++end;
     }
 
-    // Null-terminate the tokens array
-    tokens[num_tokens] = NULL;
+    // Zeroed entries belong to generation 0 and are never valid
+    dcache->generation = 1;
 
-    return tokens;
+    return dcache;
 }
 
-void free_tokens(char **tokens) {
-  for (char **p = tokens; *p; p++) free(*p);
-  free(tokens);
-}
+void dcache_destroy(dcache_t *dcache) {
+    if (dcache == NULL) {
+        return;
+    }
 
-inode_t *get_node(void *fsptr, inode_directory_t *directory, const char *child) {
-    size_t num_children = directory->num_children;
-    fs_offset *children_offsets = offset_to_pointer(fsptr, directory->children);
-    inode_t *node = NULL;
+    for (size_t i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_destroy(&dcache->locks[i]);
+    }
+    free(dcache);
+}
 
-    // Check if the child node is the parent directory
-    if (strcmp(child, "..") == 0) {
-        // Return the inode of the parent directory
-        return ((inode_t *)offset_to_pointer(fsptr, children_offsets[0]));
+fs_offset dcache_lookup(dcache_t *dcache, const char *path, size_t len) {
+    if (len > DCACHE_PATH_MAX) {
+        return 0;
     }
 
-    // Iterate through the child nodes to find the specified one
-    for (size_t i = ((size_t)1); i < num_children; i++) {
-        node = ((inode_t *)offset_to_pointer(fsptr, children_offsets[i]));
-        if (strcmp(node->name, child) == 0) {
-            // Child node found, return its inode
-            return node;
-        }
+    size_t hash = hash_name(path, len);
+    size_t i = hash & (DCACHE_SIZE - 1);
+    dcache_entry_t *entry = &dcache->entries[i];
+    fs_offset node = 0;
+
+    pthread_mutex_lock(&dcache->locks[i % DCACHE_LOCKS]);
+    if ((entry->generation == __atomic_load_n(&dcache->generation, __ATOMIC_ACQUIRE)) &&
+        (entry->hash == hash) && (entry->len == len) && (memcmp(entry->path, path, len) == 0)) {
+        node = entry->node;
     }
+    pthread_mutex_unlock(&dcache->locks[i % DCACHE_LOCKS]);
 
-    // Child node not found
-    return NULL;
+    return node;
 }
 
-inode_t *resolve_path(void *fsptr, const char *path, int skip_n_tokens) {
-    // Check if the path starts at the root directory
-    if (*path != '/') {
-        return NULL;
+void dcache_insert(dcache_t *dcache, const char *path, size_t len, fs_offset node) {
+    if (len > DCACHE_PATH_MAX) {
+        return;
     }
 
-    // Get the inode of the root directory
-    inode_t *node = offset_to_pointer(fsptr, ((superblock_t *)fsptr)->root_directory);
+    size_t hash = hash_name(path, len);
+    size_t i = hash & (DCACHE_SIZE - 1);
+    dcache_entry_t *entry = &dcache->entries[i];
+
+    pthread_mutex_lock(&dcache->locks[i % DCACHE_LOCKS]);
+    entry->hash = hash;
+    entry->generation = __atomic_load_n(&dcache->generation, __ATOMIC_ACQUIRE);
+    entry->node = node;
+    entry->len = len;
+    memcpy(entry->path, path, len);
+    pthread_mutex_unlock(&dcache->locks[i % DCACHE_LOCKS]);
+}
 
-    // If the path is just "/", return the root directory inode
-    if (path[1] == '\0') {
-        return node;
+void dcache_remove(dcache_t *dcache, const char *path, size_t len) {
+    if ((dcache == NULL) || (len > DCACHE_PATH_MAX)) {
+        return;
     }
 
-    // Break the path into tokens
-    char **tokens = tokenize('/', path, skip_n_tokens);
-
-    // Traverse the path tokens
-    for (char **token = tokens; *token; token++) {
-        // Files cannot have children
-        if (node->type == 1) {
-            free_tokens(tokens);
-            return NULL;
-        }
+    size_t hash = hash_name(path, len);
+    size_t i = hash & (DCACHE_SIZE - 1);
+    dcache_entry_t *entry = &dcache->entries[i];
 
-        // If the token is ".", stay on the same directory
-        if (strcmp(*token, ".") != 0) {
-            node = get_node(fsptr, &node->value.directory, *token);
-            // Check if the child node was successfully retrieved
-            if (node == NULL) {
-                free_tokens(tokens);
-                return NULL;
-            }
-        }
+    pthread_mutex_lock(&dcache->locks[i % DCACHE_LOCKS]);
+    if ((entry->hash == hash) && (entry->len == len) && (memcmp(entry->path, path, len) == 0)) {
+        entry->generation = 0;
     }
+    pthread_mutex_unlock(&dcache->locks[i % DCACHE_LOCKS]);
+}
 
-    free_tokens(tokens);
+void dcache_invalidate(dcache_t *dcache) {
+    if (dcache == NULL) {
+        return;
+    }
 
-    return node;
+    __atomic_add_fetch(&dcache->generation, 1, __ATOMIC_RELEASE);
 }
 
-inode_t *make_node(void *fsptr, const char *path, int *errnoptr, int is_file) {
-    // Call path solver without the last node name because that is the file name
-    // if valid path name is given
-    inode_t *parent_node = resolve_path(fsptr, path, 1);
-
-    // Check that the file parent exist
-    if (parent_node == NULL) {
-        *errnoptr = ENOENT;  // No such file or directory
+fs_handle_t *fs_handle_create(void *fsptr, size_t fssize, size_t block_size, int *errnoptr) {
+    // Block sizes are rounded to, so they must be powers of two
+    block_size = (block_size == 0) ? BLOCK_SIZE : block_size;
+    if ((block_size < BLOCK_SIZE_MIN) || (block_size > BLOCK_SIZE_MAX) ||
+        ((block_size & (block_size - 1)) != 0)) {
+        *errnoptr = EINVAL;  // Invalid argument
         return NULL;
     }
 
-    // Check that the node returned is a directory
-    if (parent_node->type != 2) {
-        *errnoptr = ENOTDIR;  // Not a directory
+    fs_handle_t *fs = (fs_handle_t *)malloc(sizeof(fs_handle_t));
+    if (fs == NULL) {
+        *errnoptr = ENOMEM;  // Out of memory
         return NULL;
     }
-
-    // Get directory from node
-    inode_directory_t *parent_directory = &parent_node->value.directory;
-
-    // Get last token which has the filename
-    unsigned long len;
-    char *new_node_name = get_last_token(path, &len);
-
-    // Check that the parent doesn't contain a node with the same name as the one
-    // we are about to create
-    if (get_node(fsptr, parent_directory, new_node_name) != NULL) {
-        *errnoptr = EEXIST;  // File already exists
+    fs->dcache = dcache_create();
+    if (fs->dcache == NULL) {
+        free(fs);
+        *errnoptr = ENOMEM;  // Out of memory
         return NULL;
     }
-
-    if (len == 0) {
-        *errnoptr = ENOENT;  // No such file or directory
+    fs->fsptr = fsptr;
+    fs->fssize = fssize;
+    fs->compact_runs = 0;
+    fs->compact_moves = 0;
+    fs->compact_bytes = 0;
+    memset(&fs->stats, 0, sizeof(alloc_stats_t));
+
+    // Bring the image up to date before anyone works on it; an image of version 0
+    // has no journal, it gets one from the migration
+    if (!mount_filesystem(fsptr, &fs->stats, fssize, block_size)) {
+        *errnoptr = EPROTONOSUPPORT;  // Another on-image format version
+        fs_handle_destroy(fs);
         return NULL;
     }
-
-    if (len > NAME_MAX_LEN) {
-        *errnoptr = ENAMETOOLONG;  // File name too long
+    if (!migrate_filesystem(fsptr, fssize, block_size, errnoptr)) {
+        fs_handle_destroy(fs);
         return NULL;
     }
-
-    // Access children block
-    fs_offset *children = offset_to_pointer(fsptr, parent_directory->children);
-    data_block_t *block = (((void *)children) - sizeof(size_t));
-
-    // Make the node and put it in the directory child list
-    // First check if the directory list has free places to add nodes to
-    size_t max_children = (block->remaining) / sizeof(fs_offset);
-    size_t ask_size;
-    if (max_children == parent_directory->num_children) {
-        ask_size = block->remaining * 2;
-        // Make more space for another children
-        void *new_children = realloc_impl(fsptr, children, &ask_size);
-
-        // realloc_impl() always returns a new pointer if ask_size == 0, otherwise
-        // we don't have enough space in memory
-        if (ask_size != 0) {
-            *errnoptr = ENOSPC;  // No space left on device
-            return NULL;
-        }
-
-        // Update offset to access the children
-        parent_directory->children = pointer_to_offset(fsptr, new_children);
-        children = ((fs_offset *)new_children);
+    if (!journal_replay(fsptr)) {
+        *errnoptr = EUCLEAN;  // Structure needs cleaning
+        fs_handle_destroy(fs);
+        return NULL;
     }
-
-    // Allocate memory for new node
-    ask_size = sizeof(inode_t);
-    inode_t *new_node = (inode_t *)malloc_impl(fsptr, NULL, &ask_size);
-    if ((ask_size != 0) || (new_node == NULL)) {
-        free_impl(fsptr, new_node);
+    if (!grow_filesystem(fsptr, &fs->stats, fssize)) {
         *errnoptr = ENOSPC;  // No space left on device
+        fs_handle_destroy(fs);
         return NULL;
     }
+    fs->root = offset_to_pointer(fsptr, ((superblock_t *)fsptr)->root_directory);
 
-    // Initialize node attributes
-    memset(new_node->name, '\0', NAME_MAX_LEN + 1);  // Fill name characters with '\0'
-    memcpy(new_node->name, new_node_name, len);  // Copy given name into node->name
-    update_time(new_node, 1);  // Update node timestamps
-
-    // Add file node to directory children
-    children[parent_directory->num_children] = pointer_to_offset(fsptr, new_node);
-    parent_directory->num_children++;
-    update_time(parent_node, 1);
-
-    if (is_file) {
-        // Make a node for the file with size of 0
-        new_node->type = 1;
-        inode_file_t *file = &new_node->value.file;
-        file->size = 0;
-        file->first_block = 0;
-    } else {
-        // Make a node for the directory
-        new_node->type = 2;
-        parent_directory = &new_node->value.directory;
-        parent_directory->num_children = ((size_t) 1);  // Set initial number of children to 1 (for '..')
+    return fs;
+}
 
-        // Allocate memory for children block
-        ask_size = 4 * sizeof(fs_offset);  // Allocate space for 4 children initially
-        fs_offset *ptr = ((fs_offset *)malloc_impl(fsptr, NULL, &ask_size));
-        if ((ask_size != 0) || (ptr == NULL)) {
-            free_impl(fsptr, ptr);
-            *errnoptr = ENOSPC;  // No space left on device
-            return NULL;
-        }
-        // Save the offset to get to the children
-        parent_directory->children = pointer_to_offset(fsptr, ptr);
-        // Set first child to point to its parent
-        *ptr = pointer_to_offset(fsptr, parent_node);
+void fs_handle_destroy(fs_handle_t *fs) {
+    if (fs == NULL) {
+        return;
     }
 
-    return new_node;
+    dcache_destroy(fs->dcache);
+    free(fs);
 }
 
-void remove_data(void *fsptr, file_block_t *block, size_t size) {
-  // Check if the block is NULL
-  if (block == NULL) {
-    return;
-  }
-
-  size_t idx = 0;
+int fs_handle_print_stats(fs_handle_t *fs, char *buf, size_t size) {
+    superblock_t *sb = (superblock_t *)fs->fsptr;
+    fs_totals_t *totals = &sb->totals;
+    alloc_stats_t *stats = &fs->stats;
+    size_t largest = largest_free_block(fs->fsptr);
+    unsigned int fragmentation = free_fragmentation(fs->fsptr);
+
+    return snprintf(buf, size,
+                    "size %zu\n"
+                    "free_bytes %zu\n"
+                    "free_blocks %zu\n"
+                    "used_blocks %zu\n"
+                    "inodes %zu\n"
+                    "largest_free_block %zu\n"
+                    "fragmentation %u.%u%%\n"
+                    "malloc_calls %llu\n"
+                    "free_calls %llu\n"
+                    "realloc_calls %llu\n"
+                    "realloc_moved_bytes %llu\n"
+                    "free_list_ops %llu\n"
+                    "compact_runs %zu\n"
+                    "compact_moves %zu\n"
+                    "compact_moved_bytes %zu\n",
+                    sb->size, totals->free_bytes, totals->free_blocks, totals->used_blocks,
+                    totals->num_objects[SLAB_INODE], largest, fragmentation / 10, fragmentation % 10,
+                    (unsigned long long)__atomic_load_n(&stats->malloc_calls, __ATOMIC_RELAXED),
+                    (unsigned long long)__atomic_load_n(&stats->free_calls, __ATOMIC_RELAXED),
+                    (unsigned long long)__atomic_load_n(&stats->realloc_calls, __ATOMIC_RELAXED),
+                    (unsigned long long)__atomic_load_n(&stats->realloc_moved, __ATOMIC_RELAXED),
+                    (unsigned long long)__atomic_load_n(&stats->list_ops, __ATOMIC_RELAXED),
+                    fs->compact_runs, fs->compact_moves, fs->compact_bytes);
+}
 
-  // Find the position to cut the file and free the rest
-  while (size != 0) {
-    // If cutting within this block
-    if (size > block->allocated) {
-      size -= block->allocated;
-      block = offset_to_pointer(fsptr, block->next);
-    } else {
-      idx = size;
-      size = 0;
+static int compact_ref_push(compact_ref_t **refsptr, size_t *countptr, size_t *capacityptr,
+                            fs_offset block, fs_offset holder, size_t parent, fs_offset file) {
+    if (*countptr == *capacityptr) {
+        size_t capacity = *capacityptr < 64 ? 64 : 2 * (*capacityptr);
+        compact_ref_t *refs = (compact_ref_t *)realloc(*refsptr, capacity * sizeof(compact_ref_t));
+        if (refs == NULL) {
+            return 0;
+        }
+        *refsptr = refs;
+        *capacityptr = capacity;
     }
-  }
 
-  // Free the data starting at idx
-  if ((idx + sizeof(data_block_t)) < block->allocated) {
-    size_t *header = (size_t *)&((char *)offset_to_pointer(fsptr, block->data))[idx];
-    *header = block->allocated - idx - sizeof(size_t);
-    // Free the memory
-    free_impl(fsptr, ((void *)header) + sizeof(size_t));
-  }
-
-  // Free all data and blocks after this one
-  block = offset_to_pointer(fsptr, block->next);
-  file_block_t *next_block;
+    compact_ref_t *ref = &(*refsptr)[(*countptr)++];
+    ref->block = block;
+    ref->holder = holder;
+    ref->parent = parent;
+    ref->file = file;
+    return 1;
+}
 
-  while (block != fsptr) {
-    // Free the data block
-    free_impl(fsptr, offset_to_pointer(fsptr, block->data));
+// Lists the movable blocks of an inode and everything below it
+static int compact_collect(void *fsptr, inode_t *node, int move_data, compact_ref_t **refsptr,
+                           size_t *countptr, size_t *capacityptr) {
+    if ((node->name_len > NAME_INLINE_LEN) &&
+        !compact_ref_push(refsptr, countptr, capacityptr, node->name.offset,
+                          pointer_to_offset(fsptr, &node->name.offset), COMPACT_FIXED, 0)) {
+        return 0;
+    }
 
-    // Get the next block before freeing the current block
-    next_block = offset_to_pointer(fsptr, block->next);
-    // Free the file block
-    free_impl(fsptr, block);
+    if (node->type == 1) {
+        inode_file_t *file = &node->value.file;
+        if ((node->flags & INODE_INLINE) || (file->extents == 0)) {
+            return 1;
+        }
+        size_t array = *countptr;
+        if (!compact_ref_push(refsptr, countptr, capacityptr, file->extents,
+                              pointer_to_offset(fsptr, &file->extents), COMPACT_FIXED, 0)) {
+            return 0;
+        }
 
-    // Update the block pointer to the next one
-    block = next_block;
-  }
-}
+        // The data fields lie in the extent array, which may move before them
+        extent_t *extents = offset_to_pointer(fsptr, file->extents);
+        for (size_t i = 0; move_data && (i < file->num_extents); i++) {
+            if (!compact_ref_push(refsptr, countptr, capacityptr, extents[i].data,
+                                  i * sizeof(extent_t) + offsetof(extent_t, data), array,
+                                  pointer_to_offset(fsptr, file))) {
+                return 0;
+            }
+        }
+        return 1;
+    }
 
-file_block_t *malloc_file_block(void *fsptr, int *errnoptr) {
-    size_t block_size = sizeof(file_block_t);
-    file_block_t *block = malloc_impl(fsptr, NULL, &block_size);
-    if (!block) {
-        *errnoptr = ENOSPC; // No space left on device
-        return NULL;
+    inode_directory_t *directory = &node->value.directory;
+    size_t table = *countptr;
+    if (!compact_ref_push(refsptr, countptr, capacityptr, directory->children,
+                          pointer_to_offset(fsptr, &directory->children), COMPACT_FIXED, 0)) {
+        return 0;
     }
-    memset(block, 0, sizeof(file_block_t));
-    return block;
-}
 
-int append_data_block(void *fsptr, file_block_t *block, size_t size, int *errnoptr) {
-    size_t block_space = block->size - block->allocated;
-    size_t append_size = size < block_space ? size : block_space;
-    void *data_block = &((char *)offset_to_pointer(fsptr, block->data))[block->allocated];
-    memset(data_block, 0, append_size);
-    block->allocated += append_size;
-    if (append_size < size) {
-        *errnoptr = ENOSPC;
+    // Like the data of extents, the pages are referred to from the page table
+    fs_offset *pages = offset_to_pointer(fsptr, directory->children);
+    for (size_t i = 0; i <= (directory->num_children - 1) / DIR_PAGE_SLOTS; i++) {
+        if (!compact_ref_push(refsptr, countptr, capacityptr, pages[i], i * sizeof(fs_offset),
+                              table, 0)) {
+            return 0;
+        }
+    }
+    if ((directory->index != 0) &&
+        !compact_ref_push(refsptr, countptr, capacityptr, directory->index,
+                          pointer_to_offset(fsptr, &directory->index), COMPACT_FIXED, 0)) {
         return 0;
     }
+    for (size_t i = ((size_t)1); i < directory->num_children; i++) {
+        if (!compact_collect(fsptr, offset_to_pointer(fsptr, *dir_child(fsptr, directory, i)),
+                             move_data, refsptr, countptr, capacityptr)) {
+            return 0;
+        }
+    }
     return 1;
 }
 
-int extend_block_with_zeros(void *fsptr, file_block_t *block, size_t size) {
-    size_t block_space = block->size - block->allocated;
-    size_t append_size = size < block_space ? size : block_space;
-    void *data_block = &((char *)offset_to_pointer(fsptr, block->data))[block->allocated];
-    memset(data_block, 0, append_size);
-    block->allocated += append_size;
-    return append_size == size ? 1 : 0;
-}
-
-void free_file_blocks(void *fsptr, fs_offset first_block) {
-    file_block_t *block = offset_to_pointer(fsptr, first_block);
-    file_block_t *next_block;
+static int compare_refs_descending(const void *a, const void *b) {
+    fs_offset x = (*(compact_ref_t *const *)a)->block;
+    fs_offset y = (*(compact_ref_t *const *)b)->block;
 
-    while (block != NULL) {
-        next_block = offset_to_pointer(fsptr, block->next);
-        free_impl(fsptr, block); // Free the current block
-        block = next_block; // Move to the next block
-    }
+    return (x < y) - (x > y);
 }
 
-int add_data(void *fsptr, inode_file_t *file, size_t size, int *errnoptr) {
-  file_block_t *block = offset_to_pointer(fsptr, file->first_block);
-
-  // Variables for later use
-  file_block_t *prev_block = NULL;
-  //   size_t initial_file_size = file->size;
-
-  // Handle case when file is empty: append first one manually
-  if (((void *)block) == fsptr) {
-    block = malloc_file_block(fsptr, errnoptr);
-    if (!block)
-      return -1;
-    // Append first file_block
-    file->first_block = pointer_to_offset(fsptr, block);
-    // Add the first data block
-    size_t block_size = size < BLOCK_SIZE ? size : BLOCK_SIZE;
-    if (!append_data_block(fsptr, block, block_size, errnoptr))
-      return -1;
-    size -= block_size;
-  }
-  // Extend the last block by appending zeros
-  else {
-    while (block->next != 0) {
-      size_t block_space = block->size - block->allocated;
-      size_t append_size = size < block_space ? size : block_space;
-      if (!extend_block_with_zeros(fsptr, block, append_size))
-        return -1;
-      size -= append_size;
-      if (size == 0)
+size_t fs_handle_compact(fs_handle_t *fs, size_t budget, int move_data) {
+    void *fsptr = fs->fsptr;
+    compact_ref_t *refs = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t moved = 0;
+
+    // Slabs stay where they are, so inodes never move: the dentry cache and the
+    // open handles stay valid, and only the blocks hanging off inodes are listed
+    compact_ref_t **order = NULL;
+    if (compact_collect(fsptr, fs->root, move_data, &refs, &count, &capacity)) {
+        order = (compact_ref_t **)malloc((count > 0 ? count : 1) * sizeof(compact_ref_t *));
+    }
+    if (order == NULL) {
+        free(refs);
         return 0;
-      block = offset_to_pointer(fsptr, block->next);
     }
-  }
-
-  // Append blocks until all data is added
-  while (size > 0) {
-    block = malloc_file_block(fsptr, errnoptr);
-    if (!block)
-      return -1;
-    if (!append_data_block(fsptr, block, size, errnoptr)) {
-      free_file_blocks(fsptr, file->first_block);
-      return -1;
+    for (size_t i = 0; i < count; i++) {
+        order[i] = &refs[i];
     }
-    size -= block->allocated;
-    if (prev_block)
-      prev_block->next = pointer_to_offset(fsptr, block);
-    prev_block = block;
-  }
-
-  return 0;
-}
-
-/* End of helper functions */
-
-int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr, uid_t uid,
-                          gid_t gid, const char *path, struct stat *stbuf) {
-    // Mount the filesystem
-    mount_filesystem(fsptr, fssize);
+    qsort(order, count, sizeof(compact_ref_t *), compare_refs_descending);
+
+    // Move blocks from the top down into the lowest free block they fit in,
+    // so that the space they leave merges with the free memory around it
+    fs->compact_runs++;
+    for (size_t i = 0; (i < count) && (moved < budget); i++) {
+        compact_ref_t *ref = order[i];
+        data_block_t *old = offset_to_pointer(fsptr, ref->block - ALLOC_HEADER);
+        data_block_t *block = get_memory_block_below(fsptr, &fs->stats, block_size(old), ref->block - ALLOC_HEADER);
+        if (block == NULL) {
+            continue;
+        }
 
-    // Resolve the path to get the corresponding inode
-    inode_t *node = resolve_path(fsptr, path, 0);
+        // The copy is not referred to until the switch, which is a single journaled write
+        // A page table must read 0 past the old capacity
+        void *data = ((void *)block) + ALLOC_HEADER;
+        size_t old_size = usable_size(fsptr, offset_to_pointer(fsptr, ref->block));
+        size_t new_size = usable_size(fsptr, data);
+        memcpy(data, offset_to_pointer(fsptr, ref->block), old_size);
+        memset(data + old_size, 0, new_size - old_size);
+        dirty_mark(fsptr, data, new_size);
+        fs_offset base = (ref->parent == COMPACT_FIXED) ? 0 : refs[ref->parent].block;
+        fs_offset *holder = offset_to_pointer(fsptr, base + ref->holder);
+        journal_log(fsptr, holder, sizeof(fs_offset));
+        *holder = pointer_to_offset(fsptr, data);
+
+        // The free block taken may have been too small to split
+        if (ref->file != 0) {
+            inode_file_t *file = offset_to_pointer(fsptr, ref->file);
+            journal_log(fsptr, &file->allocated, sizeof(size_t));
+            file->allocated += new_size - old_size;
+        }
+        free_impl(fsptr, &fs->stats, offset_to_pointer(fsptr, ref->block));
+        journal_commit(fsptr);
 
-    // Path could not be resolved
-    if (node == NULL) {
-        *errnoptr = ENOENT;
-        return -1;
+        ref->block = pointer_to_offset(fsptr, data);
+        fs->compact_moves++;
+        fs->compact_bytes += old_size;
+        moved += old_size;
     }
 
+    free(order);
+    free(refs);
+    return moved;
+}
+
+// Fills in the attributes of an inode; every one of them is stored, so nothing is walked
+static void fill_stat(void *fsptr, inode_t *node, uid_t uid, gid_t gid, struct stat *stbuf) {
     // Set UID and GID
     stbuf->st_uid = uid;
     stbuf->st_gid = gid;
@@ -1046,32 +2727,47 @@ int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr, uid_t uid,
         stbuf->st_mode = __S_IFREG; // Regular file
         stbuf->st_nlink = ((nlink_t)1); // Number of hard links
         stbuf->st_size = (off_t) node->value.file.size; // Size of the file
-        stbuf->st_atime = (__time_t) node->time[0].tv_sec; // Last access time
-        stbuf->st_mtime = (__time_t) node->time[1].tv_sec; // Last modification time
+        size_t allocated = (node->flags & INODE_INLINE) ? ((size_t)0) : node->value.file.allocated;
+        stbuf->st_blocks = (blkcnt_t) ((allocated + 511) / 512); // Allocated 512-byte units, none if inline
     } else {
-        // Directory attributes
+        // Directory attributes: "." and the entry in the parent, plus ".." of each subdirectory
         stbuf->st_mode = __S_IFDIR; // Directory
         inode_directory_t *directory = &node->value.directory;
-        fs_offset *children = offset_to_pointer(fsptr, directory->children);
-        stbuf->st_nlink = ((nlink_t)2); // Number of hard links (minimum 2 for directories)
-        for (size_t i = 1; i < directory->num_children; i++) {
-            inode_t *child_node = (inode_t *)offset_to_pointer(fsptr, children[i]);
-            if (child_node->type == 2) {
-                stbuf->st_nlink++;
-            } 
-        }
+        stbuf->st_nlink = (nlink_t) (((size_t)2) + directory->num_subdirs);
+        size_t allocated = dir_children_allocated(fsptr, directory) +
+                           directory->index_size * sizeof(dir_index_entry_t);
+        stbuf->st_blocks = (blkcnt_t) ((allocated + 511) / 512); // Children list and hash index
+    }
+    stbuf->st_atim.tv_sec = __atomic_load_n(&node->time[0].tv_sec, __ATOMIC_RELAXED); // Last access time
+    stbuf->st_atim.tv_nsec = __atomic_load_n(&node->time[0].tv_nsec, __ATOMIC_RELAXED);
+    stbuf->st_mtim = node->time[1]; // Last modification time
+    stbuf->st_ctim = node->time[1]; // No separate change time is kept
+}
+
+/* End of helper functions */
+
+int __myfs_getattr_implem(fs_handle_t *fs, int *errnoptr,
+                          uid_t uid, gid_t gid, const char *path, struct stat *stbuf) {
+    // Resolve the path to get the corresponding inode
+    inode_t *node = resolve_path(fs, path, 0);
+
+    // Path could not be resolved
+    if (node == NULL) {
+        *errnoptr = ENOENT;
+        return -1;
     }
 
+    fill_stat(fs->fsptr, node, uid, gid, stbuf);
+
     return 0;
 }
 
-int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+int __myfs_readdir_implem(fs_handle_t *fs, int *errnoptr,
                           const char *path, char ***namesptr) {
-    // Mount the filesystem
-    mount_filesystem(fsptr, fssize);
+    void *fsptr = fs->fsptr;
 
     // Resolve the path to get the corresponding inode
-    inode_t *node = resolve_path(fsptr, path, 0);
+    inode_t *node = resolve_path(fs, path, 0);
 
     // Path could not be resolved
     if (node == NULL) {
@@ -1096,7 +2792,6 @@ int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
     size_t n_children = directory->num_children;
     // Allocate space for the names of all children, except "." and ".."
     void **ptr = (void **)calloc(n_children - ((size_t)1), sizeof(char *));
-    fs_offset *children = offset_to_pointer(fsptr, directory->children);
 
     // Check that calloc was successful
     if (ptr == NULL) {
@@ -1108,10 +2803,10 @@ int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
     size_t len;
     // Fill the array with the names of the directory entries
     for (size_t i = ((size_t)1); i < n_children; i++) {
-      node = ((inode_t *)offset_to_pointer(fsptr, children[i]));  // Child node
-      len = strlen(node->name);
+      node = ((inode_t *)offset_to_pointer(fsptr, *dir_child(fsptr, directory, i)));  // Child node
+      len = node->name_len;
       names[i - 1] = (char *)malloc(len + 1);
-      strcpy(names[i - 1], node->name);  // strcpy(dst,src)
+      memcpy(names[i - 1], inode_name(fsptr, node), len);
       names[i - 1][len] = '\0';
     }
 
@@ -1119,12 +2814,69 @@ int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
     return ((int)(n_children - 1));
 }
 
-int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
+/* Implements the readdir system call on the filesystem of the handle
+   fs the way FUSE calls it, without building a list of names first.
+
+   If path can be followed and describes a directory, its entries are
+   handed to filler one by one, straight from the children list:
+   first . and .., then the files and subdirectories. Each entry comes
+   with its attributes, filled in as __myfs_getattr_implem would with
+   uid and gid, and with the offset of the entry that follows it.
+
+   The listing starts behind the entry whose offset is given, 0
+   starting from the beginning, and stops early once filler returns
+   nonzero; calling again with the offset of the last entry taken
+   resumes there. Entries are numbered by their slot in the children
+   list: an entry removed between two calls moves the last one into
+   its slot, which may then be skipped, as entries created or removed
+   meanwhile may be.
+
+   Returns 0 on success. On failure, -1 is returned and *errnoptr is
+   set appropriately.
+
+*/
+int __myfs_readdir_fill_implem(fs_handle_t *fs, int *errnoptr, uid_t uid, gid_t gid,
+                               const char *path, off_t offset, void *buf, dir_filler_t filler) {
+    void *fsptr = fs->fsptr;
+
+    // Resolve the path to get the corresponding inode
+    inode_t *node = resolve_path(fs, path, 0);
+    if (node == NULL) {
+        *errnoptr = ENOENT;  // No such file or directory
+        return -1;
+    }
+    if (node->type != 2) {
+        *errnoptr = ENOTDIR;  // Not a directory
+        return -1;
+    }
+    if (offset < 0) {
+        *errnoptr = EINVAL;  // Invalid argument
+        return -1;
+    }
+
+    // Slot i of the children list is entry i + 1: "." is entry 0, the parent in slot 0 entry 1
+    inode_directory_t *directory = &node->value.directory;
+    struct stat stbuf;
+    for (size_t i = (size_t)offset; i <= directory->num_children; i++) {
+        inode_t *entry = (i == 0) ? node : offset_to_pointer(fsptr, *dir_child(fsptr, directory, i - 1));
+        const char *name = (i == 0) ? "." : ((i == 1) ? ".." : inode_name(fsptr, entry));
+        memset(&stbuf, 0, sizeof(struct stat));
+        fill_stat(fsptr, entry, uid, gid, &stbuf);
+        if (filler(buf, name, &stbuf, (off_t)(i + 1)) != 0) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int __myfs_mknod_implem(fs_handle_t *fs, int *errnoptr,
                         const char *path) {
-  mount_filesystem(fsptr, fssize);
+  void *fsptr = fs->fsptr;
 
   // Make a directory, 1 because it is a file
-  inode_t *node = make_node(fsptr, path, errnoptr, 1);
+  inode_t *node = make_node(fs, path, errnoptr, 1);
+  journal_commit(fsptr);
 
   // Check if the node was successfully created, if it wasn't the errnoptr was
   // already set so we just return failure with -1
@@ -1136,7 +2888,7 @@ int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
 }
 
 /* Implements an emulation of the unlink system call for regular files
-   on the filesystem of size fssize pointed to by fsptr.
+   on the filesystem of the handle fs.
 
    This function is called only for the deletion of regular files.
 
@@ -1144,17 +2896,60 @@ int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
 
    On failure, -1 is returned and *errnoptr is set appropriately.
 
-   The error codes are documented in man 2 unlink.
+   The error codes are documented in man 2 unlink.
+
+*/
+int __myfs_unlink_implem(fs_handle_t *fs, int *errnoptr,
+                        const char *path) {
+  void *fsptr = fs->fsptr;
+
+  // Resolve the parent directory of the file
+  inode_t *parent_node = resolve_path(fs, path, 1);
+  if (parent_node == NULL) {
+    *errnoptr = ENOENT;  // No such file or directory
+    return -1;
+  }
+  if (parent_node->type != 2) {
+    *errnoptr = ENOTDIR;  // Not a directory
+    return -1;
+  }
+
+  size_t len;
+  const char *name = get_last_token(path, &len);
+
+  // Find the file in the parent's hash index
+  inode_directory_t *parent_directory = &parent_node->value.directory;
+  dir_index_entry_t *entry = dir_index_find(fsptr, parent_directory, name, len);
+  if (entry == NULL) {
+    *errnoptr = ENOENT;  // No such file or directory
+    return -1;
+  }
+
+  inode_t *node = offset_to_pointer(fsptr, *dir_child(fsptr, parent_directory, entry->slot));
+  if (node->type != 1) {
+    *errnoptr = EISDIR;  // Is a directory
+    return -1;
+  }
+
+  // Free the data first: freeing a large file commits in between, and a crash
+  // must leave an emptied file rather than an unreachable one behind
+  if (!(node->flags & INODE_INLINE)) {
+    file_free(fsptr, &fs->stats, &node->value.file);
+  }
+
+  // Unlink the file, then free its inode
+  dcache_remove(fs->dcache, path, path_length(path));
+  remove_child(fsptr, &fs->stats, parent_directory, entry);
+  update_time(fsptr, parent_node, 1);
+  inode_free_name(fsptr, &fs->stats, node);
+  slab_free(fsptr, &fs->stats, node);
+  journal_commit(fsptr);
 
-*/
-int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr,
-                        const char *path) {
-  /* STUB */
-  return -1;
+  return 0;
 }
 
 /* Implements an emulation of the rmdir system call on the filesystem 
-   of size fssize pointed to by fsptr. 
+   of the handle fs. 
 
    The call deletes the directory indicated by path.
 
@@ -1168,18 +2963,61 @@ int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr,
    The error codes are documented in man 2 rmdir.
 
 */
-int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+int __myfs_rmdir_implem(fs_handle_t *fs, int *errnoptr,
                         const char *path) {
-  /* STUB */
-  return -1;
+  void *fsptr = fs->fsptr;
+
+  // The root directory cannot be removed
+  inode_t *node = resolve_path(fs, path, 0);
+  if (node == NULL) {
+    *errnoptr = ENOENT;  // No such file or directory
+    return -1;
+  }
+  if (node == offset_to_pointer(fsptr, ((superblock_t *)fsptr)->root_directory)) {
+    *errnoptr = EBUSY;  // Device or resource busy
+    return -1;
+  }
+  if (node->type != 2) {
+    *errnoptr = ENOTDIR;  // Not a directory
+    return -1;
+  }
+
+  // Only ".." may be left in the directory
+  inode_directory_t *directory = &node->value.directory;
+  if (directory->num_children != 1) {
+    *errnoptr = ENOTEMPTY;  // Directory not empty
+    return -1;
+  }
+
+  // Find the directory in its parent's hash index
+  inode_t *parent_node = offset_to_pointer(fsptr, *dir_child(fsptr, directory, 0));
+  inode_directory_t *parent_directory = &parent_node->value.directory;
+  dir_index_entry_t *entry = dir_index_find(fsptr, parent_directory, inode_name(fsptr, node), node->name_len);
+  if (entry == NULL) {
+    *errnoptr = EFAULT;  // The filesystem is in a bad state
+    return -1;
+  }
+
+  // Unlink the directory, then free its children list, its index and its inode
+  dcache_remove(fs->dcache, path, path_length(path));
+  remove_child(fsptr, &fs->stats, parent_directory, entry);
+  update_time(fsptr, parent_node, 1);
+  dir_children_free(fsptr, &fs->stats, directory);
+  dir_index_free(fsptr, &fs->stats, directory);
+  inode_free_name(fsptr, &fs->stats, node);
+  slab_free(fsptr, &fs->stats, node);
+  journal_commit(fsptr);
+
+  return 0;
 }
 
-int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+int __myfs_mkdir_implem(fs_handle_t *fs, int *errnoptr,
                         const char *path) {
-  mount_filesystem(fsptr, fssize);
+  void *fsptr = fs->fsptr;
 
   // Make a directory, 0 because it is not a file
-  inode_t *node = make_node(fsptr, path, errnoptr, 0);
+  inode_t *node = make_node(fs, path, errnoptr, 0);
+  journal_commit(fsptr);
 
   // Check if the node was successfully created, if it wasn't the errnoptr was
   // already set so we just return failure with -1
@@ -1192,7 +3030,7 @@ int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
 
 
 /* Implements an emulation of the rename system call on the filesystem 
-   of size fssize pointed to by fsptr. 
+   of the handle fs. 
 
    The call moves the file or directory indicated by from to to.
 
@@ -1207,15 +3045,154 @@ int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
    The error codes are documented in man 2 rename.
 
 */
-int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
+int __myfs_rename_implem(fs_handle_t *fs, int *errnoptr,
                          const char *from, const char *to) {
-  /* STUB */
-  return -1;
+  void *fsptr = fs->fsptr;
+
+  // Resolve both parent directories
+  inode_t *from_parent = resolve_path(fs, from, 1);
+  inode_t *to_parent = resolve_path(fs, to, 1);
+  if ((from_parent == NULL) || (to_parent == NULL)) {
+    *errnoptr = ENOENT;  // No such file or directory
+    return -1;
+  }
+  if ((from_parent->type != 2) || (to_parent->type != 2)) {
+    *errnoptr = ENOTDIR;  // Not a directory
+    return -1;
+  }
+
+  size_t from_len, to_len;
+  const char *from_name = get_last_token(from, &from_len);
+  const char *to_name = get_last_token(to, &to_len);
+
+  // The root directory has no name to change
+  if ((from_len == 0) || (to_len == 0)) {
+    *errnoptr = EBUSY;  // Device or resource busy
+    return -1;
+  }
+  if (to_len > NAME_MAX_LEN) {
+    *errnoptr = ENAMETOOLONG;  // File name too long
+    return -1;
+  }
+
+  inode_directory_t *from_directory = &from_parent->value.directory;
+  inode_directory_t *to_directory = &to_parent->value.directory;
+  dir_index_entry_t *entry = dir_index_find(fsptr, from_directory, from_name, from_len);
+  if (entry == NULL) {
+    *errnoptr = ENOENT;  // No such file or directory
+    return -1;
+  }
+  inode_t *node = offset_to_pointer(fsptr, *dir_child(fsptr, from_directory, entry->slot));
+
+  // A directory cannot become its own descendant
+  if (node->type == 2) {
+    for (inode_t *up = to_parent; up != fs->root;
+         up = offset_to_pointer(fsptr, *dir_child(fsptr, &up->value.directory, 0))) {
+      if (up == node) {
+        *errnoptr = EINVAL;  // Invalid argument
+        return -1;
+      }
+    }
+  }
+
+  // An existing target is replaced, if it is of the same kind
+  dir_index_entry_t *to_entry = dir_index_find(fsptr, to_directory, to_name, to_len);
+  inode_t *target = NULL;
+  if (to_entry != NULL) {
+    target = offset_to_pointer(fsptr, *dir_child(fsptr, to_directory, to_entry->slot));
+    if (target == node) {
+      return 0;
+    }
+    if ((node->type == 2) && (target->type != 2)) {
+      *errnoptr = ENOTDIR;  // Not a directory
+      return -1;
+    }
+    if ((node->type != 2) && (target->type == 2)) {
+      *errnoptr = EISDIR;  // Is a directory
+      return -1;
+    }
+    if ((target->type == 2) && (target->value.directory.num_children != 1)) {
+      *errnoptr = ENOTEMPTY;  // Directory not empty
+      return -1;
+    }
+  }
+
+  // Allocate everything first: remove_child may free a page, which must not be
+  // handed out again before the commit. Reserving may rebuild the indexes, so
+  // the entries are looked up again behind it.
+  if (target == NULL) {
+    if (!dir_children_reserve(fsptr, &fs->stats, to_directory) || !dir_index_reserve(fsptr, &fs->stats, to_directory)) {
+      *errnoptr = ENOSPC;  // No space left on device
+      return -1;
+    }
+  }
+  entry = dir_index_find(fsptr, from_directory, from_name, from_len);
+  void *old_name = (node->name_len > NAME_INLINE_LEN) ? offset_to_pointer(fsptr, node->name.offset) : NULL;
+  if (!inode_set_name(fsptr, &fs->stats, node, to_name, to_len)) {
+    *errnoptr = ENOSPC;  // No space left on device
+    return -1;
+  }
+
+  // Put the inode in the place of the target, whose index entry has the same name,
+  // or in a new place at the end of the target directory
+  if (target != NULL) {
+    fs_offset *child = dir_child(fsptr, to_directory, dir_index_find(fsptr, to_directory, to_name, to_len)->slot);
+    journal_log(fsptr, child, sizeof(fs_offset));
+    *child = pointer_to_offset(fsptr, node);
+  } else {
+    fs_offset *child = dir_child(fsptr, to_directory, to_directory->num_children);
+    journal_log(fsptr, child, sizeof(fs_offset));
+    *child = pointer_to_offset(fsptr, node);
+    dir_index_insert(fsptr, to_directory, hash_name(to_name, to_len), to_directory->num_children);
+    journal_log(fsptr, to_directory, sizeof(inode_directory_t));
+    to_directory->num_children++;
+    if (node->type == 2) {
+      to_directory->num_subdirs++;
+    }
+  }
+
+  // Take it out of its old directory; in the same directory, this moves the
+  // last child, which may be the inode itself, by its new name
+  remove_child(fsptr, &fs->stats, from_directory, entry);
+  if ((node->type == 2) && (from_parent != to_parent)) {
+    fs_offset *dotdot = dir_child(fsptr, &node->value.directory, 0);
+    journal_log(fsptr, dotdot, sizeof(fs_offset));
+    *dotdot = pointer_to_offset(fsptr, to_parent);
+  }
+  if (old_name != NULL) {
+    free_impl(fsptr, &fs->stats, old_name);
+  }
+  update_time(fsptr, from_parent, 1);
+  update_time(fsptr, to_parent, 1);
+
+  // Paths below a directory all change; a file only has its own two
+  if ((node->type == 2) || ((target != NULL) && (target->type == 2))) {
+    dcache_invalidate(fs->dcache);
+  } else {
+    dcache_remove(fs->dcache, from, path_length(from));
+    dcache_remove(fs->dcache, to, path_length(to));
+  }
+
+  // Free the replaced target behind the change of names: should freeing a large
+  // one commit in between, a crash can only leak what is left of it
+  if (target != NULL) {
+    if (target->type == 2) {
+      dir_children_free(fsptr, &fs->stats, &target->value.directory);
+      dir_index_free(fsptr, &fs->stats, &target->value.directory);
+    } else if (!(target->flags & INODE_INLINE)) {
+      file_free(fsptr, &fs->stats, &target->value.file);
+    }
+    inode_free_name(fsptr, &fs->stats, target);
+    slab_free(fsptr, &fs->stats, target);
+  }
+  journal_commit(fsptr);
+
+  return 0;
 }
 
-int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
-                           const char *path, off_t offset) {
-  mount_filesystem(fsptr, fssize);
+int __myfs_truncate_implem(fs_handle_t *fs, int *errnoptr,
+                           const char *path, file_handle_t *handle, off_t offset) {
+  void *fsptr = fs->fsptr;
 
   // Check if offset is negative
   if (offset < 0) {
@@ -1225,8 +3202,8 @@ int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
 
   size_t new_size = (size_t)offset;
 
-  // Resolve the path to get the node representing the file
-  inode_t *node = resolve_path(fsptr, path, 0);
+  // Resolve the path (or the handle) to get the node representing the file
+  inode_t *node = resolve_handle(fs, path, handle);
 
   // Check if the path is valid
   if (node == NULL) {
@@ -1235,44 +3212,56 @@ int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
   }
 
   // Ensure that the node represents a file
-  if (node->type == 1) {
+  if (node->type != 1) {
     *errnoptr = EISDIR; // Is a directory
     return -1;
   }
 
   inode_file_t *file = &node->value.file;
-  file_block_t *block = offset_to_pointer(fsptr, file->first_block);
 
   // If the new size is the same, do nothing
   if (file->size == new_size) {
-    update_time(node, 0); // File access only
+    update_time(fsptr, node, 0); // File access only
     return 0;
   }
+  // An inline file that stays small is cut or zero-filled in place
+  else if ((node->flags & INODE_INLINE) && (new_size <= FILE_INLINE_LEN)) {
+    update_time(fsptr, node, 1); // File access and modification
+    if (new_size > file->size) {
+      file_inline_reserve(fsptr, node, 0, new_size);
+    } else {
+      journal_log(fsptr, file, FILE_FIELDS_SIZE);
+      file->size = new_size;
+    }
+  }
   // If the new size is smaller, remove excess data
   else if (file->size > new_size) {
-    update_time(node, 1); // File access and modification
+    update_time(fsptr, node, 1); // File access and modification
+    file_shrink(fsptr, &fs->stats, file, new_size);
 
-    // Update the file size
-    file->size = new_size;
-
-    // Remove excess data from the file
-    remove_data(fsptr, block, new_size);
+    // Commit the cut on its own, the move back into the inode must not overflow the journal
+    if (new_size <= FILE_INLINE_LEN) {
+      journal_commit(fsptr);
+      file_unspill(fsptr, &fs->stats, node);
+    }
   }
-  // If the new size is larger, append zeros to extend the file
+  // If the new size is larger, the new bytes are a hole reading as zeros
   else {
-    update_time(node, 1); // File access and modification
-
-    // Extend the file by appending zeros
-    if (add_data(fsptr, file, new_size, errnoptr) != 0) {
+    if (!file_spill(fsptr, &fs->stats, node, new_size, errnoptr)) {
+      journal_commit(fsptr);
       return -1;
     }
+    update_time(fsptr, node, 1); // File access and modification
+    journal_log(fsptr, file, FILE_FIELDS_SIZE);
+    file->size = new_size;
   }
+  journal_commit(fsptr);
 
   return 0; // Success
 }
 
 /* Implements an emulation of the open system call on the filesystem 
-   of size fssize pointed to by fsptr, without actually performing the opening
+   of the handle fs, without actually performing the opening
    of the file (no file descriptor is returned).
 
    The call just checks if the file (or directory) indicated by path
@@ -1297,14 +3286,33 @@ int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
    The error codes are documented in man 2 open.
 
 */
-int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr,
-                       const char *path) {
-  /* STUB */
-  return -1;
+int __myfs_open_implem(fs_handle_t *fs, int *errnoptr,
+                       const char *path, file_handle_t **handleptr) {
+  void *fsptr = fs->fsptr;
+
+  // Opening only needs the path to lead somewhere
+  inode_t *node = resolve_path(fs, path, 0);
+  if (node == NULL) {
+    *errnoptr = ENOENT; // No such file or directory
+    return -1;
+  }
+
+  // Remember the inode, so that later calls on the handle need no path walk;
+  // inodes never move, and the high-level FUSE API keeps open files from being freed
+  file_handle_t *handle = (file_handle_t *)malloc(sizeof(file_handle_t));
+  if (handle == NULL) {
+    *errnoptr = ENOMEM; // Out of memory
+    return -1;
+  }
+  handle->node = pointer_to_offset(fsptr, node);
+  handle->cursor = 0;
+  *handleptr = handle;
+
+  return 0;
 }
 
 /* Implements an emulation of the read system call on the filesystem 
-   of size fssize pointed to by fsptr.
+   of the handle fs.
 
    The call copies up to size bytes from the file indicated by 
    path into the buffer, starting to read at offset. See the man page
@@ -1318,14 +3326,257 @@ int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr,
    The error codes are documented in man 2 read.
 
 */
-int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
-                       const char *path, char *buf, size_t size, off_t offset) {
-  /* STUB */
-  return -1;
+int __myfs_read_implem(fs_handle_t *fs, int *errnoptr,
+                       const char *path, file_handle_t *handle, char *buf, size_t size, off_t offset) {
+  void *fsptr = fs->fsptr;
+
+  // Check if offset is negative
+  if (offset < 0) {
+    *errnoptr = EINVAL; // Invalid argument
+    return -1;
+  }
+
+  // Resolve the path (or the handle) to get the node representing the file
+  inode_t *node = resolve_handle(fs, path, handle);
+  if (node == NULL) {
+    *errnoptr = ENOENT; // No such file or directory
+    return -1;
+  }
+  if (node->type != 1) {
+    *errnoptr = EISDIR; // Is a directory
+    return -1;
+  }
+
+  // Reads through one handle may run at once: each works on a copy of the cursor,
+  // and whichever finishes last leaves its position in the handle
+  size_t position = (handle != NULL) ? __atomic_load_n(&handle->cursor, __ATOMIC_RELAXED) : 0;
+  size_t *cursor = (handle != NULL) ? &position : NULL;
+
+  inode_file_t *file = &node->value.file;
+  update_time(fsptr, node, 0); // File access only
+
+  // Nothing is left to read at or beyond the end of the file
+  if (((size_t)offset) >= file->size) {
+    return 0;
+  }
+
+  // Read at most up to the end of the file; the count must fit the return value
+  size_t to_read = file->size - ((size_t)offset);
+  to_read = to_read < size ? to_read : size;
+  to_read = to_read < ((size_t)INT32_MAX) ? to_read : ((size_t)INT32_MAX);
+  if (node->flags & INODE_INLINE) {
+    memcpy(buf, file->data + offset, to_read);
+  } else {
+    file_read(fsptr, file, buf, to_read, (size_t)offset, cursor);
+  }
+  if (handle != NULL) {
+    __atomic_store_n(&handle->cursor, position, __ATOMIC_RELAXED);
+  }
+
+  return (int)to_read;
+}
+
+/* Implements the lookup part of the read system call on the filesystem
+   of the handle fs, for callers that move the data
+   themselves (e.g. by splicing it out of the backup-file).
+
+   The call behaves like __myfs_read_implem, but instead of copying
+   the bytes it describes where they are: *segmentsptr is set to an
+   array of 2 * (*countptr) entries, allocated with malloc, that the
+   caller must free. Entry 2 * i is the offset in the image of the
+   i-th run of bytes, or 0 if the run is a hole reading as zeros;
+   entry 2 * i + 1 is its length.
+
+   On success, the number of bytes covered by the runs is returned.
+   The value zero is returned on an end-of-file condition, with
+   *segmentsptr set to NULL.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+*/
+int __myfs_read_extents_implem(fs_handle_t *fs, int *errnoptr,
+                               const char *path, file_handle_t *handle, size_t size, off_t offset,
+                               size_t **segmentsptr, size_t *countptr) {
+  void *fsptr = fs->fsptr;
+
+  *segmentsptr = NULL;
+  *countptr = 0;
+
+  // Check if offset is negative
+  if (offset < 0) {
+    *errnoptr = EINVAL; // Invalid argument
+    return -1;
+  }
+
+  // Resolve the path (or the handle) to get the node representing the file
+  inode_t *node = resolve_handle(fs, path, handle);
+  if (node == NULL) {
+    *errnoptr = ENOENT; // No such file or directory
+    return -1;
+  }
+  if (node->type != 1) {
+    *errnoptr = EISDIR; // Is a directory
+    return -1;
+  }
+
+  // Reads through one handle may run at once: each works on a copy of the cursor,
+  // and whichever finishes last leaves its position in the handle
+  size_t position = (handle != NULL) ? __atomic_load_n(&handle->cursor, __ATOMIC_RELAXED) : 0;
+  size_t *cursor = (handle != NULL) ? &position : NULL;
+
+  inode_file_t *file = &node->value.file;
+  update_time(fsptr, node, 0); // File access only
+
+  // Nothing is left to read at or beyond the end of the file
+  if (((size_t)offset) >= file->size) {
+    return 0;
+  }
+
+  // Read at most up to the end of the file; the count must fit the return value
+  size_t to_read = file->size - ((size_t)offset);
+  to_read = to_read < size ? to_read : size;
+  to_read = to_read < ((size_t)INT32_MAX) ? to_read : ((size_t)INT32_MAX);
+
+  // The bytes of an inline file are a single run inside its inode
+  if (node->flags & INODE_INLINE) {
+    size_t *segments = (size_t *)malloc(2 * sizeof(size_t));
+    if (segments == NULL) {
+      *errnoptr = ENOMEM; // Out of memory
+      return -1;
+    }
+    segments[0] = pointer_to_offset(fsptr, file->data + offset);
+    segments[1] = to_read;
+    *segmentsptr = segments;
+    *countptr = ((size_t)1);
+    return (int)to_read;
+  }
+
+  // Extents and holes alternate at worst, so this bounds the number of runs
+  size_t first = extent_find(fsptr, file, (size_t)offset, cursor);
+  size_t last = extent_find(fsptr, file, ((size_t)offset) + to_read - 1, NULL);
+  size_t *segments = (size_t *)malloc(2 * (2 * (last - first) + 3) * sizeof(size_t));
+  if (segments == NULL) {
+    *errnoptr = ENOMEM; // Out of memory
+    return -1;
+  }
+  size_t count = file_segments(fsptr, file, to_read, (size_t)offset, cursor, segments);
+  if (handle != NULL) {
+    __atomic_store_n(&handle->cursor, position, __ATOMIC_RELAXED);
+  }
+
+  *segmentsptr = segments;
+  *countptr = count;
+  return (int)to_read;
+}
+
+/* Implements the allocation part of the write system call on the
+   filesystem of the handle fs, for callers that
+   move the data themselves (e.g. out of a pipe FUSE spliced it into).
+
+   The call behaves like __myfs_write_implem, but instead of copying
+   the bytes it backs the range with memory and describes where it
+   lies, in the same format as __myfs_read_extents_implem: the caller
+   must fill all runs and free *segmentsptr. If it cannot, it must
+   truncate the file back to at most the size it had before, which
+   is returned in *old_sizeptr, as the bytes beyond it are garbage.
+
+   On success, the number of bytes covered by the runs is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+*/
+int __myfs_write_extents_implem(fs_handle_t *fs, int *errnoptr,
+                                const char *path, file_handle_t *handle, size_t size, off_t offset,
+                                size_t **segmentsptr, size_t *countptr, off_t *old_sizeptr) {
+  void *fsptr = fs->fsptr;
+
+  *segmentsptr = NULL;
+  *countptr = 0;
+
+  // Check if offset is negative
+  if (offset < 0) {
+    *errnoptr = EINVAL; // Invalid argument
+    return -1;
+  }
+
+  // Resolve the path (or the handle) to get the node representing the file
+  inode_t *node = resolve_handle(fs, path, handle);
+  size_t *cursor = (handle != NULL) ? &handle->cursor : NULL;
+  if (node == NULL) {
+    *errnoptr = ENOENT; // No such file or directory
+    return -1;
+  }
+  if (node->type != 1) {
+    *errnoptr = EISDIR; // Is a directory
+    return -1;
+  }
+
+  // The count must fit the return value, the end must fit the file size
+  size = size < ((size_t)INT32_MAX) ? size : ((size_t)INT32_MAX);
+  if (((size_t)offset) > SIZE_MAX - size) {
+    *errnoptr = EFBIG; // File too large
+    return -1;
+  }
+
+  inode_file_t *file = &node->value.file;
+  *old_sizeptr = (off_t)file->size;
+  if (size == 0) {
+    return 0;
+  }
+
+  // A range an inline file can still hold is a single run inside its inode
+  if ((node->flags & INODE_INLINE) && (((size_t)offset) + size <= FILE_INLINE_LEN)) {
+    size_t *segments = (size_t *)malloc(2 * sizeof(size_t));
+    if (segments == NULL) {
+      *errnoptr = ENOMEM; // Out of memory
+      return -1;
+    }
+    char *data = file_inline_reserve(fsptr, node, size, (size_t)offset);
+    segments[0] = pointer_to_offset(fsptr, data);
+    segments[1] = size;
+    *segmentsptr = segments;
+    *countptr = ((size_t)1);
+    update_time(fsptr, node, 1); // File access and modification
+    journal_commit(fsptr);
+    return (int)size;
+  }
+  if (!file_spill(fsptr, &fs->stats, node, ((size_t)offset) + size, errnoptr)) {
+    journal_commit(fsptr);
+    return -1;
+  }
+
+  // Back the range, then describe it: it has no holes any more
+  size_t reserved = file_reserve(fsptr, &fs->stats, file, size, (size_t)offset, cursor, errnoptr);
+  if (reserved == 0) {
+    journal_commit(fsptr);
+    return -1;
+  }
+  size_t first = extent_find(fsptr, file, (size_t)offset, NULL);
+  size_t last = extent_find(fsptr, file, ((size_t)offset) + reserved - 1, NULL);
+  size_t *segments = (size_t *)malloc(2 * (last - first + 1) * sizeof(size_t));
+  if (segments == NULL) {
+    if (file->size > (size_t)*old_sizeptr) {
+      file_shrink(fsptr, &fs->stats, file, (size_t)*old_sizeptr);
+    }
+    journal_commit(fsptr);
+    *errnoptr = ENOMEM; // Out of memory
+    return -1;
+  }
+  *countptr = file_segments(fsptr, file, reserved, (size_t)offset, cursor, segments);
+  *segmentsptr = segments;
+  update_time(fsptr, node, 1); // File access and modification
+
+  // The caller fills the runs before it releases its locks, thus before any sync
+  for (size_t i = 0; i < *countptr; i++) {
+    dirty_mark(fsptr, offset_to_pointer(fsptr, segments[2 * i]), segments[2 * i + 1]);
+  }
+  journal_commit(fsptr);
+
+  return (int)reserved;
 }
 
 /* Implements an emulation of the write system call on the filesystem 
-   of size fssize pointed to by fsptr.
+   of the handle fs.
 
    The call copies up to size bytes to the file indicated by 
    path into the buffer, starting to write at offset. See the man page
@@ -1339,14 +3590,145 @@ int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
    The error codes are documented in man 2 write.
 
 */
-int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
-                        const char *path, const char *buf, size_t size, off_t offset) {
-  /* STUB */
-  return -1;
+int __myfs_write_implem(fs_handle_t *fs, int *errnoptr,
+                        const char *path, file_handle_t *handle, const char *buf, size_t size, off_t offset) {
+  void *fsptr = fs->fsptr;
+
+  // Check if offset is negative
+  if (offset < 0) {
+    *errnoptr = EINVAL; // Invalid argument
+    return -1;
+  }
+
+  // Resolve the path (or the handle) to get the node representing the file
+  inode_t *node = resolve_handle(fs, path, handle);
+  size_t *cursor = (handle != NULL) ? &handle->cursor : NULL;
+  if (node == NULL) {
+    *errnoptr = ENOENT; // No such file or directory
+    return -1;
+  }
+  if (node->type != 1) {
+    *errnoptr = EISDIR; // Is a directory
+    return -1;
+  }
+
+  // The count must fit the return value, the end must fit the file size
+  size = size < ((size_t)INT32_MAX) ? size : ((size_t)INT32_MAX);
+  if (((size_t)offset) > SIZE_MAX - size) {
+    *errnoptr = EFBIG; // File too large
+    return -1;
+  }
+  if (size == 0) {
+    return 0;
+  }
+
+  // A range an inline file can still hold is copied into its inode
+  if ((node->flags & INODE_INLINE) && (((size_t)offset) + size <= FILE_INLINE_LEN)) {
+    memcpy(file_inline_reserve(fsptr, node, size, (size_t)offset), buf, size);
+    update_time(fsptr, node, 1); // File access and modification
+    journal_commit(fsptr);
+    return (int)size;
+  }
+  if (!file_spill(fsptr, &fs->stats, node, ((size_t)offset) + size, errnoptr)) {
+    journal_commit(fsptr);
+    return -1;
+  }
+
+  // Writing beyond the end of the file leaves a hole in between
+  size_t written = file_write(fsptr, &fs->stats, &node->value.file, buf, size, (size_t)offset, cursor, errnoptr);
+  journal_commit(fsptr);
+  if (written == 0) {
+    return -1;
+  }
+  update_time(fsptr, node, 1); // File access and modification
+
+  return (int)written;
+}
+
+/* Implements the lookup part of the fsync system call on the filesystem
+   of the handle fs, for the caller that writes the
+   image back (e.g. with msync on the backup-file mapping).
+
+   The call takes the pages of the image changed since they were last
+   synced off the dirty map and sets *rangesptr to an array of
+   2 * (*countptr) entries, allocated with malloc, that the caller must
+   free: entry 2 * i is the offset of the i-th run of changed pages,
+   entry 2 * i + 1 its length. All of them must be written back, or
+   the caller has to fall back to writing back the whole image.
+
+   If datasync is zero, all changed pages are returned, as the file's
+   metadata depends on the allocator and its directories. Otherwise
+   only the changed pages holding the file's data, its extent array
+   and its inode are, which is what is needed to read the data back.
+   With datasync zero only the dirty map is read, so the call may run
+   alongside other operations (see dirty_take() for what the caller
+   must wait for); otherwise the file must not change meanwhile.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+*/
+int __myfs_fsync_implem(fs_handle_t *fs, int *errnoptr,
+                        const char *path, file_handle_t *handle, int datasync,
+                        size_t **rangesptr, size_t *countptr) {
+  void *fsptr = fs->fsptr;
+  size_t fssize = fs->fssize;
+
+  size_t *ranges = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  int ok = 1;
+
+  *rangesptr = NULL;
+  *countptr = 0;
+
+  if (!datasync) {
+    ok = dirty_take(fsptr, 0, fssize, &ranges, &count, &capacity);
+  } else {
+    // Resolve the path (or the handle) to get the node representing the file
+    inode_t *node = resolve_handle(fs, path, handle);
+    if (node == NULL) {
+      *errnoptr = ENOENT; // No such file or directory
+      return -1;
+    }
+
+    ok = dirty_take(fsptr, pointer_to_offset(fsptr, node), sizeof(inode_t), &ranges, &count, &capacity);
+    if ((node->type == 1) && !(node->flags & INODE_INLINE)) {
+      inode_file_t *file = &node->value.file;
+      extent_t *extents = offset_to_pointer(fsptr, file->extents);
+      ok = ok && dirty_take(fsptr, file->extents, file->num_extents * sizeof(extent_t),
+                            &ranges, &count, &capacity);
+      for (size_t i = 0; ok && (i < file->num_extents); i++) {
+        ok = dirty_take(fsptr, extents[i].data, extents[i].length, &ranges, &count, &capacity);
+      }
+    }
+  }
+
+  // Pages taken off the map so far must not get lost
+  if (!ok) {
+    for (size_t i = 0; i < count; i++) {
+      dirty_mark(fsptr, offset_to_pointer(fsptr, ranges[2 * i]), ranges[2 * i + 1]);
+    }
+    free(ranges);
+    *errnoptr = ENOMEM; // Out of memory
+    return -1;
+  }
+
+  // The map rounds the end of the image up to a whole page
+  for (size_t i = 0; i < count; i++) {
+    if (ranges[2 * i] + ranges[2 * i + 1] > fssize) {
+      ranges[2 * i + 1] = fssize - ranges[2 * i];
+    }
+  }
+
+  *rangesptr = ranges;
+  *countptr = count;
+  return 0;
 }
 
 /* Implements an emulation of the utimensat system call on the filesystem 
-   of size fssize pointed to by fsptr.
+   of the handle fs.
 
    The call changes the access and modification times of the file
    or directory indicated by path to the values in ts.
@@ -1358,14 +3740,14 @@ int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
    The error codes are documented in man 2 utimensat.
 
 */
-int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
+int __myfs_utimens_implem(fs_handle_t *fs, int *errnoptr,
                           const char *path, const struct timespec ts[2]) {
   /* STUB */
   return -1;
 }
 
 /* Implements an emulation of the statfs system call on the filesystem 
-   of size fssize pointed to by fsptr.
+   of the handle fs.
 
    The call gets information of the filesystem usage and puts in 
    into stbuf.
@@ -1387,8 +3769,27 @@ int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
              filesystem has such a maximum
 
 */
-int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr,
+int __myfs_statfs_implem(fs_handle_t *fs, int *errnoptr,
                          struct statvfs* stbuf) {
-  /* STUB */
-  return -1;
+  void *fsptr = fs->fsptr;
+  size_t fssize = fs->fssize;
+
+  // Free space is what the allocator could still hand out, holes cost nothing;
+  // all of it comes from the running totals
+  fs_totals_t *totals = &((superblock_t *)fsptr)->totals;
+  memset(stbuf, 0, sizeof(struct statvfs));
+  // Counts stay in units of BLOCK_SIZE whatever block size files are made of
+  stbuf->f_bsize = ((superblock_t *)fsptr)->block_size;
+  stbuf->f_frsize = BLOCK_SIZE;
+  stbuf->f_blocks = (fsblkcnt_t) (fssize / BLOCK_SIZE);
+  stbuf->f_bfree = (fsblkcnt_t) (totals->free_bytes / BLOCK_SIZE);
+  stbuf->f_bavail = stbuf->f_bfree;
+
+  // Inodes come out of the same free memory
+  stbuf->f_ffree = (fsfilcnt_t) (totals->free_bytes / sizeof(inode_t));
+  stbuf->f_favail = stbuf->f_ffree;
+  stbuf->f_files = (fsfilcnt_t) totals->num_objects[SLAB_INODE] + stbuf->f_ffree;
+  stbuf->f_namemax = NAME_MAX_LEN;
+
+  return 0;
 }
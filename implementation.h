@@ -1,13 +1,49 @@
 #ifndef __MY_FUSE_IMPL__
 #define __MY_FUSE_IMPL__
 
+#include <stddef.h>
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 
 // Constants and type definitions
 #define MAGIC_NUMBER ((uint32_t)0xADDBEEF)
+#define FORMAT_VERSION ((uint32_t)1) // On-image layout version; the original, unversioned layout reads as 0
 #define NAME_MAX_LEN ((size_t)255)
-#define BLOCK_SIZE ((size_t)1024)
+#define NAME_INLINE_LEN ((size_t)23) // Longer names are kept out of line
+#define BLOCK_SIZE ((size_t)1024)        // Default base block size, see superblock_t.block_size
+#define BLOCK_SIZE_MIN ((size_t)64)      // Smallest base block size a filesystem can be made with
+#define BLOCK_SIZE_MAX ((size_t)65536)   // Largest one; files grow to blocks of 1024 times the base
+#define FILE_INLINE_LEN ((size_t)192) // Files up to this size keep their data in the inode
+#define EXTENT_PREALLOC_MAX ((size_t)(1 << 24)) // Most memory reserved ahead of a growing file
+#define EXTENT_MIN_COUNT ((size_t)4)            // Initial capacity of a file's extent array
+#define MIN_FS_SIZE ((size_t)32768) // Smallest filesystem the superblock, journal and root directory fit into
+#define DIRTY_PAGE_SHIFT 12         // log2 of the granularity of the dirty map, the usual page size
+#define JOURNAL_SIZE_MAX ((size_t)65536) // Largest journal; smaller filesystems get an eighth of their size
+#define JOURNAL_SIZE_MIN ((size_t)16384) // Smallest journal, room for two steps
+#define JOURNAL_STEP_MAX ((size_t)8192)  // Most an operation journals between two consistent points
+
+// Allocator constants: blocks are kept in ALLOC_FL_COUNT x ALLOC_SL_COUNT segregated
+// free lists. The first level is the power of two of the block size, the second
+// level splits each power of two range into ALLOC_SL_COUNT equal parts.
+#define ALLOC_ALIGN ((size_t)8)
+#define ALLOC_HEADER ((size_t)sizeof(size_t))
+#define ALLOC_MIN_BLOCK ((size_t)32)       // Header, two list links and footer
+#define ALLOC_FL_SHIFT 5                   // log2(ALLOC_MIN_BLOCK)
+#define ALLOC_FL_COUNT (64 - ALLOC_FL_SHIFT)
+#define ALLOC_SL_LOG2 2
+#define ALLOC_SL_COUNT (1 << ALLOC_SL_LOG2)
+#define ALLOC_IN_USE ((size_t)1)           // Header flag: the block is allocated
+#define ALLOC_PREV_IN_USE ((size_t)2)      // Header flag: the block in front is allocated
+#define ALLOC_FLAGS (ALLOC_IN_USE | ALLOC_PREV_IN_USE)
+
+// Slab constants: fixed-size metadata objects live in slabs of SLAB_SIZE bytes,
+// aligned to SLAB_SIZE so that the slab of an object is found by masking its offset
+#define SLAB_SIZE ((size_t)4096)
+#define SLAB_MAX_OBJECTS ((size_t)128)     // Bits of slab_t.used
+#define SLAB_INODE 0                       // Slab kind for inode_t
+#define SLAB_KINDS 1
+#define SLAB_HEADER ((sizeof(slab_t) + ALLOC_ALIGN - 1) & ~(ALLOC_ALIGN - 1))
 
 typedef size_t fs_offset;  
 typedef unsigned int u_int;
@@ -15,148 +51,494 @@ typedef unsigned int u_int;
 /* Struct Declarations (1) */
 
 // Memory block structure
+// Every block starts with a header holding its total size (a multiple of ALLOC_ALIGN)
+// and the ALLOC_* flags. Allocated blocks hand out everything after the header.
+// Free blocks link into their free list and repeat their size in their last word
+// (the footer), so that the block behind them can find them when coalescing.
 typedef struct data_block {
-    size_t remaining; // Remaining space of the data block
-    fs_offset next;       // Offset to the next memory block
+    size_t header;  // Total size of the block | ALLOC_* flags
+    fs_offset next; // Offset to the next free block of the same list (free blocks only)
+    fs_offset prev; // Offset to the previous free block of the same list (free blocks only)
 } data_block_t;
 
-typedef struct list {
-  fs_offset head;
-} list_t;
+// (2) Allocator state
+typedef struct allocator {
+    fs_offset heap_start; // Offset of the first block
+    fs_offset heap_end;   // Offset of the end sentinel, an empty allocated block header
+    uint64_t fl_bitmap;   // Bit i set if some free list of first level i is non-empty
+    uint32_t sl_bitmap[ALLOC_FL_COUNT]; // Bit j of entry i set if free list [i][j] is non-empty
+    fs_offset free_lists[ALLOC_FL_COUNT][ALLOC_SL_COUNT]; // Heads of the free lists
+} allocator_t;
+
+// (2) Slab header, followed by the slab's objects
+typedef struct slab {
+    fs_offset next;    // Next slab of the same kind with free objects (0 if none)
+    fs_offset prev;    // Previous slab of the same kind with free objects (0 if none)
+    uint64_t used[2];  // Bit i % 64 of used[i / 64] set if object i is allocated
+    uint32_t kind;     // SLAB_* kind of the objects
+    uint32_t num_used; // Number of allocated objects
+} slab_t;
+
+// (2) Per-kind slab state
+typedef struct slab_cache {
+    size_t object_size;      // Size of one object
+    size_t objects_per_slab; // Number of objects fitting in one slab
+    fs_offset partial;       // List of slabs with free objects
+} slab_cache_t;
+
+// (1) Undo journal of the metadata changes of the running operation. Before a
+// range of metadata in use is changed, its old bytes are appended as a record;
+// if the operation does not get to commit, the records are undone on the next
+// mount. The records follow the header, each one followed by its trailer.
+typedef struct journal {
+    size_t used;     // Bytes of records of the open transaction (0 if none is open)
+    size_t capacity; // Bytes of room for records
+} journal_t;
+
+// (1) Trailer of a journal record, behind the old bytes padded to ALLOC_ALIGN
+typedef struct journal_record {
+    fs_offset offset; // Offset of the changed range
+    size_t length;    // Number of old bytes
+} journal_record_t;
+
+// (2) Running totals of the allocator and the slabs, so that statfs walks nothing
+typedef struct fs_totals {
+    size_t free_bytes;  // Bytes of all free blocks, headers included
+    size_t free_blocks; // Number of free blocks
+    size_t used_blocks; // Number of allocated blocks
+    size_t num_objects[SLAB_KINDS]; // Number of allocated objects of each slab kind
+} fs_totals_t;
+
+// (2) Allocator activity since the filesystem was mounted, for the statistics. It lives
+// in process memory, in the handle, and is only ever added to with relaxed atomics
+typedef struct alloc_stats {
+    uint64_t malloc_calls;  // Calls of malloc_impl() and malloc_aligned_impl()
+    uint64_t free_calls;    // Calls of free_impl()
+    uint64_t realloc_calls; // Calls of realloc_impl()
+    uint64_t realloc_moved; // Bytes copied by realloc_impl() moving a block
+    uint64_t list_ops;      // Blocks put on or taken off a free list
+} alloc_stats_t;
 
 // Superblock structure
 typedef struct superblock {
     uint32_t magic_number; // Magic number identifying the file system
-    fs_offset free_memory;    // Offset to the free memory
+    uint32_t version;      // On-image layout version (0 for images predating versioning)
     fs_offset root_directory; // Offset to the root directory
     size_t size;           // Total size of the file system
+    allocator_t allocator; // Free memory management
+    slab_cache_t slabs[SLAB_KINDS]; // Fixed-size metadata object management
+    fs_offset dirty_map;   // Offset to the bitmap of pages changed since they were last synced
+    fs_offset journal;     // Offset to the undo journal, right behind the superblock
+    fs_totals_t totals;    // Running totals
+    size_t block_size;     // Base block size of file data, a power of two chosen when the image is made
 } superblock_t;
 
-// (3) File-specific inode fields
+// (3) File-specific inode fields. A file flagged INODE_INLINE keeps its bytes
+// in place of the extent fields; they make the inode large enough for the small
+// configuration and lock files most files are
 typedef struct inode_file {
-    size_t size;      // Size of the file
-    fs_offset first_block; // Offset to the first block of the file
+    size_t size;            // Size of the file
+    union {
+        struct {
+            size_t num_extents; // Number of extents of the file
+            fs_offset extents;  // Offset to the extent array, sorted by start (0 if none yet)
+            size_t allocated;   // Bytes of memory held by the extents, for st_blocks
+        };
+        char data[FILE_INLINE_LEN]; // Bytes of an inline file
+    };
 } inode_file_t;
 
-// (3) Directory-specific inode fields
+// (3) Bytes of inode_file_t a change of the size or the extents journals. Undoing
+// one never needs the inline bytes behind them: only those below the size count
+#define FILE_FIELDS_SIZE (offsetof(inode_file_t, allocated) + sizeof(size_t))
+
+// (3) Extent: a run of file bytes stored contiguously. Extents do not overlap
+// and end at or before the end of the file; the usable size of the data
+// block is the extent's capacity, so appends can fill it without reallocating.
+// File bytes not covered by any extent are holes and read as zeros
+typedef struct extent {
+    size_t start;   // Offset of the first byte of the run in the file
+    size_t length;  // Number of bytes of the run
+    fs_offset data; // Offset to the memory block holding the run
+} extent_t;
+
+// (3) Directory-specific inode fields. The children list is kept in pages of
+// DIR_PAGE_SLOTS offsets, found through a table of page offsets: slot i is
+// entry i % DIR_PAGE_SLOTS of page i / DIR_PAGE_SLOTS (see dir_child()). All
+// pages but the last are full, so adding a child never copies the others.
+// Slot 0 holds the parent
 typedef struct inode_directory {
     size_t num_children; // Number of children in the directory
-    fs_offset children;     // Offset to the children list
+    fs_offset children;     // Offset to the page table of the children list
+    fs_offset index;        // Offset to the hash index over the children's names (0 if none yet)
+    size_t index_size;      // Number of entries of the hash index (a power of two)
+    uint32_t index_deleted; // Number of removed entries still occupying the hash index
+    uint32_t num_subdirs;   // Number of children that are directories, for st_nlink
 } inode_directory_t;
 
-// Inode structure (common fields for both files and directories)
+// (3) Entry of a directory's hash index, looked up by open addressing
+typedef struct dir_index_entry {
+    size_t hash; // Hash of the child's name
+    size_t slot; // Position of the child in the children list (DIR_INDEX_EMPTY or DIR_INDEX_DELETED if unused)
+} dir_index_entry_t;
+
+#define DIR_INDEX_EMPTY ((size_t)0)        // Slot 0 of the children list is "..", never indexed
+#define DIR_INDEX_DELETED (~((size_t)0))
+#define DIR_INDEX_MIN_SIZE ((size_t)8)
+#define DIR_PAGE_SLOTS ((size_t)128)       // Children per page of a children list (a power of two)
+
+#define INODE_INLINE ((uint8_t)1) // The file's data lies in value.file.data
+
+// Inode structure (common fields for both files and directories). The fields
+// every lookup and stat reads come first, short names are stored inline; the
+// value comes last, as the bytes of an inline file make up most of the inode
 typedef struct inode {
-    char name[NAME_MAX_LEN + ((size_t) 1)];  // Name of the file or directory (+ 1 for null terminator)
-    struct timespec time[2];    // [0] - last access time; [1] - last modification time
     uint8_t type;                // Type: 1 for file, 2 for directory
+    uint8_t name_len;            // Length of the name, without the null terminator
+    uint8_t flags;               // INODE_* flags
+    union {
+        char inline_name[NAME_INLINE_LEN + ((size_t) 1)]; // Null-terminated name of up to NAME_INLINE_LEN bytes
+        fs_offset offset;     // Offset to the null-terminated name of a longer one
+    } name;
+    struct timespec time[2];    // [0] - last access time; [1] - last modification time
     union {
         inode_file_t file;         // File-specific inode fields
         inode_directory_t directory; // Directory-specific inode fields
     } value;
 } inode_t;
 
-// (3) File block structure
-typedef struct file_block {
-    size_t size;      // Size of the file block
-    size_t allocated; // Allocated size of the file block
-    fs_offset next;      // Offset to the next file block
-    fs_offset data;      // Offset to the data of the file block
-} file_block_t;
+// Superblock of the original, unversioned layout (version 0), only read by
+// migrate_filesystem(). Free memory was a list of blocks starting at free_memory
+typedef struct superblock_v0 {
+    uint32_t magic_number;
+    uint32_t version;      // Padding the original layout left zero
+    fs_offset free_memory;
+    fs_offset root_directory;
+    size_t size;
+} superblock_v0_t;
+
+// Inode of version 0: a directory's children array has the parent in slot 0,
+// a file's bytes lie in a chain of file blocks
+typedef struct inode_v0 {
+    char name[NAME_MAX_LEN + ((size_t) 1)];
+    struct timespec time[2];
+    uint8_t type;
+    union {
+        struct {
+            size_t size;
+            fs_offset first_block;
+        } file;
+        struct {
+            size_t num_children;
+            fs_offset children;
+        } directory;
+    } value;
+} inode_v0_t;
+
+// File block of version 0, holding allocated bytes of the file at data
+typedef struct file_block_v0 {
+    size_t size;
+    size_t allocated;
+    fs_offset next; // Next block of the file (0 if none)
+    fs_offset data;
+} file_block_v0_t;
+
+// Dentry cache sizing
+#define DCACHE_SIZE ((size_t)4096)        // Number of entries (a power of two)
+#define DCACHE_LOCKS ((size_t)64)         // Number of locks striping the entries
+#define DCACHE_PATH_MAX ((size_t)216)     // Longer paths are not cached
+
+// Entry of the dentry cache: a full path and the offset of its inode
+typedef struct dcache_entry {
+    size_t hash;       // Hash of the path
+    size_t generation; // Cache generation the entry was made in
+    fs_offset node;    // Offset of the inode the path resolves to
+    size_t len;        // Length of the path
+    char path[DCACHE_PATH_MAX];
+} dcache_entry_t;
+
+// Dentry cache mapping full paths to inode offsets.
+// It lives in process memory, not in the filesystem: nothing in it survives an unmount.
+typedef struct dcache {
+    pthread_mutex_t locks[DCACHE_LOCKS]; // Entry i is protected by locks[i % DCACHE_LOCKS]
+    size_t generation;                   // Entries of older generations are stale
+    dcache_entry_t entries[DCACHE_SIZE]; // Direct-mapped by path hash
+} dcache_t;
+
+// Open file handle, kept in process memory and passed around in fuse_file_info.fh
+typedef struct file_handle {
+    fs_offset node; // Offset of the inode of the open file
+    size_t cursor;  // Index of the extent the last access through this handle ended in
+} file_handle_t;
+
+// Handle of a mounted filesystem, built once by fs_handle_create() and passed to
+// every operation. It lives in process memory, nothing in it survives an unmount.
+typedef struct fs_handle {
+    void *fsptr;      // Start of the filesystem
+    size_t fssize;    // Size of the filesystem
+    inode_t *root;    // Root directory
+    dcache_t *dcache; // Dentry cache
+    size_t compact_runs;  // Calls of fs_handle_compact() since mounting
+    size_t compact_moves; // Blocks it moved
+    size_t compact_bytes; // Bytes it moved
+    alloc_stats_t stats;  // Allocator activity, passed to every call that allocates or frees
+} fs_handle_t;
+
+// Block that compaction may move, listed by fs_handle_compact() in process memory.
+// The offset referring to it lies in an inode, or in another listed block that
+// may move first: then holder is relative to that block
+typedef struct compact_ref {
+    fs_offset block;  // Offset of the block, as handed out by malloc_impl()
+    fs_offset holder; // Offset of the field referring to the block
+    size_t parent;    // Index of the listed block holding the field (COMPACT_FIXED if none)
+    fs_offset file;   // Offset of the fields of the file whose allocated count covers the block (0 if none)
+} compact_ref_t;
+
+#define COMPACT_FIXED (~((size_t)0))
+
+// Callback taking one directory entry from __myfs_readdir_fill_implem(); it has the
+// signature of FUSE's fuse_fill_dir_t and returns nonzero once its buffer is full
+typedef int (*dir_filler_t)(void *buf, const char *name, const struct stat *stbuf, off_t off);
 
 /* END Struct declarations (1) */
 
 /* START memory allocation implementation */
 
 /**
- * @brief (2) Allocate memory for a data block and add it to the list in ascending order.
- * 
- * This function allocates memory for a data block and inserts it into a linked list
- * of allocated memory regions, maintaining ascending order based on memory addresses.
- * 
+ * @brief (2) Sets up the allocator over [heap_start, fssize) as one free block.
+ *
  * @param fsptr Pointer to the start of the file system.
- * @param ll Pointer to the linked list of allocated memory regions.
- * @param new_block Pointer to the data block to be allocated.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param heap_start Offset of the first byte the allocator manages.
+ * @param fssize Size of the file system.
  */
-void add_to_free_memory(void *fsptr, list_t *ll, data_block_t *new_block);
+void init_allocator(void *fsptr, alloc_stats_t *stats, fs_offset heap_start, size_t fssize);
 
 /**
- * @brief (2) Extends the available block to accommodate additional size, if possible.
- * 
- * This function extends the available block to accommodate the specified size
- * if it has enough remaining space. If the available block does not have enough
- * space, it extends the original available block as much as possible and updates
- * the size accordingly.
- * 
+ * @brief (2) Extends the heap up to a new, larger end of the filesystem.
+ *
+ * The memory between the old and the new end must never have been used. It
+ * joins the free block in front of it, if any.
+ *
  * @param fsptr Pointer to the start of the file system.
- * @param before_avail Pointer to the data block before the available block.
- * @param org_avail Pointer to the original available block.
- * @param avail_off Offset of the available block.
- * @param size Pointer to the size to be extended.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param fssize New size of the file system.
  */
-void extend_avail_block(void *fsptr, data_block_t *before_avail,
-                        data_block_t *org_avail, fs_offset avail_off,
-                        size_t *size);
+void grow_allocator(void *fsptr, alloc_stats_t *stats, size_t fssize);
 
 /**
- * @brief (2) Gets a memory allocation block of the specified size.
- * 
- * This function retrieves a memory allocation block of the specified size
- * from the free space managed by the provided list. It first attempts to
- * allocate space from a selected space indicated by selected_block. If the selected
- * space does not have enough space, or if no selected space is specified, it
- * searches for the largest available block in the list and allocates space from it.
+ * @brief (2) Computes the free list a block of the given size goes into.
+ *
+ * @param size Total block size, at least ALLOC_MIN_BLOCK.
+ * @param fl Pointer to store the first level index.
+ * @param sl Pointer to store the second level index.
+ */
+void size_to_list(size_t size, size_t *fl, size_t *sl);
+
+/**
+ * @brief (2) Adds a free block to the free list matching its size.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param block Pointer to the free block, with its header and footer already set.
+ */
+void insert_free_block(void *fsptr, alloc_stats_t *stats, data_block_t *block);
+
+/**
+ * @brief (2) Takes a free block out of its free list.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param block Pointer to the free block.
+ */
+void remove_free_block(void *fsptr, alloc_stats_t *stats, data_block_t *block);
+
+/**
+ * @brief (2) Frees a block, coalescing it with free neighbours.
+ *
+ * Both neighbours are found in O(1) through the block's size (next block)
+ * and the footer of a free block in front of it (ALLOC_PREV_IN_USE clear).
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param block Pointer to the block, whose header holds its size.
+ * @param prev_in_use Whether the block in front of it is allocated.
+ */
+void add_to_free_memory(void *fsptr, alloc_stats_t *stats, data_block_t *block, int prev_in_use);
+
+/**
+ * @brief (2) Gets a free memory block of at least the specified total size.
+ *
+ * The size is rounded up to the start of the next list, so that any block of
+ * that list or of a larger one fits; the bitmaps lead to the first non-empty
+ * such list in O(1). The block is split if the rest makes a block of its own.
  * 
  * @param fsptr Pointer to the start of the file system.
- * @param ll Pointer to the list of free blocks.
- * @param selected_block Pointer to the original selected space block, if any.
- * @param size Pointer to the size of the allocation to be obtained.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param size Total block size wanted, aligned and at least ALLOC_MIN_BLOCK.
  * @return Pointer to the allocated memory block, or NULL if allocation fails.
  */
-void *get_memory_block(void *fsptr, list_t *ll, data_block_t *selected_block,
-                     size_t *size);    
+data_block_t *get_memory_block(void *fsptr, alloc_stats_t *stats, size_t size);
+
+/**
+ * @brief (2) Gets the free memory block with the lowest address below a limit
+ * that has at least the specified total size.
+ *
+ * Every list that may hold such a block is walked, so this is for compaction
+ * (see fs_handle_compact()) rather than for allocating. The block is split if
+ * the rest makes a block of its own.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param size Total block size wanted, aligned and at least ALLOC_MIN_BLOCK.
+ * @param limit Offset the block must start below.
+ * @return Pointer to the allocated memory block, or NULL if there is none.
+ */
+data_block_t *get_memory_block_below(void *fsptr, alloc_stats_t *stats, size_t size, fs_offset limit);
+
+/**
+ * @brief (2) Returns the number of usable bytes of an allocated memory region.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @param ptr Pointer returned by malloc_impl() or realloc_impl().
+ * @return Usable size in bytes, at least the size asked for; 0 if ptr is NULL.
+ */
+size_t usable_size(void *fsptr, void *ptr);
 
 /**
  * @brief (2) Allocates a memory block of the given size.
  *
- * If the size is zero, returns NULL. Otherwise, calls get_allocation to
- * allocate memory of the specified size.
+ * If the size is zero, returns NULL. Otherwise, *size is reset to 0 on success.
  *
  * @param fsptr Pointer to the start of the file system.
- * @param selected_ptr Pointer to the preferred memory block. If NULL, defaults to fsptr.
+ * @param stats Allocator counters of the handle, to add to.
  * @param size Pointer to the size of the memory block to allocate.
  * @return Pointer to the allocated memory block, or NULL if size is zero or memory allocation fails.
  */
-void *malloc_impl(void *fsptr, void *selected_ptr, size_t *size);
+void *malloc_impl(void *fsptr, alloc_stats_t *stats, size_t *size);
+
+/**
+ * @brief (2) Allocates a memory block of the given size, starting at an aligned offset.
+ *
+ * The memory in front of the aligned start is given back to the free lists.
+ * *size is reset to 0 on success.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param alignment Alignment of the offset of the returned memory, a power of two.
+ * @param size Pointer to the size of the memory block to allocate.
+ * @return Pointer to the allocated memory block, or NULL if size is zero or memory allocation fails.
+ */
+void *malloc_aligned_impl(void *fsptr, alloc_stats_t *stats, size_t alignment, size_t *size);
 
 /**
  * @brief (2) Reallocates memory block pointed to by orig_ptr to the specified size.
  *
  * If size is 0, frees the memory block pointed to by orig_ptr and returns NULL.
  * If orig_ptr is NULL, reallocates memory equivalent to a call to malloc(size) for size bytes.
- * If the new size is less than the original size and not enough to make a new memory block, 
- * the remaining memory is kept.
- * If the new size is less than the original size and enough to make a new memory block, 
- * a new memory block is created for the remaining memory and added to the free memory list.
- * If the new size is greater than the original size, a new memory block is allocated, 
- * contents of the original memory block are copied to the new memory block, 
- * and the original memory block is freed.
+ * If the new size is smaller, the block is cut in place and its tail is freed
+ * if it is large enough to make a block.
+ * If the new size is larger, the block is first grown in place into a free block
+ * behind it. Otherwise a new memory block is allocated, contents of the original
+ * memory block are copied to the new memory block, and the original memory block is freed.
+ * *size is reset to 0 on success.
  *
  * @param fsptr Pointer to the start of the file system.
+ * @param stats Allocator counters of the handle, to add to.
  * @param orig_ptr Pointer to the original memory block.
  * @param size Pointer to the new size of the memory block.
  * @return Pointer to the reallocated memory block, or NULL if size is 0 or memory allocation fails.
  */
-void *realloc_impl(void *fsptr, void *orig_ptr, size_t *size);
+void *realloc_impl(void *fsptr, alloc_stats_t *stats, void *orig_ptr, size_t *size);
 
 /**
- * @brief (2) Frees the memory block pointed to by ptr and adds it back to the free memory list.
+ * @brief (2) Frees the memory block pointed to by ptr and adds it back to the free memory lists.
  *
  * If ptr is NULL, the function does nothing.
  *
  * @param fsptr Pointer to the start of the file system.
+ * @param stats Allocator counters of the handle, to add to.
  * @param ptr Pointer to the memory block to be freed.
  */
-void free_impl(void *fsptr, void *ptr);
+void free_impl(void *fsptr, alloc_stats_t *stats, void *ptr);
+
+/**
+ * @brief (9) Returns the free memory of the filesystem, from the running totals.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @return Number of free bytes, block headers included.
+ */
+size_t free_memory_size(void *fsptr);
+
+/**
+ * @brief (9) Finds the size of the largest free block, the largest allocation that can succeed.
+ *
+ * Only the highest non-empty free list is walked. Together with the running
+ * totals this tells how fragmented the free memory is.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @return Size of the largest free block, header included; 0 if none is free.
+ */
+size_t largest_free_block(void *fsptr);
+
+/**
+ * @brief (9) Tells how fragmented the free memory is: the share of it that the
+ * largest allocation cannot use, see largest_free_block().
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @return The share in tenths of a percent, 0 if nothing is free.
+ */
+unsigned int free_fragmentation(void *fsptr);
+
+/**
+ * @brief (9) Sets the running totals from scratch by walking the heap and the directory tree.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ */
+void count_totals(void *fsptr);
+
+/**
+ * @brief (2) Sets up the slab caches of a fresh filesystem.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ */
+void init_slabs(void *fsptr);
+
+/**
+ * @brief (2) Returns the slab an object lives in.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @param object Pointer to an object allocated with slab_alloc().
+ * @return Pointer to the slab header.
+ */
+slab_t *slab_of(void *fsptr, void *object);
+
+/**
+ * @brief (2) Allocates a fixed-size metadata object in O(1).
+ *
+ * The object is taken from the slab of hint if that one has room, so that
+ * related objects (e.g. the inodes of one directory) end up next to each
+ * other; otherwise from any slab with room, or from a new slab.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param kind SLAB_* kind of the object.
+ * @param hint Pointer to an object of the same kind to allocate next to, or NULL.
+ * @return Pointer to the uninitialized object, or NULL if memory allocation fails.
+ */
+void *slab_alloc(void *fsptr, alloc_stats_t *stats, int kind, void *hint);
+
+/**
+ * @brief (2) Frees an object allocated with slab_alloc() in O(1).
+ *
+ * A slab whose last object is freed goes back to the allocator.
+ * If object is NULL, the function does nothing.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param object Pointer to the object.
+ */
+void slab_free(void *fsptr, alloc_stats_t *stats, void *object);
 
 /* END memory allocation implementation */
 
@@ -174,62 +556,418 @@ fs_offset pointer_to_offset (void *fsptr, void *pointer);
 /// @return 
 void *offset_to_pointer (void *fsptr, fs_offset my_offset);
 
-/// @brief (1)
+/// @brief (1) Get the allocator state stored in the superblock
 /// @param fsptr 
 /// @return 
-void *get_free_memory_pointer(void *fsptr);
+allocator_t *get_allocator(void *fsptr);
+
+/**
+ * @brief (1) Records that the pages holding a range of the image have changed.
+ *
+ * Every change to the image must be recorded, so that a sync can write back
+ * just the recorded pages. Safe to call concurrently on overlapping ranges.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @param ptr Pointer to the start of the changed range.
+ * @param size Number of changed bytes; nothing is recorded if 0.
+ */
+void dirty_mark(void *fsptr, void *ptr, size_t size);
+
+/**
+ * @brief (1) Takes the changed pages of a range of the image off the dirty map.
+ *
+ * The pages are appended to a growable array of (image offset, length) pairs,
+ * allocated with realloc; a pair that continues the last one is merged into it.
+ * Pages whose pairs cannot be stored stay marked. Safe to call while
+ * operations mark pages: each word of the map is cleared atomically, so a page
+ * marked meanwhile is either taken or stays marked. As operations may mark a
+ * page before they change it, the taken pages must only be written back once
+ * the operations running during the take have finished.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @param start Offset of the range.
+ * @param size Number of bytes of the range.
+ * @param rangesptr Pointer to the array, NULL initially.
+ * @param countptr Pointer to the number of pairs in the array.
+ * @param capacityptr Pointer to the number of pairs the array has room for.
+ * @return 1 on success, 0 if memory allocation fails.
+ */
+int dirty_take(void *fsptr, fs_offset start, size_t size, size_t **rangesptr, size_t *countptr,
+               size_t *capacityptr);
+
+/**
+ * @brief (1) Saves the old bytes of a range of metadata in use about to change.
+ *
+ * Must be called before every change to metadata that is reachable from the
+ * superblock (allocator headers and lists, slab headers, inodes apart from
+ * their times, directory and extent arrays); memory that was free before the
+ * operation needs no saving. Metadata the operation frees is not saved either,
+ * so it commits before allocating again once it has freed an array that an
+ * undo would point back to. The range is recorded in the dirty map as well.
+ * No step of an operation, from its start or a consistent point to the next
+ * one, journals more than JOURNAL_STEP_MAX bytes, and every loop over a
+ * growing number of objects calls journal_checkpoint() at its consistent
+ * points, so a transaction always fits; one that did not would be a bug and
+ * fails an assertion.
+ *
+ * The undo covers an operation cut short while the image stays in memory or
+ * in the page cache, as when the process dies. Pages of a backup-file reach
+ * the disk in no particular order, the journal's included, so after a power
+ * loss the image on disk is only sure to be consistent if nothing changed
+ * it since the last sync finished.
+ *
+ * Operations changing metadata must be serialized with each other.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @param ptr Pointer to the start of the range.
+ * @param size Number of bytes of the range; nothing is saved if 0.
+ */
+void journal_log(void *fsptr, void *ptr, size_t size);
+
+/**
+ * @brief (1) Ends the open transaction: its changes are no longer undone.
+ *
+ * Every operation changing metadata calls it once it is done, also when failing.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ */
+void journal_commit(void *fsptr);
+
+/**
+ * @brief (1) Commits the open transaction if another step might not fit into the journal.
+ *
+ * Must only be called where the metadata is consistent; see journal_log().
+ *
+ * @param fsptr Pointer to the start of the file system.
+ */
+void journal_checkpoint(void *fsptr);
+
+/**
+ * @brief (1) Undoes the changes of a transaction that was open when the filesystem went down.
+ *
+ * Must be called once when the filesystem is mounted, before any operation.
+ *
+ * @param fsptr Pointer to the start of the file system.
+ * @return 1 on success, 0 if the journal is damaged or holds less than JOURNAL_STEP_MAX.
+ */
+int journal_replay(void *fsptr);
 
 /**
  * @brief (1) Updates the access and modification times of the specified inode.
  *
  * If node is NULL, the function does nothing.
  *
+ * @param fsptr Pointer to the start of the file system.
  * @param node Pointer to the inode whose times are to be updated.
  * @param set_mod Flag indicating whether to update modification time as well.
  *                If set_mod is non-zero, modification time will be updated.
  *                If set_mod is zero, only access time will be updated.
  */
-void update_time(inode_t *node, int set_mod);
+void update_time(void *fsptr, inode_t *node, int set_mod);
 
 /**
  * @brief (1) Mounts the filesystem represented by the provided memory buffer.
  *
  * If the filesystem is being mounted for the first time, initializes the superblock
- * and sets up the root directory.
+ * and sets up the root directory. The free memory is left as it is.
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param fssize Size of the filesystem, at least MIN_FS_SIZE.
+ * @param block_size Base block size recorded in a new filesystem, a power of two
+ *        from BLOCK_SIZE_MIN to BLOCK_SIZE_MAX; an existing one keeps its own.
+ * @return 1 on success, 0 if the memory holds a filesystem of an on-image format version
+ *         that is not supported (neither FORMAT_VERSION nor 0) or is too small.
+ */
+int mount_filesystem(void *fsptr, alloc_stats_t *stats, size_t fssize, size_t block_size);
+
+/**
+ * @brief (1) Brings a filesystem of the original, unversioned layout (version 0) up to FORMAT_VERSION.
+ *
+ * The old tree is walked and created anew, through the operations, in a
+ * filesystem made in process memory; that one is copied over the image once
+ * complete. A crash before the copy leaves the old image as it was and the
+ * migration starts over on the next mount; a crash while the copy runs loses
+ * the image, so a copy of the backup-file should be kept until the first mount
+ * is done. The old image is checked while walked, offsets out of range or
+ * a cycle fail the migration. Must be called before the journal is replayed:
+ * an image of version 0 has none. Nothing happens to images of FORMAT_VERSION.
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param fssize Size of the memory, at least the size of the old filesystem.
+ * @param block_size Base block size of the new filesystem, see mount_filesystem().
+ * @param errnoptr Set on failure: EUCLEAN if the old image is damaged, ENOMEM if
+ *        the process is out of memory, ENOSPC if the tree does not fit the new
+ *        layout; the old image is kept then.
+ * @return 1 on success, 0 on failure.
+ */
+int migrate_filesystem(void *fsptr, size_t fssize, size_t block_size, int *errnoptr);
+
+/**
+ * @brief (1) Grows a mounted filesystem in place to a larger size.
+ *
+ * The filesystem keeps all its contents; the memory behind its old end
+ * becomes free space. Must be called once the journal is replayed, before
+ * any operation. Nothing happens if the filesystem is that large already.
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param fssize New size of the filesystem.
+ * @return 1 on success, 0 if the filesystem is too full to track the new pages;
+ *         it is left unchanged then.
+ */
+int grow_filesystem(void *fsptr, alloc_stats_t *stats, size_t fssize);
+
+/**
+ * @brief (1) Mounts a filesystem and builds the handle the operations work on.
+ *
+ * Formats the memory on the first mount, undoes what a crash left half done,
+ * migrates an older on-image layout and grows the filesystem if fssize got
+ * larger (see mount_filesystem(), journal_replay(), migrate_filesystem() and
+ * grow_filesystem()). Must be called once, before any operation.
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param fssize Size of the filesystem, at least MIN_FS_SIZE.
+ * @param block_size Base block size if the filesystem gets formatted, see
+ *        mount_filesystem(); 0 for BLOCK_SIZE.
+ * @param errnoptr Set on failure: EINVAL for an unsupported block size,
+ *        EPROTONOSUPPORT for an image of an unsupported on-image format
+ *        version, EUCLEAN for a damaged or too small journal or a damaged old
+ *        image, ENOSPC if there is no room to migrate or grow the filesystem,
+ *        ENOMEM if out of memory.
+ * @return The handle, to be freed with fs_handle_destroy(), or NULL on failure.
+ */
+fs_handle_t *fs_handle_create(void *fsptr, size_t fssize, size_t block_size, int *errnoptr);
+
+/**
+ * @brief (1) Frees a handle returned by fs_handle_create(); the filesystem is left as it is.
+ *
+ * @param fs The handle; NULL is ignored.
+ */
+void fs_handle_destroy(fs_handle_t *fs);
+
+/**
+ * @brief (1) Prints the statistics of the filesystem: the running totals, the
+ *        fragmentation of the free memory and the allocator activity since mounting.
+ *
+ * @param fs The handle.
+ * @param buf Buffer for the text, null-terminated as with snprintf().
+ * @param size Size of buf.
+ * @return Length of the full text, as with snprintf().
+ */
+int fs_handle_print_stats(fs_handle_t *fs, char *buf, size_t size);
+
+/**
+ * @brief (1) Runs a step of compaction: moves blocks from the top of the heap
+ *        into free blocks further down, so that the free memory merges.
+ *
+ * Extent arrays, file data, children lists, hash indexes and long names can
+ * move; slabs and with them the inodes stay in place, so cached lookups and
+ * open handles remain valid. Every move is a transaction of its own. The
+ * blocks are found by a walk of the whole tree, so a step must run alone.
+ *
+ * @param fs The handle.
+ * @param budget Number of bytes after which the step stops moving blocks.
+ * @param move_data Zero if file data must stay where it is, e.g. because
+ *        replies in flight still point at it.
+ * @return Number of bytes moved; 0 once nothing can move any further (or if
+ *         out of memory).
+ */
+size_t fs_handle_compact(fs_handle_t *fs, size_t budget, int move_data);
+
+/**
+ * @brief (3) Returns the null-terminated name of an inode, stored inline or out of line.
  *
  * @param fsptr Pointer to the start of the filesystem.
- * @param fssize Size of the filesystem.
+ * @param node The inode; its name is node->name_len bytes long.
+ * @return Pointer to the name.
  */
-void mount_filesystem(void *fsptr, size_t fssize);
+const char *inode_name(void *fsptr, inode_t *node);
+
+/**
+ * @brief (3) Gives an inode that holds no name the given one.
+ *
+ * Names longer than NAME_INLINE_LEN get a block of their own. The inode must be
+ * fresh or have had its name freed with inode_free_name().
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param node The inode.
+ * @param name The name, not necessarily null-terminated.
+ * @param len Length of the name, at most NAME_MAX_LEN.
+ * @return 1 on success, 0 if there is no memory for a long name.
+ */
+int inode_set_name(void *fsptr, alloc_stats_t *stats, inode_t *node, const char *name, size_t len);
+
+/**
+ * @brief (3) Frees the out-of-line name of an inode, if it has one.
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param node The inode.
+ */
+void inode_free_name(void *fsptr, alloc_stats_t *stats, inode_t *node);
+
+/**
+ * @brief (4) Computes the length of a path, not counting trailing slashes.
+ *
+ * The root directory "/" keeps its length of 1.
+ *
+ * @param path The path, null-terminated.
+ * @return The length of the path without trailing slashes.
+ */
+size_t path_length(const char *path);
+
+/**
+ * @brief (4) Computes the length of the prefix of a path naming its parent directory.
+ *
+ * @param path The path.
+ * @param len Length of the path, as returned by path_length().
+ * @return Length of the parent's path; 1 (for "/") for the root and its children.
+ */
+size_t parent_length(const char *path, size_t len);
 
 /**
  * @brief (4) Retrieves the last token (filename or directory name) from the given path.
  *
- * Finds the last occurrence of '/' in the path and extracts the token following it.
- * Allocates memory for the token and returns a copy of it.
+ * Finds the last occurrence of '/' in the path and returns a pointer to the
+ * token following it, inside the path itself. Nothing is allocated; the
+ * token ends after token_len characters, ignoring trailing slashes.
  *
  * @param path The path from which to extract the last token.
  * @param token_len Pointer to store the length of the extracted token.
- * @return Pointer to the extracted token, or NULL if memory allocation fails.
+ * @return Pointer to the start of the last token within path.
+ */
+const char *get_last_token(const char *path, size_t *token_len);
+
+/**
+ * @brief (4) Hashes a name for the directory hash index (64-bit FNV-1a).
+ *
+ * @param name The name to hash, not necessarily null-terminated.
+ * @param len Length of the name.
+ * @return The hash of the name.
+ */
+size_t hash_name(const char *name, size_t len);
+
+/**
+ * @brief (4) Looks up a child by name in the hash index of a directory.
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param directory Pointer to the directory inode structure.
+ * @param name Name of the child, not necessarily null-terminated.
+ * @param len Length of the name.
+ * @return Pointer to the index entry of the child, or NULL if there is no such child.
+ */
+dir_index_entry_t *dir_index_find(void *fsptr, inode_directory_t *directory,
+                                  const char *name, size_t len);
+
+/**
+ * @brief (4) Makes sure the hash index of a directory can take one more entry.
+ *
+ * Rebuilds the index at a larger size (or at the same size, to get rid of
+ * removed entries) when inserting another entry would load it over 3/4.
+ * Only the stored hashes are used for rebuilding, no child inode is touched.
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param directory Pointer to the directory inode structure.
+ * @return 1 on success, 0 if there is not enough memory.
+ */
+int dir_index_reserve(void *fsptr, alloc_stats_t *stats, inode_directory_t *directory);
+
+/**
+ * @brief (4) Inserts an entry into the hash index of a directory.
+ *
+ * dir_index_reserve() must have succeeded before.
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param directory Pointer to the directory inode structure.
+ * @param hash Hash of the child's name.
+ * @param slot Position of the child in the children list.
+ */
+void dir_index_insert(void *fsptr, inode_directory_t *directory, size_t hash, size_t slot);
+
+/**
+ * @brief (4) Frees the hash index of a directory.
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param directory Pointer to the directory inode structure.
+ */
+void dir_index_free(void *fsptr, alloc_stats_t *stats, inode_directory_t *directory);
+
+/**
+ * @brief (4) Returns the place of a slot in the children list of a directory.
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param directory Pointer to the directory inode structure.
+ * @param slot The slot, below the capacity dir_children_reserve() made.
+ * @return Pointer to the offset of the child in the slot.
  */
-char *get_last_token(const char *path, unsigned long *token_len);
+fs_offset *dir_child(void *fsptr, inode_directory_t *directory, size_t slot);
 
 /**
- * @brief (4) Tokenizes a string based on a delimiter character and skips a specified number of tokens.
+ * @brief (4) Gives a new directory a children list holding just its parent.
  *
- * Splits the input path string into tokens using the given delimiter character.
- * Allocates memory for the tokens array and returns it.
+ * The offset of the list is stored in the directory without journaling, as
+ * nothing refers to the directory yet.
  *
- * @param token The delimiter character to use for tokenization.
- * @param path The input path string to tokenize.
- * @param skip_n_tokens The number of tokens to skip from the end of the tokenized array.
- * @return An array of token strings, or NULL if memory allocation fails.
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param directory Pointer to the directory inode structure.
+ * @param parent Offset of the parent's inode, to go into slot 0.
+ * @return 1 on success, 0 if there is not enough memory (nothing is allocated then).
  */
-char **tokenize(const char token, const char *path, int skip_n_tokens);
+int dir_children_init(void *fsptr, alloc_stats_t *stats, inode_directory_t *directory, fs_offset parent);
 
-/// @brief (4)
-/// @param tokens 
-void free_tokens(char **tokens);
+/**
+ * @brief (4) Makes sure the children list of a directory can take one more child.
+ *
+ * Grows the last page until it holds DIR_PAGE_SLOTS children, then adds a new
+ * page; only the page table is ever copied as it doubles, never any children.
+ * A page left over by a failed insertion is used again.
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param directory Pointer to the directory inode structure.
+ * @return 1 on success, 0 if there is not enough memory.
+ */
+int dir_children_reserve(void *fsptr, alloc_stats_t *stats, inode_directory_t *directory);
+
+/**
+ * @brief (4) Frees the children list of a directory.
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param directory Pointer to the directory inode structure.
+ */
+void dir_children_free(void *fsptr, alloc_stats_t *stats, inode_directory_t *directory);
+
+/**
+ * @brief (4) Returns the number of bytes the children list of a directory takes.
+ *
+ * Full pages are counted at DIR_PAGE_SLOTS offsets each, so this takes no walk.
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param directory Pointer to the directory inode structure.
+ * @return Bytes of the page table and the pages.
+ */
+size_t dir_children_allocated(void *fsptr, inode_directory_t *directory);
+
+/**
+ * @brief (4) Removes a child from a directory.
+ *
+ * The last child takes the place of the removed one in the children list,
+ * so that removal costs O(1) on average; a page left empty is freed, so
+ * nothing may be allocated before the transaction is committed. The child's
+ * inode is not freed.
+ *
+ * @param fsptr Pointer to the start of the filesystem.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param directory Pointer to the directory inode structure.
+ * @param entry Index entry of the child, as returned by dir_index_find().
+ */
+void remove_child(void *fsptr, alloc_stats_t *stats, inode_directory_t *directory, dir_index_entry_t *entry);
 
 /**
  * @brief (4) Retrieves the inode of a child node within a directory.
@@ -240,98 +978,255 @@ void free_tokens(char **tokens);
  *
  * @param fsptr Pointer to the start of the filesystem.
  * @param directory Pointer to the directory inode structure.
- * @param child Name of the child node to search for.
+ * @param child Name of the child node to search for, not necessarily null-terminated.
+ * @param len Length of the name.
  * @return Pointer to the inode of the child node if found, or NULL if not found.
  */
-inode_t *get_node(void *fsptr, inode_directory_t *directory, const char *child);
+inode_t *get_node(void *fsptr, inode_directory_t *directory, const char *child, size_t len);
 
 /**
  * @brief (4) Resolves the path to retrieve the corresponding inode.
  *
  * Traverses the filesystem hierarchy based on the provided path to locate
- * and return the inode corresponding to the specified path.
+ * and return the inode corresponding to the specified path. The path is
+ * walked in place, without any allocation. The path (or else its parent) is
+ * looked up in the dentry cache of the handle first, and the result of a walk
+ * is entered into it.
  * 
- * @param fsptr Pointer to the start of the filesystem.
+ * @param fs Handle of the mounted filesystem.
  * @param path The path to resolve.
- * @param skip_n_tokens Number of leading tokens to skip in the path.
+ * @param skip_n_tokens Number of trailing tokens to skip in the path.
  * @return Pointer to the inode corresponding to the resolved path, or NULL if not found.
  */
-inode_t *resolve_path(void *fsptr, const char *path, int skip_n_tokens);
+inode_t *resolve_path(fs_handle_t *fs, const char *path, int skip_n_tokens);
 
 /**
  * @brief (6) Creates a new inode (file or directory) at the specified path.
  *
  * Creates a new inode (file or directory) at the specified path within the filesystem.
  * 
- * @param fsptr Pointer to the start of the filesystem.
+ * @param fs Handle of the mounted filesystem.
  * @param path The path where the new inode will be created.
  * @param errnoptr Pointer to store error number in case of failure.
  * @param isfile Indicates whether the inode to be created is a file (1) or directory (0).
  * @return Pointer to the newly created inode on success, NULL on failure.
  */
-inode_t *make_node(void *fsptr, const char *path, int *errnoptr, int is_file);
+inode_t *make_node(fs_handle_t *fs, const char *path, int *errnoptr, int is_file);
 
 /**
- * Removes data from a file block and frees associated memory.
+ * @brief (12) Finds the first extent of a file that ends after the given offset.
+ *
+ * The extent array is sorted, so this is a binary search, unless the cursor
+ * of a sequential access already points there.
  *
  * @param fsptr Pointer to the filesystem.
- * @param block Pointer to the file block.
- * @param size Number of bytes to remove.
+ * @param file Pointer to the inode of the file.
+ * @param offset Offset in the file.
+ * @param cursor Index of an extent at or just before the wanted one, checked
+ *        before searching; NULL if unknown.
+ * @return Index of the extent containing offset or, if offset lies in a gap,
+ *         of the next extent; num_extents if there is none.
+ */
+size_t extent_find(void *fsptr, inode_file_t *file, size_t offset, size_t *cursor);
+
+/**
+ * @brief (12) Copies bytes out of a file; gaps between extents read as zeros.
  *
- * @brief (8) Removes data from a file block and frees associated memory.
+ * @param fsptr Pointer to the filesystem.
+ * @param file Pointer to the inode of the file.
+ * @param buf Buffer to copy into.
+ * @param size Number of bytes to copy, which must lie within the file.
+ * @param offset Offset in the file to copy from.
+ * @param cursor Extent cursor of the access, see extent_find(), updated to where
+ *        the access ended; NULL if none.
  */
-void remove_data(void *fsptr, file_block_t *block, size_t size);
+void file_read(void *fsptr, inode_file_t *file, char *buf, size_t size, size_t offset, size_t *cursor);
 
 /**
- * (8) Allocates a new file block in the filesystem.
+ * @brief (12) Backs a range of a file with extents, allocating them where
+ * needed and growing the file if the range ends beyond it.
+ *
+ * Holes in front of offset stay unallocated. Bytes of the range that were a
+ * hole inside the file read as zeros afterwards; bytes beyond the old end of
+ * the file are left for the caller to fill. An extent continuing the one in
+ * front of it reserves room ahead (as much as the file holds already, up to
+ * EXTENT_PREALLOC_MAX), so that a sequential writer fills few large extents.
  *
  * @param fsptr Pointer to the filesystem.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param file Pointer to the inode of the file.
+ * @param size Number of bytes of the range.
+ * @param offset Offset in the file of the range.
+ * @param cursor Extent cursor of the access, see extent_find(), updated to where
+ *        the access ended; NULL if none.
  * @param errnoptr Pointer to an integer where error code will be stored on failure.
- * @return Pointer to the allocated file block on success, NULL on failure with *errnoptr set appropriately.
+ * @return Number of bytes backed from offset on; if less than size, *errnoptr is set appropriately.
  */
-file_block_t *malloc_file_block(void *fsptr, int *errnoptr);
+size_t file_reserve(void *fsptr, alloc_stats_t *stats, inode_file_t *file, size_t size, size_t offset, size_t *cursor,
+                    int *errnoptr);
 
 /**
- * (8) Appends data to a file block.
+ * @brief (12) Describes where a range of a file lies in the image.
  *
  * @param fsptr Pointer to the filesystem.
- * @param block Pointer to the file block.
- * @param size Size of the data to append.
- * @param errnoptr Pointer to an integer where error code will be stored on failure.
- * @return 1 on success, 0 on failure with *errnoptr set appropriately.
+ * @param file Pointer to the inode of the file.
+ * @param size Number of bytes of the range, which must lie within the file.
+ * @param offset Offset in the file of the range.
+ * @param cursor Extent cursor of the access, see extent_find(), updated to where
+ *        the access ended; NULL if none.
+ * @param segments Array receiving (image offset, length) pairs, offset 0 marking
+ *        a hole; the range touching k extents needs at most 2 * k + 1 pairs.
+ * @return Number of pairs stored.
  */
-int append_data_block(void *fsptr, file_block_t *block, size_t size, int *errnoptr);
+size_t file_segments(void *fsptr, inode_file_t *file, size_t size, size_t offset, size_t *cursor,
+                     size_t *segments);
 
 /**
- * (8) Extends a file block by appending zeros.
+ * @brief (12) Copies bytes into a file, allocating extents where needed and
+ * growing the file if the range ends beyond it, see file_reserve().
  *
  * @param fsptr Pointer to the filesystem.
- * @param block Pointer to the file block to extend.
- * @param size Size of the extension in bytes.
- * @return 1 on success, 0 on failure.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param file Pointer to the inode of the file.
+ * @param buf Bytes to copy.
+ * @param size Number of bytes to copy.
+ * @param offset Offset in the file to copy to.
+ * @param cursor Extent cursor of the access, see extent_find(), updated to where
+ *        the access ended; NULL if none.
+ * @param errnoptr Pointer to an integer where error code will be stored on failure.
+ * @return Number of bytes copied; if less than size, *errnoptr is set appropriately.
  */
-int extend_block_with_zeros(void *fsptr, file_block_t *block, size_t size);
+size_t file_write(void *fsptr, alloc_stats_t *stats, inode_file_t *file, const char *buf, size_t size, size_t offset,
+                  size_t *cursor, int *errnoptr);
 
 /**
- * (8) Frees all file blocks associated with a file.
+ * @brief (8) Cuts a file down to the given size, freeing the memory behind it.
  *
  * @param fsptr Pointer to the filesystem.
- * @param first_block Pointer to the first file block of the file.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param file Pointer to the inode of the file.
+ * @param size New size of the file, not larger than the current one.
  */
-void free_file_blocks(void *fsptr, fs_offset first_block);
+void file_shrink(void *fsptr, alloc_stats_t *stats, inode_file_t *file, size_t size);
 
 /**
- * Adds data to a file in the filesystem.
+ * @brief (13) Frees all data of a file, together with its extent array.
  *
  * @param fsptr Pointer to the filesystem.
+ * @param stats Allocator counters of the handle, to add to.
  * @param file Pointer to the inode of the file.
- * @param size Size of the data to add.
+ */
+void file_free(void *fsptr, alloc_stats_t *stats, inode_file_t *file);
+
+/**
+ * @brief (12) Grows an inline file to cover a range that ends within FILE_INLINE_LEN.
+ *
+ * Bytes between the old end of the file and offset read as zeros afterwards;
+ * bytes beyond the old end are left for the caller to fill.
+ *
+ * @param fsptr Pointer to the filesystem.
+ * @param node Pointer to the inode of the inline file.
+ * @param size Number of bytes of the range.
+ * @param offset Offset in the file of the range.
+ * @return Pointer to the first byte of the range.
+ */
+char *file_inline_reserve(void *fsptr, inode_t *node, size_t size, size_t offset);
+
+/**
+ * @brief (12) Moves the data of an inline file into an extent before it grows
+ * beyond FILE_INLINE_LEN; other files are left as they are.
+ *
+ * @param fsptr Pointer to the filesystem.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param node Pointer to the inode of the file.
+ * @param end Size the file is about to grow to.
  * @param errnoptr Pointer to an integer where error code will be stored on failure.
- * @return 0 on success, -1 on failure with *errnoptr set appropriately.
+ * @return 1 if the file can grow to end on extents, 0 on failure.
+ */
+int file_spill(void *fsptr, alloc_stats_t *stats, inode_t *node, size_t end, int *errnoptr);
+
+/**
+ * @brief (8) Moves the data of a file of at most FILE_INLINE_LEN bytes back into
+ * its inode, freeing its memory; a file split over several extents is left as it is.
+ *
+ * @param fsptr Pointer to the filesystem.
+ * @param stats Allocator counters of the handle, to add to.
+ * @param node Pointer to the inode of the file.
+ */
+void file_unspill(void *fsptr, alloc_stats_t *stats, inode_t *node);
+
+/**
+ * @brief (11) Returns the inode behind an open handle, or resolves the path if there is none.
+ *
+ * @param fs Handle of the mounted filesystem.
+ * @param path Path of the file.
+ * @param handle Open file handle, or NULL.
+ * @return Pointer to the inode, or NULL if the path cannot be resolved.
+ */
+inode_t *resolve_handle(fs_handle_t *fs, const char *path, file_handle_t *handle);
+
+/**
+ * @brief (11) Frees a handle returned by __myfs_open_implem().
+ *
+ * If handle is NULL, the function does nothing.
+ *
+ * @param handle Open file handle.
+ */
+void file_handle_destroy(file_handle_t *handle);
+
+/**
+ * @brief (4) Allocates and initializes an empty dentry cache in process memory.
+ *
+ * @return Pointer to the dentry cache, or NULL on failure.
+ */
+dcache_t *dcache_create(void);
+
+/**
+ * @brief (4) Frees a dentry cache.
+ *
+ * @param dcache The dentry cache; NULL is ignored.
+ */
+void dcache_destroy(dcache_t *dcache);
+
+/**
+ * @brief (4) Looks a path up in the dentry cache.
+ *
+ * @param dcache The dentry cache.
+ * @param path The path, not necessarily null-terminated.
+ * @param len Length of the path.
+ * @return Offset of the inode the path resolves to, or 0 on a miss.
+ */
+fs_offset dcache_lookup(dcache_t *dcache, const char *path, size_t len);
+
+/**
+ * @brief (4) Enters a path into the dentry cache, replacing what was there.
+ *
+ * @param dcache The dentry cache.
+ * @param path The path, not necessarily null-terminated.
+ * @param len Length of the path.
+ * @param node Offset of the inode the path resolves to.
+ */
+void dcache_insert(dcache_t *dcache, const char *path, size_t len, fs_offset node);
+
+/**
+ * @brief (4) Removes a path from the dentry cache.
+ *
+ * Must be called whenever the object named by path gets removed.
  *
- * @brief (8) Adds data to a file in the filesystem.
+ * @param dcache The dentry cache; NULL is ignored.
+ * @param path The path, not necessarily null-terminated.
+ * @param len Length of the path.
  */
-int add_data(void *fsptr, inode_file_t *file, size_t size, int *errnoptr);
+void dcache_remove(dcache_t *dcache, const char *path, size_t len);
+
+/**
+ * @brief (4) Invalidates every entry of the dentry cache in O(1).
+ *
+ * Needed whenever a directory moves, as all paths below it change.
+ *
+ * @param dcache The dentry cache; NULL is ignored.
+ */
+void dcache_invalidate(dcache_t *dcache);
 
 /* END fuse helper methods */
 
@@ -339,7 +1234,7 @@ int add_data(void *fsptr, inode_file_t *file, size_t size, int *errnoptr);
 
 /**
  * @brief (4) Implements an emulation of the stat system call on the filesystem 
- *        of size fssize pointed to by fsptr.
+ *        of the handle fs.
  *
  * If path can be followed and describes a file or directory 
  * that exists and is accessible, the access information is 
@@ -348,8 +1243,7 @@ int add_data(void *fsptr, inode_file_t *file, size_t size, int *errnoptr);
  * On success, 0 is returned. On failure, -1 is returned and 
  * the appropriate error code is put into *errnoptr.
  *
- * @param fsptr Pointer to the start of the filesystem.
- * @param fssize Size of the filesystem.
+ * @param fs Handle of the mounted filesystem.
  * @param errnoptr Pointer to store the error code in case of failure.
  * @param uid User ID.
  * @param gid Group ID.
@@ -371,12 +1265,12 @@ int add_data(void *fsptr, inode_file_t *file, size_t size, int *errnoptr);
  * - st_atim
  * - st_mtim
  */
-int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr, uid_t uid,
-                          gid_t gid, const char *path, struct stat *stbuf);
+int __myfs_getattr_implem(fs_handle_t *fs, int *errnoptr,
+                          uid_t uid, gid_t gid, const char *path, struct stat *stbuf);
 
 /**
  * @brief (5) Implements an emulation of the readdir system call on the filesystem 
- *        of size fssize pointed to by fsptr. 
+ *        of the handle fs. 
  *
  * If path can be followed and describes a directory that exists and
  * is accessible, the names of the subdirectories and files 
@@ -410,19 +1304,30 @@ int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr, uid_t uid,
  * In the case memory allocation with malloc/calloc fails, failure is
  * indicated by returning -1 and setting *errnoptr to EINVAL.
  *
- * @param fsptr Pointer to the start of the filesystem
- * @param fssize Size of the filesystem
+ * @param fs Handle of the mounted filesystem.
  * @param errnoptr Pointer to store error code in case of failure
  * @param path Path of the directory to read
  * @param namesptr Pointer to store the array of directory and file names
  * @return The number of names read on success, 0 if no entries, -1 on failure
  */
-int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+int __myfs_readdir_implem(fs_handle_t *fs, int *errnoptr,
                           const char *path, char ***namesptr);
+/// @brief Hands the entries of a directory to filler one by one, as FUSE's readdir does, without allocating
+/// @param fs Handle of the mounted file system
+/// @param errnoptr Pointer to store error number in case of failure
+/// @param uid User ID put into the attributes of the entries
+/// @param gid Group ID put into the attributes of the entries
+/// @param path Path of the directory to read
+/// @param offset Offset of the last entry already taken, 0 to start with .
+/// @param buf Buffer passed on to filler
+/// @param filler Called for each entry with its attributes and the offset to resume behind it
+/// @return 0 on success (including when filler stops early), -1 on failure
+int __myfs_readdir_fill_implem(fs_handle_t *fs, int *errnoptr, uid_t uid, gid_t gid,
+                               const char *path, off_t offset, void *buf, dir_filler_t filler);
 
 /**
  * @brief (6) Implements an emulation of the mknod system call for regular files
- *        on the filesystem of size fssize pointed to by fsptr.
+ *        on the filesystem of the handle fs.
  *
  * This function is called only for the creation of regular files.
  * If a file gets created, it is of size zero and has default
@@ -433,31 +1338,40 @@ int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
  * On failure, -1 is returned and *errnoptr is set appropriately.
  * The error codes are documented in man 2 mknod.
  *
- * @param fsptr Pointer to the start of the filesystem.
- * @param fssize Size of the filesystem.
+ * @param fs Handle of the mounted filesystem.
  * @param errnoptr Pointer to store the error code in case of failure.
  * @param path Path to the file to be created.
  * @return 0 on success, -1 on failure.
  */ 
-int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
+int __myfs_mknod_implem(fs_handle_t *fs, int *errnoptr,
                         const char *path);
 
-/// @brief 
-/// @param fsptr 
-/// @param fssize 
-/// @param errnoptr 
-/// @param path 
-/// @return 
-int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr,
+/**
+ * @brief (13) Implements an emulation of the unlink system call for regular files
+ *        on the filesystem of the handle fs.
+ *
+ * The file's data, its inode and its entry in the parent directory are freed.
+ *
+ * @param fs Handle of the mounted filesystem.
+ * @param errnoptr Pointer to store the error code in case of failure.
+ * @param path Path to the file to be removed.
+ * @return 0 on success, -1 on failure.
+ */
+int __myfs_unlink_implem(fs_handle_t *fs, int *errnoptr,
                          const char *path);
 
-/// @brief 
-/// @param fsptr 
-/// @param fssize 
-/// @param errnoptr 
-/// @param path 
-/// @return 
-int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+/**
+ * @brief (14) Implements an emulation of the rmdir system call on the filesystem
+ *        of the handle fs.
+ *
+ * Fails with ENOTEMPTY when the directory contains anything besides . and ..
+ *
+ * @param fs Handle of the mounted filesystem.
+ * @param errnoptr Pointer to store the error code in case of failure.
+ * @param path Path to the directory to be removed.
+ * @return 0 on success, -1 on failure.
+ */
+int __myfs_rmdir_implem(fs_handle_t *fs, int *errnoptr,
                         const char *path);
 
 /**
@@ -465,8 +1379,7 @@ int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
  *
  * This function creates a directory indicated by the given path.
  *
- * @param fsptr Pointer to the filesystem.
- * @param fssize Size of the filesystem.
+ * @param fs Handle of the mounted filesystem.
  * @param errnoptr Pointer to an integer where error code will be stored on failure.
  * @param path Path of the directory to be created.
  * @return 0 on success, -1 on failure with *errnoptr set appropriately.
@@ -475,84 +1388,135 @@ int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
  *
  * The error codes are documented in man 2 mkdir.
  */
-int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+int __myfs_mkdir_implem(fs_handle_t *fs, int *errnoptr,
                         const char *path);
 
-/// @brief 
-/// @param fsptr 
-/// @param fssize 
-/// @param errnoptr 
-/// @param from 
-/// @param to 
-/// @return 
-int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
+/**
+ * @brief (15) Implements an emulation of the rename system call on the filesystem
+ *        of the handle fs.
+ *
+ * The inode indicated by from is moved to to, with no data copied: its offset moves
+ * from one children list to the other and its index entry follows its name. An
+ * existing target of the same kind (a file, or an empty directory) is replaced in
+ * its own slot and freed in the same transaction, so a crash leaves either the
+ * old or the new target in place. The dentry cache is cleared when a directory
+ * moves, as the paths of everything below it change.
+ *
+ * The error codes are documented in man 2 rename; EINVAL is set when a directory
+ * would be moved below itself.
+ *
+ * @param fs Handle of the mounted filesystem.
+ * @param errnoptr Pointer to store the error code in case of failure.
+ * @param from Path of the file or directory to be moved.
+ * @param to Path to move it to.
+ * @return 0 on success, -1 on failure.
+ */
+int __myfs_rename_implem(fs_handle_t *fs, int *errnoptr,
                          const char *from, const char *to);
 
 /**
  * Emulates the truncate system call on the filesystem.
  *
- * @param fsptr Pointer to the filesystem.
- * @param fssize Size of the filesystem.
+ * @param fs Handle of the mounted filesystem.
  * @param errnoptr Pointer to an integer where error code will be stored on failure.
  * @param path Path to the file.
+ * @param handle Open file handle (for ftruncate), or NULL to resolve path.
  * @param offset New size of the file in bytes.
  * @return 0 on success, -1 on failure with *errnoptr set appropriately.
  *
  * @brief (8) Emulates the truncate system call on the filesystem.
  */
-int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
-                           const char *path, off_t offset);
+int __myfs_truncate_implem(fs_handle_t *fs, int *errnoptr,
+                           const char *path, file_handle_t *handle, off_t offset);
 
 /// @brief 
-/// @param fsptr 
-/// @param fssize 
+/// @param fs 
 /// @param errnoptr 
 /// @param path 
+/// @param handleptr Set to a new handle for the file, to be freed with file_handle_destroy()
 /// @return 
-int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr,
-                       const char *path);
+int __myfs_open_implem(fs_handle_t *fs, int *errnoptr,
+                       const char *path, file_handle_t **handleptr);
 
 /// @brief 
-/// @param fsptr 
-/// @param fssize 
+/// @param fs 
 /// @param errnoptr 
 /// @param path 
+/// @param handle Open file handle, or NULL to resolve path
 /// @param buf 
 /// @param size 
 /// @param offset 
 /// @return 
-int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
-                       const char *path, char *buf, size_t size, off_t offset);
+int __myfs_read_implem(fs_handle_t *fs, int *errnoptr,
+                       const char *path, file_handle_t *handle, char *buf, size_t size, off_t offset);
+/// @brief Locates the bytes a read would return inside the image, without copying them
+/// @param fs Handle of the mounted file system
+/// @param errnoptr Pointer to store error number in case of failure
+/// @param path Path of the file
+/// @param handle Open file handle, or NULL to resolve path
+/// @param size Number of bytes to read
+/// @param offset Offset in the file to read from
+/// @param segmentsptr Set to a malloc'd array of (image offset, length) pairs, offset 0 marking a hole
+/// @param countptr Set to the number of pairs
+/// @return Number of bytes covered by the pairs, or -1 on failure
+int __myfs_read_extents_implem(fs_handle_t *fs, int *errnoptr,
+                               const char *path, file_handle_t *handle, size_t size, off_t offset,
+                               size_t **segmentsptr, size_t *countptr);
+/// @brief Backs the range of a write in the image and locates it, leaving the copying to the caller
+/// @param fs Handle of the mounted file system
+/// @param errnoptr Pointer to store error number in case of failure
+/// @param path Path of the file
+/// @param handle Open file handle, or NULL to resolve path
+/// @param size Number of bytes to write
+/// @param offset Offset in the file to write to
+/// @param segmentsptr Set to a malloc'd array of (image offset, length) pairs
+/// @param countptr Set to the number of pairs
+/// @param old_sizeptr Set to the size of the file before the call
+/// @return Number of bytes covered by the pairs, or -1 on failure
+int __myfs_write_extents_implem(fs_handle_t *fs, int *errnoptr,
+                                const char *path, file_handle_t *handle, size_t size, off_t offset,
+                                size_t **segmentsptr, size_t *countptr, off_t *old_sizeptr);
 /// @brief 
-/// @param fsptr 
-/// @param fssize 
+/// @param fs 
 /// @param errnoptr 
 /// @param path 
+/// @param handle Open file handle, or NULL to resolve path
 /// @param buf 
 /// @param size 
 /// @param offset 
 /// @return 
-int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
-                        const char *path, const char *buf, size_t size,
+int __myfs_write_implem(fs_handle_t *fs, int *errnoptr,
+                        const char *path, file_handle_t *handle, const char *buf, size_t size,
                         off_t offset);
 
+/// @brief Finds the pages of the image a sync of a file has to write back
+/// @param fs Handle of the mounted file system
+/// @param errnoptr Pointer to store error number in case of failure
+/// @param path Path of the file
+/// @param handle Open file handle, or NULL to resolve path
+/// @param datasync Non-zero if only the file's data and inode need to be written back
+/// @param rangesptr Set to a malloc'd array of (image offset, length) pairs
+/// @param countptr Set to the number of pairs
+/// @return 0 on success, or -1 on failure
+int __myfs_fsync_implem(fs_handle_t *fs, int *errnoptr,
+                        const char *path, file_handle_t *handle, int datasync,
+                        size_t **rangesptr, size_t *countptr);
+
 /// @brief 
-/// @param fsptr 
-/// @param fssize 
+/// @param fs 
 /// @param errnoptr 
 /// @param path 
 /// @param ts 
 /// @return 
-int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
+int __myfs_utimens_implem(fs_handle_t *fs, int *errnoptr,
                           const char *path, const struct timespec ts[2]);
 
 /// @brief 
-/// @param fsptr 
-/// @param fssize 
+/// @param fs 
 /// @param errnoptr 
 /// @param stbuf 
 /// @return 
-int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr,
+int __myfs_statfs_implem(fs_handle_t *fs, int *errnoptr,
                          struct statvfs *stbuf);
 
 // END of fuse function declarations
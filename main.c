@@ -1,80 +1,355 @@
 #include <stdio.h>  //printf()
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 
 #include "implementation.h"
 
-// void print_tokens(char **tokens) {
-//   for (; *tokens; tokens++) {
-//     printf("%s\n", *tokens);
-//   }
-// }
-
-int main(void) {
-//   const char path[85] =
-//       "/Users/robertalvarez/OneDrive - University of Texas at El "
-//       "Paso/Fall_2022/CS_4375/HW3";
-//   printf("Full path: %s\n", path);
-
-//   // Tokenize all of them but eh last one and print them
-//   char **tokens = tokenize('/', path, 1);
-//   print_tokens(tokens);
-
-//   // Tokenize the last token and print it with its size
-//   unsigned long len;
-//   char *last_token = get_last_token(path, &len);
-
-//   printf("Last token: %s\n", last_token);
-//   printf("len: %lu =? strlen(last_token): %lu\n", len, strlen(last_token));
-
-//   const char path2[6] = "/file";
-//   printf("Full path: %s\n", path2);
-//   tokens = tokenize('/', path2, 0);
-//   for (char **token = tokens; *token; token++) {
-//     printf("token = %s\n", *token);
-//   }
-
-//   printf("sizeof(handler_t) = %zx\n", sizeof(handler_t));
-//   printf("sizeof(node_t) = %zx\n", sizeof(node_t));
-//   printf("sizeof(directory_t) = %zx\n", sizeof(directory_t));
-//   printf("sizeof(file_t) = %zx\n", sizeof(file_t));
-//   printf("sizeof(file_block_t) = %zx\n", sizeof(file_block_t));
-//   printf("sizeof(size_t) = %zx\n", sizeof(size_t));
-//   printf("sizeof(struct timespec) = %zx\n\n", sizeof(struct timespec));
-
-//   size_t fssize = 2048;
-//   void *fsptr = mmap(NULL, fssize, PROT_WRITE | PROT_READ,
-//                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-
-//   printf("fssize = %zx\n", fssize);
-//   if (fsptr != NULL) {
-//     handler(fsptr, fssize);
-//     size_t *size = malloc(sizeof(size_t));
-//     *size = 0x10;
-//     void *alloc = __malloc_impl(fsptr, NULL, size);
-
-//     printf("fsptr = %p\n", fsptr);
-//     printf("alloc = %p\n", alloc);
-//     printf("alloc-fsptr = %zx\n", (alloc - fsptr));
-
-//     List *LL = (List *)get_free_memory_ptr(fsptr);
-//     AllocateFrom *fb = off_to_ptr(fsptr, LL->first_space);
-//     printf("fb->remaining = %zx\n", fb->remaining);
-//     printf("fb->next_space = %zx\n", fb->next_space);
-
-//     *size = 0x10;
-//     void *alloc2 = __malloc_impl(fsptr, alloc, size);
-
-//     printf("fsptr = %p\n", fsptr);
-//     printf("alloc2 = %p\n", alloc2);
-//     printf("alloc2-fsptr = %zx\n", (alloc2 - fsptr));
-//     __free_impl(fsptr, alloc);
-
-//     free(size);
-//     munmap(fsptr, fssize);
-//   }
-
-   return 0;
-}
\ No newline at end of file
+/* Microbenchmarks of the implem layer and the allocator
+
+   The filesystem lives in a large anonymous mapping and the
+   __myfs_*_implem functions are called directly, without FUSE or any
+   of the locking in myfs.c. Every operation is timed on its own; each
+   benchmark reports its rate and the latency percentiles.
+
+   usage: main [-n operations] [-s image size in MiB] [-i I/O size in bytes] [-b block size in bytes]
+               [-r seed]
+*/
+
+#define BENCH_DEPTH    32                   // Directories on the path of the lookups
+#define BENCH_READDIRS ((size_t)50)         // Listings of the large directory
+#define BENCH_SLOTS    ((size_t)1024)       // Live blocks in the allocator churn
+#define BENCH_BLOCK    ((size_t)4096)       // Largest block in the allocator churn
+#define BENCH_FILE_MAX ((size_t)64 << 20)   // Largest file of the sequential I/O
+
+typedef struct bench {
+  fs_handle_t *fs;
+  void *fsptr;
+  size_t ops;       // Operations per benchmark
+  size_t io_size;   // Bytes per read or write
+  uint64_t seed;    // State of the random number generator
+  uint64_t *lat;    // Latencies of the current benchmark, in ns
+  size_t count;     // Used entries of lat
+  int failed;
+} bench_t;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec) * ((uint64_t)1000000000) + ((uint64_t)ts.tv_nsec);
+}
+
+// xorshift64*, good enough to spread the offsets and sizes
+static uint64_t bench_random(bench_t *b) {
+  b->seed ^= b->seed >> 12;
+  b->seed ^= b->seed << 25;
+  b->seed ^= b->seed >> 27;
+  return b->seed * ((uint64_t)0x2545F4914F6CDD1DULL);
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *((const uint64_t *)a);
+  uint64_t y = *((const uint64_t *)b);
+
+  return (x > y) - (x < y);
+}
+
+// Files the latency of an operation that started at start; res is its result
+static void bench_record(bench_t *b, uint64_t start, int res, int err) {
+  b->lat[b->count++] = now_ns() - start;
+  if ((res < 0) && !b->failed) {
+    fprintf(stderr, "operation %zu failed: %s\n", b->count, strerror(err));
+    b->failed = 1;
+  }
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t count, unsigned int permille) {
+  size_t i = (count * permille) / ((size_t)1000);
+
+  return sorted[(i < count) ? i : (count - ((size_t)1))];
+}
+
+// Prints the rate and the latency percentiles of the benchmark that just ran
+static void bench_report(bench_t *b, const char *name) {
+  uint64_t total = 0;
+  size_t i;
+
+  if (b->count == ((size_t)0)) {
+    printf("%-16s no operations\n", name);
+    return;
+  }
+  for (i = 0; i < b->count; i++) {
+    total += b->lat[i];
+  }
+  qsort(b->lat, b->count, sizeof(uint64_t), compare_u64);
+  printf("%-16s %9zu ops %12.0f ops/s  p50 %8llu  p90 %8llu  p99 %8llu  p99.9 %8llu  max %10llu ns%s\n",
+         name, b->count,
+         (total == 0) ? 0.0 : ((double)b->count) * 1e9 / ((double)total),
+         (unsigned long long)percentile(b->lat, b->count, 500),
+         (unsigned long long)percentile(b->lat, b->count, 900),
+         (unsigned long long)percentile(b->lat, b->count, 990),
+         (unsigned long long)percentile(b->lat, b->count, 999),
+         (unsigned long long)b->lat[b->count - ((size_t)1)],
+         b->failed ? "  (failures)" : "");
+  b->count = 0;
+  b->failed = 0;
+}
+
+// Creates ops files in one directory, which the readdir benchmark lists
+static void bench_create(bench_t *b) {
+  char path[64];
+  int err;
+  size_t i;
+
+  __myfs_mkdir_implem(b->fs, &err, "/create");
+  for (i = 0; i < b->ops; i++) {
+    snprintf(path, sizeof(path), "/create/file%zu", i);
+    uint64_t start = now_ns();
+    int res = __myfs_mknod_implem(b->fs, &err, path);
+    bench_record(b, start, res, err);
+  }
+  bench_report(b, "create");
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+  (*((size_t *)buf))++;
+  return 0;
+}
+
+static void bench_readdir(bench_t *b) {
+  size_t entries, i;
+  int err;
+
+  for (i = 0; i < BENCH_READDIRS; i++) {
+    entries = 0;
+    uint64_t start = now_ns();
+    int res = __myfs_readdir_fill_implem(b->fs, &err, 0, 0, "/create", 0, &entries, count_entry);
+    bench_record(b, start, res, err);
+  }
+  bench_report(b, "readdir");
+}
+
+// Looks up the files of the create benchmark and a file at the end of a long path
+static void bench_lookup(bench_t *b) {
+  char path[BENCH_DEPTH * 8 + 16];
+  struct stat st;
+  size_t len, i;
+  int err, d;
+
+  for (i = 0; i < b->ops; i++) {
+    snprintf(path, sizeof(path), "/create/file%zu", (size_t)(bench_random(b) % b->ops));
+    uint64_t start = now_ns();
+    int res = __myfs_getattr_implem(b->fs, &err, 0, 0, path, &st);
+    bench_record(b, start, res, err);
+  }
+  bench_report(b, "lookup");
+
+  len = 0;
+  for (d = 0; d < BENCH_DEPTH; d++) {
+    len += (size_t)snprintf(path + len, sizeof(path) - len, "/dir%02d", d);
+    __myfs_mkdir_implem(b->fs, &err, path);
+  }
+  snprintf(path + len, sizeof(path) - len, "/file");
+  __myfs_mknod_implem(b->fs, &err, path);
+  for (i = 0; i < b->ops; i++) {
+    uint64_t start = now_ns();
+    int res = __myfs_getattr_implem(b->fs, &err, 0, 0, path, &st);
+    bench_record(b, start, res, err);
+  }
+  bench_report(b, "deep lookup");
+}
+
+// Writes and reads back a file sequentially, then at random offsets inside it
+static void bench_io(bench_t *b) {
+  size_t chunks = b->ops;
+  file_handle_t *handle = NULL;
+  char *buf;
+  size_t i;
+  int err;
+
+  if (chunks * b->io_size > BENCH_FILE_MAX) {
+    chunks = (b->io_size < BENCH_FILE_MAX) ? (BENCH_FILE_MAX / b->io_size) : ((size_t)1);
+  }
+  if ((buf = malloc(b->io_size)) == NULL) {
+    return;
+  }
+  memset(buf, 'x', b->io_size);
+  __myfs_mknod_implem(b->fs, &err, "/io");
+  if (__myfs_open_implem(b->fs, &err, "/io", &handle) < 0) {
+    fprintf(stderr, "open: %s\n", strerror(err));
+    free(buf);
+    return;
+  }
+
+  for (i = 0; i < chunks; i++) {
+    uint64_t start = now_ns();
+    int res = __myfs_write_implem(b->fs, &err, "/io", handle, buf, b->io_size, (off_t)(i * b->io_size));
+    bench_record(b, start, res, err);
+  }
+  bench_report(b, "seq write");
+
+  for (i = 0; i < chunks; i++) {
+    uint64_t start = now_ns();
+    int res = __myfs_read_implem(b->fs, &err, "/io", handle, buf, b->io_size, (off_t)(i * b->io_size));
+    bench_record(b, start, res, err);
+  }
+  bench_report(b, "seq read");
+
+  for (i = 0; i < b->ops; i++) {
+    off_t offset = (off_t)((bench_random(b) % chunks) * b->io_size);
+    uint64_t start = now_ns();
+    int res = __myfs_write_implem(b->fs, &err, "/io", handle, buf, b->io_size, offset);
+    bench_record(b, start, res, err);
+  }
+  bench_report(b, "random write");
+
+  for (i = 0; i < b->ops; i++) {
+    off_t offset = (off_t)((bench_random(b) % chunks) * b->io_size);
+    uint64_t start = now_ns();
+    int res = __myfs_read_implem(b->fs, &err, "/io", handle, buf, b->io_size, offset);
+    bench_record(b, start, res, err);
+  }
+  bench_report(b, "random read");
+
+  file_handle_destroy(handle);
+  __myfs_unlink_implem(b->fs, &err, "/io");
+  free(buf);
+}
+
+// Grows a file by io_size at a time
+static void bench_truncate(bench_t *b) {
+  size_t steps = b->ops;
+  size_t i;
+  int err;
+
+  if (steps * b->io_size > BENCH_FILE_MAX) {
+    steps = (b->io_size < BENCH_FILE_MAX) ? (BENCH_FILE_MAX / b->io_size) : ((size_t)1);
+  }
+  __myfs_mknod_implem(b->fs, &err, "/truncate");
+  for (i = 1; i <= steps; i++) {
+    uint64_t start = now_ns();
+    int res = __myfs_truncate_implem(b->fs, &err, "/truncate", NULL, (off_t)(i * b->io_size));
+    bench_record(b, start, res, err);
+  }
+  bench_report(b, "truncate grow");
+  __myfs_unlink_implem(b->fs, &err, "/truncate");
+}
+
+// Random mallocs, reallocs and frees over a pool of live blocks, straight on the allocator
+static void bench_alloc(bench_t *b) {
+  void *slots[BENCH_SLOTS];
+  size_t i, size;
+
+  memset(slots, 0, sizeof(slots));
+  for (i = 0; i < b->ops; i++) {
+    size_t slot = (size_t)(bench_random(b) % BENCH_SLOTS);
+    size = ((size_t)(bench_random(b) % BENCH_BLOCK)) + ((size_t)1);
+    int res = 0;
+    uint64_t start = now_ns();
+    if (slots[slot] == NULL) {
+      slots[slot] = malloc_impl(b->fsptr, &b->fs->stats, &size);
+      res = (slots[slot] == NULL) ? -1 : 0;
+    } else if ((bench_random(b) & 1) == 0) {
+      free_impl(b->fsptr, &b->fs->stats, slots[slot]);
+      slots[slot] = NULL;
+    } else {
+      void *ptr = realloc_impl(b->fsptr, &b->fs->stats, slots[slot], &size);
+      if (ptr != NULL) {
+        slots[slot] = ptr;
+      } else {
+        res = -1;
+      }
+    }
+    journal_commit(b->fsptr);  // Each call is an operation of its own, see journal_log()
+    bench_record(b, start, res, ENOMEM);
+  }
+  bench_report(b, "alloc churn");
+
+  for (i = 0; i < BENCH_SLOTS; i++) {
+    free_impl(b->fsptr, &b->fs->stats, slots[i]);
+    journal_commit(b->fsptr);
+  }
+}
+
+static size_t parse_arg(const char *str, size_t min) {
+  char *end;
+  unsigned long long val = strtoull(str, &end, 0);
+
+  if ((*str == '\0') || (*end != '\0') || (val < ((unsigned long long)min))) {
+    return 0;
+  }
+  return (size_t)val;
+}
+
+int main(int argc, char **argv) {
+  size_t fssize = ((size_t)512) << 20;
+  size_t block_size = BLOCK_SIZE;
+  bench_t b;
+  int opt, err;
+
+  memset(&b, 0, sizeof(b));
+  b.ops = 100000;
+  b.io_size = 4096;
+  b.seed = 88172645463325252ULL;
+  while ((opt = getopt(argc, argv, "n:s:i:b:r:")) != -1) {
+    switch (opt) {
+    case 'n':
+      b.ops = parse_arg(optarg, 1);
+      break;
+    case 's':
+      fssize = parse_arg(optarg, 1) << 20;
+      break;
+    case 'i':
+      b.io_size = parse_arg(optarg, 1);
+      break;
+    case 'b':
+      block_size = parse_arg(optarg, 1);
+      break;
+    case 'r':
+      b.seed = (uint64_t)parse_arg(optarg, 1);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n operations] [-s image size in MiB] [-i I/O size in bytes] [-b block size in bytes] [-r seed]\n", argv[0]);
+      return 1;
+    }
+  }
+  if ((b.ops == 0) || (fssize == 0) || (b.io_size == 0) || (block_size == 0) || (b.seed == 0)) {
+    fprintf(stderr, "%s: bad argument\n", argv[0]);
+    return 1;
+  }
+
+  b.fsptr = mmap(NULL, fssize, PROT_WRITE | PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (b.fsptr == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  if ((b.fs = fs_handle_create(b.fsptr, fssize, block_size, &err)) == NULL) {
+    fprintf(stderr, "%s: cannot set up the filesystem: %s\n", argv[0], strerror(err));
+    munmap(b.fsptr, fssize);
+    return 1;
+  }
+  if ((b.lat = malloc(((b.ops > BENCH_READDIRS) ? b.ops : BENCH_READDIRS) * sizeof(uint64_t))) == NULL) {
+    fs_handle_destroy(b.fs);
+    munmap(b.fsptr, fssize);
+    return 1;
+  }
+
+  printf("image %zu MiB, %zu operations, %zu-byte I/O, %zu-byte blocks\n", fssize >> 20, b.ops, b.io_size,
+         block_size);
+  bench_create(&b);
+  bench_readdir(&b);
+  bench_lookup(&b);
+  bench_io(&b);
+  bench_truncate(&b);
+  bench_alloc(&b);
+
+  free(b.lat);
+  fs_handle_destroy(b.fs);
+  munmap(b.fsptr, fssize);
+  return 0;
+}
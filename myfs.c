@@ -54,11 +54,23 @@
 #include <sys/mman.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
 
 
 struct __myfs_options_struct_t {
         const char *filename;
         const char *size;
+        const char *block_size;
+        int zerocopy;
+        int hugepages;
+        int populate;
+        const char *numa_node;
+        const char *compact_interval;
+        const char *writeback_interval;
+        const char *writeback_dirty;
         int show_help;
 };
 
@@ -67,6 +79,14 @@ struct __myfs_options_struct_t {
 static const struct fuse_opt __myfs_option_spec[] = {
         OPTION("--backupfile=%s", filename),
         OPTION("--size=%s", size),
+        OPTION("--block-size=%s", block_size),
+        OPTION("--zerocopy", zerocopy),
+        OPTION("--hugepages", hugepages),
+        OPTION("--populate", populate),
+        OPTION("--numa-node=%s", numa_node),
+        OPTION("--compact-interval=%s", compact_interval),
+        OPTION("--writeback-interval=%s", writeback_interval),
+        OPTION("--writeback-dirty=%s", writeback_dirty),
         OPTION("-h", show_help),
         OPTION("--help", show_help),
         FUSE_OPT_END
@@ -78,18 +98,270 @@ struct __memory_block_struct_t {
 };
 typedef struct __memory_block_struct_t memory_block_t;
 
+/* Initialization of the filesystem and its handle, see
+   implementation.c 
+*/
+typedef struct fs_handle fs_handle_t;
+typedef struct file_handle file_handle_t;
+
+fs_handle_t *fs_handle_create(void *, size_t, size_t, int *);
+void fs_handle_destroy(fs_handle_t *);
+int fs_handle_print_stats(fs_handle_t *, char *, size_t);
+size_t fs_handle_compact(fs_handle_t *, size_t, int);
+unsigned int free_fragmentation(void *);
+void file_handle_destroy(file_handle_t *);
+
+/* Declaration for the implementations of the operations */
+
+int __myfs_getattr_implem(fs_handle_t *, int *, uid_t, gid_t, const char *, struct stat *);
+int __myfs_readdir_implem(fs_handle_t *, int *, const char *, char ***);
+int __myfs_readdir_fill_implem(fs_handle_t *, int *, uid_t, gid_t, const char *, off_t,
+                               void *, fuse_fill_dir_t);
+int __myfs_mknod_implem(fs_handle_t *, int *, const char *);
+int __myfs_unlink_implem(fs_handle_t *, int *, const char *);
+int __myfs_mkdir_implem(fs_handle_t *, int *, const char *);
+int __myfs_rmdir_implem(fs_handle_t *, int *, const char *);
+int __myfs_rename_implem(fs_handle_t *, int *, const char *, const char*);
+int __myfs_truncate_implem(fs_handle_t *, int *, const char *, file_handle_t *, off_t);
+int __myfs_open_implem(fs_handle_t *, int *, const char *, file_handle_t **);
+int __myfs_read_implem(fs_handle_t *, int *, const char *, file_handle_t *, char *, size_t, off_t);
+int __myfs_read_extents_implem(fs_handle_t *, int *, const char *, file_handle_t *, size_t, off_t, size_t **, size_t *);
+int __myfs_write_implem(fs_handle_t *, int *, const char *, file_handle_t *, const char *, size_t, off_t);
+int __myfs_write_extents_implem(fs_handle_t *, int *, const char *, file_handle_t *, size_t, off_t, size_t **, size_t *, off_t *);
+int __myfs_statfs_implem(fs_handle_t *, int *, struct statvfs*);
+int __myfs_utimens_implem(fs_handle_t *, int *, const char *, const struct timespec [2]);
+int __myfs_fsync_implem(fs_handle_t *, int *, const char *, file_handle_t *, int, size_t **, size_t *);
+
+/* Open files carry their handle in fi->fh */
+#define MYFS_HANDLE(fi)  (((fi) == NULL) ? NULL : ((file_handle_t *) (uintptr_t) ((fi)->fh)))
+
+/* Locking scheme
+
+   env_lock is a reader/writer lock taken in shared mode by every
+   operation; it is only taken in exclusive mode for work on the whole
+   image.
+
+   Directories and files are protected by a table of striped
+   reader/writer locks, indexed by a hash of the path naming them. An
+   operation takes every proper ancestor of its path in shared mode,
+   so that nobody changes the directories it walks through, and then
+   the object it works on (or its parent, for operations changing a
+   directory's entries) in the appropriate mode. Reads take a file in
+   shared mode: the access time and the handle's cursor they update are
+   stored with relaxed atomics (see implementation.c).
+
+   alloc_lock serializes the operations that may allocate or free
+   memory in the image, as the allocator state in the superblock is
+   shared by all of them. Writes only hold it while they reserve the
+   range they write to: the copy into the reserved runs changes no
+   shared state, and the stripes keep anybody else from freeing them.
+
+   All locks are always acquired in the same order (env_lock, the
+   stripes by ascending index, alloc_lock), which rules out deadlocks.
+
+   Every shard (see below) has locks of its own; a lock set only ever
+   takes the locks of one shard.
+*/
+#define MYFS_LOCK_STRIPES  ((size_t) 64)
+
+#define MYFS_LOCK_NONE       ((unsigned char) 0)
+#define MYFS_LOCK_SHARED     ((unsigned char) 1)
+#define MYFS_LOCK_EXCLUSIVE  ((unsigned char) 2)
+
+struct __myfs_lockset_struct_t {
+  size_t        shard;
+  unsigned char global;
+  unsigned char stripes[MYFS_LOCK_STRIPES];
+  int           alloc;
+};
+typedef struct __myfs_lockset_struct_t lockset_t;
+
+/* Statistics
+
+   Every operation counts its calls and failures and files its latency
+   into a histogram over powers of two of nanoseconds; the lock set
+   code adds up the time spent waiting for the locks. The counters are
+   only ever added to, with relaxed atomics, so recording takes no
+   lock. They are read from the virtual file MYFS_STATS_PATH, along
+   with the statistics the filesystem keeps itself (see
+   implementation.c).
+*/
+#define MYFS_STATS_PATH     "/.myfs_stats"
+#define MYFS_STATS_BUCKETS  40                /* Bucket i: [2^i, 2^(i+1)) ns */
+#define MYFS_STATS_MAX      ((size_t) 16384)  /* Room for the text of the file */
+
+enum __myfs_op_enum_t {
+  MYFS_OP_GETATTR,
+  MYFS_OP_READDIR,
+  MYFS_OP_MKNOD,
+  MYFS_OP_UNLINK,
+  MYFS_OP_MKDIR,
+  MYFS_OP_RMDIR,
+  MYFS_OP_RENAME,
+  MYFS_OP_TRUNCATE,
+  MYFS_OP_OPEN,
+  MYFS_OP_READ,
+  MYFS_OP_WRITE,
+  MYFS_OP_STATFS,
+  MYFS_OP_UTIMENS,
+  MYFS_OP_FSYNC,
+  MYFS_OP_COUNT
+};
+
+static const char *__myfs_op_names[MYFS_OP_COUNT] = {
+  "getattr", "readdir", "mknod", "unlink", "mkdir", "rmdir", "rename",
+  "truncate", "open", "read", "write", "statfs", "utimens", "fsync"
+};
+
+struct __myfs_op_stats_struct_t {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t total_ns;
+  uint64_t buckets[MYFS_STATS_BUCKETS];
+};
+
+struct __myfs_stats_struct_t {
+  struct __myfs_op_stats_struct_t ops[MYFS_OP_COUNT];
+  uint64_t lock_acquires;
+  uint64_t lock_wait_ns;
+  uint64_t writeback_runs;
+  uint64_t writeback_bytes;
+  uint64_t writeback_ns;
+  uint64_t snapshots;
+  uint64_t snapshot_pause_ns;
+};
+
+/* Text of the statistics file, taken when it is opened */
+struct __myfs_stats_snapshot_struct_t {
+  size_t len;
+  char   text[];
+};
+typedef struct __myfs_stats_snapshot_struct_t stats_snapshot_t;
+
+#define MYFS_SNAPSHOT(fi)  ((stats_snapshot_t *) (uintptr_t) ((fi)->fh))
+
+/* Shards
+
+   A mount may spread over several backup-files, given separated by
+   colons. Each one holds a filesystem of its own, with its own
+   superblock, allocator and locks: a shard. The entries of the root
+   directory are spread over the shards by a hash of their name, and
+   everything below an entry lives in the shard of the entry, so an
+   operation on a path only ever touches one shard. Only the root
+   directory itself is found in all of them; operations on it go over
+   all shards, one after the other.
+
+   The hash depends on the number of shards, so the backup-files must
+   always be given in the same order; mounting checks that the
+   entries of every root directory are where they belong.
+*/
+#define MYFS_MAX_SHARDS   16
+#define MYFS_SHARD_SEP    ':'
+#define MYFS_SHARD_SHIFT  48   /* Readdir offsets of the root directory carry the shard up here */
+
+struct __myfs_shard_struct_t {
+  pthread_rwlock_t env_lock;
+  pthread_rwlock_t node_locks[MYFS_LOCK_STRIPES];
+  pthread_mutex_t  alloc_lock;
+  pthread_mutex_t  sync_lock;    /* Held while runs taken off the dirty map are written back */
+  void            *memory;
+  size_t          size;
+  int             backup_fd;
+  fs_handle_t     *fs;
+};
+typedef struct __myfs_shard_struct_t shard_t;
+
 struct __myfs_environment_struct_t {
-  pthread_mutex_t env_lock;
+  shard_t         shards[MYFS_MAX_SHARDS];
+  size_t          num_shards;
   uid_t           uid;
   gid_t           gid;
-  void            *memory;
-  size_t          size;
   int             using_backup;
-  int             backup_fd;
+  int             zerocopy;
+  struct __myfs_stats_struct_t stats;
+  pthread_t       compact_thread;
+  pthread_mutex_t compact_lock;
+  pthread_cond_t  compact_cond;
+  unsigned int    compact_interval;
+  int             compact_started;
+  int             compact_requested;
+  int             compact_stop;
+  pthread_t       writeback_thread;
+  pthread_mutex_t writeback_lock;
+  pthread_cond_t  writeback_cond;
+  unsigned int    writeback_interval;
+  uint64_t        writeback_dirty;      /* Bytes written since the last writeback */
+  uint64_t        writeback_threshold;
+  int             writeback_started;
+  int             writeback_requested;
+  int             writeback_stop;
 };
 
+#define MYFS_SHARD(env, ls)  (&((env)->shards[(ls)->shard]))
+
 #define MYFS_DEFAULT_SIZE  ((size_t) (128 << 20))   /* 128MB */
-#define MYFS_MIN_SIZE      ((size_t) (2048))        /* 2kB */
+#define MYFS_MIN_SIZE      ((size_t) (32768))       /* 32kB, see MIN_FS_SIZE */
+#define MYFS_ZEROCOPY_MIN  ((size_t) (32768))       /* 32kB, smaller reads are copied */
+#define MYFS_READAHEAD_MIN ((size_t) (131072))      /* 128kB, larger reads prefetch the next range */
+#define MYFS_COMPACT_INTERVAL  10u                   /* Seconds between looks at the fragmentation */
+#define MYFS_COMPACT_THRESHOLD 500u                  /* Fragmentation in permille that starts a run */
+#define MYFS_COMPACT_BUDGET    ((size_t) (1 << 20))  /* 1MB moved per step, with the shard locked */
+#define MYFS_COMPACT_COMMAND   "compact"             /* Written to MYFS_STATS_PATH, runs compaction now */
+#define MYFS_WRITEBACK_INTERVAL 5u                    /* Seconds between writebacks of a backup-file */
+#define MYFS_WRITEBACK_DIRTY   ((size_t) (32 << 20)) /* 32MB written start a writeback early */
+#define MYFS_SNAPSHOT_COMMAND  "snapshot "           /* Followed by the files to clone the backup-files to */
+#define MYFS_COMMAND_MAX       ((size_t) 4096)       /* Longest command MYFS_STATS_PATH takes */
+
+#ifndef FICLONE
+#define FICLONE                _IOW(0x94, 9, int)
+#endif
+
+static int __myfs_init_locks(shard_t *shard) {
+  size_t i, j;
+
+  if (pthread_rwlock_init(&(shard->env_lock), NULL) != 0) return 0;
+  for (i=0;i<MYFS_LOCK_STRIPES;i++) {
+    if (pthread_rwlock_init(&(shard->node_locks[i]), NULL) != 0) {
+      for (j=0;j<i;j++) {
+        pthread_rwlock_destroy(&(shard->node_locks[j]));
+      }
+      pthread_rwlock_destroy(&(shard->env_lock));
+      return 0;
+    }
+  }
+  if (pthread_mutex_init(&(shard->alloc_lock), NULL) != 0) {
+    for (i=0;i<MYFS_LOCK_STRIPES;i++) {
+      pthread_rwlock_destroy(&(shard->node_locks[i]));
+    }
+    pthread_rwlock_destroy(&(shard->env_lock));
+    return 0;
+  }
+  if (pthread_mutex_init(&(shard->sync_lock), NULL) != 0) {
+    pthread_mutex_destroy(&(shard->alloc_lock));
+    for (i=0;i<MYFS_LOCK_STRIPES;i++) {
+      pthread_rwlock_destroy(&(shard->node_locks[i]));
+    }
+    pthread_rwlock_destroy(&(shard->env_lock));
+    return 0;
+  }
+  return 1;
+}
+
+static void __myfs_destroy_locks(shard_t *shard) {
+  size_t i;
+  int failed;
+
+  failed = 0;
+  if (pthread_mutex_destroy(&(shard->sync_lock)) != 0) failed = 1;
+  if (pthread_mutex_destroy(&(shard->alloc_lock)) != 0) failed = 1;
+  for (i=0;i<MYFS_LOCK_STRIPES;i++) {
+    if (pthread_rwlock_destroy(&(shard->node_locks[i])) != 0) failed = 1;
+  }
+  if (pthread_rwlock_destroy(&(shard->env_lock)) != 0) failed = 1;
+  if (failed) {
+    perror("Cannot destroy locks");
+  }
+}
 
 static int __myfs_parse_size(size_t *size, const char *str) {
   unsigned long long int tmp, t;
@@ -106,14 +378,361 @@ static int __myfs_parse_size(size_t *size, const char *str) {
   return 1;
 }
 
-static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, struct __myfs_options_struct_t *opts) {
-  int size_specified, using_backup;
-  size_t size;
+/* Placement of the image in memory
+
+   --hugepages backs an image without backup-file with pages from the
+   huge page pool (MAP_HUGETLB); when the pool cannot serve it, and
+   for a backup-file, it asks for transparent huge pages instead.
+   --numa-node=<n> binds the image to node n, --numa-node=all
+   interleaves it over all the nodes we may use. The page cache
+   holding a backup-file is not allocated through the mapping, so the
+   policy is then set for the whole process too, before FUSE starts
+   its threads. --populate faults the whole image in at mount time,
+   once the policy is in place.
+*/
+#define MYFS_HUGE_PAGE_SIZE  ((size_t) (2 << 20))   /* 2MB, the size the pool is rounded to */
+#define MYFS_NUMA_NONE       (-2)
+#define MYFS_NUMA_ALL        (-1)
+#define MYFS_NUMA_MAX_NODES  1024
+
+#ifndef MPOL_BIND
+#define MPOL_BIND            2
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE      3
+#endif
+#ifndef MPOL_F_MEMS_ALLOWED
+#define MPOL_F_MEMS_ALLOWED  (1 << 2)
+#endif
+
+static int __myfs_parse_numa_node(int *node, const char *str) {
+  unsigned long int tmp;
+  char *end;
+
+  if (strcmp(str, "all") == 0) {
+    *node = MYFS_NUMA_ALL;
+    return 1;
+  }
+  if (*str == '\0') return 0;
+  tmp = strtoul(str, &end, 10);
+  if (*end != '\0') return 0;
+  if (tmp >= ((unsigned long int) MYFS_NUMA_MAX_NODES)) return 0;
+  *node = (int) tmp;
+  return 1;
+}
+
+/* Puts the pages of the mapping on node, or on all allowed nodes in
+   turn; the system calls are used directly so that we do not depend
+   on libnuma */
+static int __myfs_bind_memory(void *memory, size_t size, int node, int using_backup) {
+  unsigned long int mask[MYFS_NUMA_MAX_NODES / (8 * sizeof(unsigned long int))];
+  unsigned long int maxnode;
+  int mode;
+
+  memset(mask, 0, sizeof(mask));
+  maxnode = ((unsigned long int) MYFS_NUMA_MAX_NODES) + 1ul;
+  if (node == MYFS_NUMA_ALL) {
+    mode = MPOL_INTERLEAVE;
+    if (syscall(SYS_get_mempolicy, NULL, mask, maxnode, NULL, (unsigned long int) MPOL_F_MEMS_ALLOWED) != 0) {
+      return 0;
+    }
+  } else {
+    mode = MPOL_BIND;
+    mask[((size_t) node) / (8 * sizeof(unsigned long int))] |= 1ul << (((size_t) node) % (8 * sizeof(unsigned long int)));
+  }
+  if (syscall(SYS_mbind, memory, size, (unsigned long int) mode, mask, maxnode, 0ul) != 0) {
+    return 0;
+  }
+  if (using_backup) {
+    if (syscall(SYS_set_mempolicy, mode, mask, maxnode) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void __myfs_clear_shard(shard_t *shard, int using_backup) {
+  if (using_backup) {
+    if (msync(shard->memory, shard->size, MS_SYNC) != 0) {
+      perror("Cannot synchronize memory map with backup-file");
+    }
+  }
+  if (munmap(shard->memory, shard->size) != 0) {
+    perror("Cannot unmap memory");
+  }
+  if (using_backup) {
+    if (close(shard->backup_fd) != 0) {
+      perror("Cannot close backup-file");
+    }
+  }
+  fs_handle_destroy(shard->fs);
+  __myfs_destroy_locks(shard);
+}
+
+static void __myfs_clear_environment(struct __myfs_environment_struct_t *env) {
+  size_t i;
+
+  for (i=((size_t) 0);i<env->num_shards;i++) {
+    __myfs_clear_shard(&(env->shards[i]), env->using_backup);
+  }
+}
+
+/* Finds the shard of the root directory entry a path starts with;
+   the root directory itself is taken from the first shard */
+static size_t __myfs_shard_of_name(struct __myfs_environment_struct_t *env, const char *name, size_t len) {
+  uint64_t h;
+  size_t i;
+
+  if ((env->num_shards <= ((size_t) 1)) || (len == ((size_t) 0))) return (size_t) 0;
+
+  /* FNV-1a over the name */
+  h = (uint64_t) 14695981039346656037ull;
+  for (i=0;i<len;i++) {
+    h ^= (uint64_t) ((unsigned char) name[i]);
+    h *= (uint64_t) 1099511628211ull;
+  }
+  return (size_t) (h % ((uint64_t) env->num_shards));
+}
+
+static size_t __myfs_shard_of(struct __myfs_environment_struct_t *env, const char *path) {
+  size_t len;
+
+  while (*path == '/') path++;
+  for (len=((size_t) 0);(path[len] != '\0') && (path[len] != '/');len++);
+  return __myfs_shard_of_name(env, path, len);
+}
+
+/* Paths naming the root directory go to all shards */
+static int __myfs_is_root(const char *path) {
+  while (*path == '/') path++;
+  return *path == '\0';
+}
+
+struct __myfs_shard_check_struct_t {
+  struct __myfs_environment_struct_t *env;
+  size_t shard;
+  int misplaced;
+};
+
+static int __myfs_check_entry(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+  struct __myfs_shard_check_struct_t *check;
+
+  (void) stbuf;
+  check = (struct __myfs_shard_check_struct_t *) buf;
+  if (off <= ((off_t) 2)) return 0;
+  if (__myfs_shard_of_name(check->env, name, strlen(name)) != check->shard) {
+    check->misplaced = 1;
+    return 1;
+  }
+  return 0;
+}
+
+/* Makes sure every root directory entry is in the shard it is looked
+   for in, that is, that the backup-files are given as before */
+static int __myfs_check_shards(struct __myfs_environment_struct_t *env) {
+  struct __myfs_shard_check_struct_t check;
+  int __myfs_errno;
+
+  if (env->num_shards <= ((size_t) 1)) return 1;
+  check.env = env;
+  check.misplaced = 0;
+  for (check.shard=((size_t) 0);check.shard<env->num_shards;check.shard++) {
+    if (__myfs_readdir_fill_implem(env->shards[check.shard].fs, &__myfs_errno,
+                                   (uid_t) 0, (gid_t) 0, "/", (off_t) 0,
+                                   &check, __myfs_check_entry) < 0) {
+      fprintf(stderr, "Cannot list root directory: %s\n", strerror(__myfs_errno));
+      return 0;
+    }
+    if (check.misplaced) {
+      fprintf(stderr, "Cannot mount backup-files: they are not given in the same number and order as before\n");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Sets up the shard kept in filename, or in memory only if filename is NULL */
+static int __myfs_setup_shard(shard_t *shard, const char *filename, size_t size, int size_specified,
+                              size_t block_size, int numa_node, struct __myfs_options_struct_t *opts) {
+  int using_backup, fs_errno, map_flags;
+  fs_handle_t *fs;
   int fd;
   void *memory;
   off_t off;
   size_t len;
-  size_t orig_size;
+
+  /* Setup locks for the threads */
+  if (!__myfs_init_locks(shard)) {
+    perror("Cannot setup locks");
+    return 0;    
+  }
+  
+  /* Handle backup file */
+  if (filename != NULL) {
+    using_backup = 1;
+    fd = open(filename, O_CREAT | O_RDWR, 00644);
+    if (fd < 0) {
+      perror("Cannot open backup-file");
+      __myfs_destroy_locks(shard);
+      return 0;
+    }
+    off = lseek(fd, 0, SEEK_END);
+    if (off < ((off_t) 0)) {
+      perror("Cannot seek in backup-file");
+      __myfs_destroy_locks(shard);
+      return 0;
+    }
+    len = (size_t) off;
+    off = lseek(fd, 0, SEEK_SET);
+    if (off < ((off_t) 0)) {
+      perror("Cannot seek in backup-file");
+      __myfs_destroy_locks(shard);
+      return 0;
+    }
+    if (size_specified) {
+      if (len > size) {
+        size = len;
+      }
+    } else {
+      if (!(len == ((size_t) 0))) {
+        size = len;
+        if (size < MYFS_MIN_SIZE) {
+          size = MYFS_MIN_SIZE;
+        }
+      } 
+    }
+    if (ftruncate(fd, size) != 0) {
+      perror("Cannot seek in backup-file");
+      __myfs_destroy_locks(shard);
+      return 0;
+    }
+  } else {
+    using_backup = 0;
+    fd = -1;
+  }
+
+  /* Do the mmap; with a NUMA policy to apply, the image is only
+     populated once it is in place */
+  map_flags = 0;
+  if (opts->populate && (numa_node == MYFS_NUMA_NONE)) {
+    map_flags |= MAP_POPULATE;
+  }
+  memory = MAP_FAILED;
+  if (using_backup) {
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | map_flags, fd, 0);
+    if (memory == MAP_FAILED) {
+      perror("Cannot map backup-file into memory");
+      if (close(fd) != 0) {
+        perror("Cannot close backup-file");
+      }
+      __myfs_destroy_locks(shard);
+      return 0;
+    }
+  } else {
+    if (opts->hugepages) {
+      size = (size + MYFS_HUGE_PAGE_SIZE - ((size_t) 1)) & ~(MYFS_HUGE_PAGE_SIZE - ((size_t) 1));
+      memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | map_flags, -1, 0);
+      if (memory == MAP_FAILED) {
+        perror("Cannot map in huge pages, trying transparent huge pages");
+      }
+    }
+    if (memory == MAP_FAILED) {
+      memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | map_flags, -1, 0);
+      if (memory == MAP_FAILED) {
+        perror("Cannot map in memory");
+        __myfs_destroy_locks(shard);
+        return 0;
+      }
+      if (opts->hugepages) {
+        if (madvise(memory, size, MADV_HUGEPAGE) != 0) {
+          perror("Cannot use transparent huge pages");
+        }
+      }
+    }
+  }
+  if (using_backup && opts->hugepages) {
+    if (madvise(memory, size, MADV_HUGEPAGE) != 0) {
+      perror("Cannot use transparent huge pages for backup-file");
+    }
+  }
+
+  /* Place and populate the image */
+  if (numa_node != MYFS_NUMA_NONE) {
+    if (!__myfs_bind_memory(memory, size, numa_node, using_backup)) {
+      perror("Cannot bind memory to NUMA node");
+      if (munmap(memory, size) != 0) {
+        perror("Cannot unmap memory");
+      }
+      if (using_backup) {
+        if (close(fd) != 0) {
+          perror("Cannot close backup-file");
+        }
+      }
+      __myfs_destroy_locks(shard);
+      return 0;
+    }
+    if (opts->populate) {
+#if defined(MADV_POPULATE_READ) && defined(MADV_POPULATE_WRITE)
+      /* Write faults on the backup-file would make every page dirty */
+      if (madvise(memory, size, using_backup ? MADV_POPULATE_READ : MADV_POPULATE_WRITE) != 0) {
+        perror("Cannot populate memory");
+      }
+#else
+      fprintf(stderr, "Cannot populate memory: unsupported together with a NUMA node\n");
+#endif
+    }
+  }
+
+  /* Mount the filesystem and build its handle before any request
+     comes in: a fresh filesystem gets initialized, what an operation
+     cut short by a crash left half done gets undone, and the
+     filesystem grows into a backup-file that got larger.
+     Doing it here rather than in init lets a failure stop the mount
+     with a message instead of leaving a dead mount-point.
+  */
+  fs = fs_handle_create(memory, size, block_size, &fs_errno);
+  if (fs == NULL) {
+    switch (fs_errno) {
+    case EINVAL:
+      fprintf(stderr, "Cannot setup filesystem: unsupported block size\n");
+      break;
+    case EPROTONOSUPPORT:
+      fprintf(stderr, "Cannot mount backup-file: unsupported on-image format version\n");
+      break;
+    case EUCLEAN:
+      fprintf(stderr, "Cannot mount backup-file: the journal is damaged or too small, or the old image to migrate is damaged\n");
+      break;
+    case ENOSPC:
+      fprintf(stderr, "Cannot migrate or grow backup-file: the filesystem is too full\n");
+      break;
+    default:
+      fprintf(stderr, "Cannot setup filesystem handle: %s\n", strerror(fs_errno));
+      break;
+    }
+    if (munmap(memory, size) != 0) {
+      perror("Cannot unmap memory");
+    }
+    if (using_backup) {
+      if (close(fd) != 0) {
+        perror("Cannot close backup-file");
+      }
+    }
+    __myfs_destroy_locks(shard);
+    return 0;
+  }
+
+  /* Write back and succeed */
+  shard->memory = memory;
+  shard->size = size;
+  shard->backup_fd = fd;
+  shard->fs = fs;
+  return 1;
+}
+
+static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, struct __myfs_options_struct_t *opts) {
+  int size_specified, numa_node, failed;
+  char *filenames, *filename, *next;
+  size_t size, block_size, interval, writeback_interval, writeback_dirty, i;
 
   /* Handle size */
   if (opts->size != NULL) {
@@ -135,154 +754,895 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     size = MYFS_MIN_SIZE;
   }
 
-  /* Setup lock for the threads */
-  if (pthread_mutex_init(&(env->env_lock), NULL) != 0) {
-    perror("Cannot setup mutex");
-    return 0;    
+  /* Handle block size, 0 leaves the default to the implementation */
+  block_size = (size_t) 0;
+  if (opts->block_size != NULL) {
+    if ((!__myfs_parse_size(&block_size, opts->block_size)) || (block_size == ((size_t) 0))) {
+      fprintf(stderr, "Cannot parse block size indication\n");
+      return 0;
+    }
   }
-  
-  /* Handle backup file */
-  if (opts->filename != NULL) {
-    using_backup = 1;
-    fd = open(opts->filename, O_CREAT | O_RDWR, 00644);
-    if (fd < 0) {
-      perror("Cannot open backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
+
+  /* Handle NUMA node */
+  numa_node = MYFS_NUMA_NONE;
+  if (opts->numa_node != NULL) {
+    if (!__myfs_parse_numa_node(&numa_node, opts->numa_node)) {
+      fprintf(stderr, "Cannot parse NUMA node indication\n");
       return 0;
     }
-    off = lseek(fd, 0, SEEK_END);
-    if (off < ((off_t) 0)) {
-      perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
+  }
+
+  /* Handle compaction interval, 0 compacts on request only */
+  interval = (size_t) MYFS_COMPACT_INTERVAL;
+  if (opts->compact_interval != NULL) {
+    if ((!__myfs_parse_size(&interval, opts->compact_interval)) ||
+        (interval > ((size_t) ((unsigned int) -1)))) {
+      fprintf(stderr, "Cannot parse compaction interval indication\n");
       return 0;
     }
-    len = (size_t) off;
-    orig_size = len;
-    off = lseek(fd, 0, SEEK_SET);
-    if (off < ((off_t) 0)) {
-      perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
+  }
+
+  /* Handle writeback interval and threshold, 0 turns either off */
+  writeback_interval = (size_t) MYFS_WRITEBACK_INTERVAL;
+  if (opts->writeback_interval != NULL) {
+    if ((!__myfs_parse_size(&writeback_interval, opts->writeback_interval)) ||
+        (writeback_interval > ((size_t) ((unsigned int) -1)))) {
+      fprintf(stderr, "Cannot parse writeback interval indication\n");
       return 0;
     }
-    if (size_specified) {
-      if (len > size) {
-        size = len;
+  }
+  writeback_dirty = MYFS_WRITEBACK_DIRTY;
+  if (opts->writeback_dirty != NULL) {
+    if (!__myfs_parse_size(&writeback_dirty, opts->writeback_dirty)) {
+      fprintf(stderr, "Cannot parse writeback threshold indication\n");
+      return 0;
+    }
+  }
+
+  /* Handle backup-files: one shard each */
+  filenames = NULL;
+  if (opts->filename != NULL) {
+    filenames = strdup(opts->filename);
+    if (filenames == NULL) {
+      perror("Cannot setup backup-files");
+      return 0;
+    }
+  }
+  env->num_shards = (size_t) 0;
+  failed = 0;
+  filename = filenames;
+  do {
+    next = NULL;
+    if (filename != NULL) {
+      next = strchr(filename, MYFS_SHARD_SEP);
+      if (next != NULL) *(next++) = '\0';
+    }
+    if (env->num_shards >= ((size_t) MYFS_MAX_SHARDS)) {
+      fprintf(stderr, "Cannot use more than %d backup-files\n", MYFS_MAX_SHARDS);
+      failed = 1;
+      break;
+    }
+    if (!__myfs_setup_shard(&(env->shards[env->num_shards]), filename,
+                            size, size_specified, block_size, numa_node, opts)) {
+      failed = 1;
+      break;
+    }
+    env->num_shards++;
+    filename = next;
+  } while (filename != NULL);
+  free(filenames);
+  if (failed || !__myfs_check_shards(env)) {
+    for (i=((size_t) 0);i<env->num_shards;i++) {
+      __myfs_clear_shard(&(env->shards[i]), opts->filename != NULL);
+    }
+    return 0;
+  }
+
+  /* Get uid and gid, write back and succeed */
+  env->uid = getuid();
+  env->gid = getgid();
+  env->using_backup = (opts->filename != NULL);
+  env->zerocopy = env->using_backup && opts->zerocopy;
+  memset(&(env->stats), 0, sizeof(env->stats));
+  env->compact_interval = (unsigned int) interval;
+  env->compact_started = 0;
+  env->compact_requested = 0;
+  env->compact_stop = 0;
+  env->writeback_interval = (unsigned int) writeback_interval;
+  env->writeback_dirty = (uint64_t) 0;
+  env->writeback_threshold = (uint64_t) writeback_dirty;
+  env->writeback_started = 0;
+  env->writeback_requested = 0;
+  env->writeback_stop = 0;
+  return 1;
+}
+
+static int __myfs_sync_shard(struct __myfs_environment_struct_t *env, shard_t *shard) {
+  if (env == NULL) return -1;
+  if (!(env->using_backup)) return 0;
+  if (msync(shard->memory, shard->size, MS_SYNC) != 0) return -1;
+  if (fsync(shard->backup_fd) != 0) return -1;
+  return 0;
+}
+
+/* Writes back the given (image offset, length) runs of the mapping;
+   msync on a range of a shared file mapping writes back just the
+   pages of the range and syncs them to the device.
+*/
+static int __myfs_sync_ranges(shard_t *shard,
+                              const size_t *ranges, size_t count) {
+  size_t page, i, start;
+
+  page = (size_t) sysconf(_SC_PAGESIZE);
+  for (i=((size_t) 0);i<count;i++) {
+    start = ranges[2 * i] & ~(page - ((size_t) 1));
+    if (msync(((void *) shard->memory) + start,
+              ranges[2 * i] + ranges[2 * i + 1] - start, MS_SYNC) != 0) return -1;
+  }
+  return 0;
+}
+
+#ifndef SYNC_FILE_RANGE_WRITE
+#define SYNC_FILE_RANGE_WRITE  2
+#endif
+
+/* Starts writing back the given runs of a backup-file, without waiting
+   for any of it; sync_file_range only lets the writes go, msync after
+   it then waits for them all at once. The image starts at offset 0 of
+   the backup-file. Failures are left to the msync to report.
+*/
+static void __myfs_start_ranges(shard_t *shard,
+                                const size_t *ranges, size_t count) {
+  size_t i;
+
+  for (i=((size_t) 0);i<count;i++) {
+    syscall(SYS_sync_file_range, shard->backup_fd, (off_t) ranges[2 * i], (off_t) ranges[2 * i + 1],
+            (unsigned int) SYNC_FILE_RANGE_WRITE);
+  }
+}
+
+/* Asks the kernel to read ahead the runs of the mapping a read is
+   about to need; the runs with image offset 0 are holes */
+static void __myfs_advise_ranges(shard_t *shard,
+                                 const size_t *ranges, size_t count) {
+  size_t page, i, start;
+
+  page = (size_t) sysconf(_SC_PAGESIZE);
+  for (i=((size_t) 0);i<count;i++) {
+    if (ranges[2 * i] == ((size_t) 0)) continue;
+    start = ranges[2 * i] & ~(page - ((size_t) 1));
+    madvise(((void *) shard->memory) + start,
+            ranges[2 * i] + ranges[2 * i + 1] - start, MADV_WILLNEED);
+  }
+}
+
+/* Statistics handling */
+
+static uint64_t __myfs_stats_now(void) {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) return (uint64_t) 0;
+  return ((uint64_t) ts.tv_sec) * ((uint64_t) 1000000000) + ((uint64_t) ts.tv_nsec);
+}
+
+/* Files an operation that started at start and returns its result res */
+static int __myfs_stats_record(struct __myfs_environment_struct_t *env, int op, uint64_t start, int res) {
+  struct __myfs_op_stats_struct_t *stats;
+  uint64_t ns;
+  int bucket;
+
+  stats = &(env->stats.ops[op]);
+  ns = __myfs_stats_now() - start;
+  bucket = (ns == ((uint64_t) 0)) ? 0 : (63 - __builtin_clzll(ns));
+  if (bucket >= MYFS_STATS_BUCKETS) bucket = MYFS_STATS_BUCKETS - 1;
+  __atomic_fetch_add(&(stats->calls), (uint64_t) 1, __ATOMIC_RELAXED);
+  if (res < 0) __atomic_fetch_add(&(stats->errors), (uint64_t) 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(stats->total_ns), ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(stats->buckets[bucket]), (uint64_t) 1, __ATOMIC_RELAXED);
+  return res;
+}
+
+static int __myfs_is_stats_path(const char *path) {
+  return strcmp(path, MYFS_STATS_PATH) == 0;
+}
+
+/* Prints the counters of the wrappers; one line per operation, the
+   histogram as bucket:count pairs for the non-empty buckets */
+static size_t __myfs_stats_print(struct __myfs_environment_struct_t *env, char *buf, size_t size) {
+  struct __myfs_op_stats_struct_t *stats;
+  size_t len;
+  uint64_t n;
+  int op, i;
+
+  len = (size_t) 0;
+/* Once only the terminator fits, the text is cut off there */
+#define MYFS_STATS_APPEND(...)                                          \
+  do {                                                                  \
+    size_t __room = size - len;                                         \
+    if (__room > ((size_t) 1)) {                                        \
+      int __r = snprintf(buf + len, __room, __VA_ARGS__);               \
+      if (__r > 0) len += ((size_t) __r) < __room ? ((size_t) __r) : __room - ((size_t) 1); \
+    }                                                                   \
+  } while (0)
+  MYFS_STATS_APPEND("lock_acquires %llu\nlock_wait_ns %llu\n",
+                    (unsigned long long) __atomic_load_n(&(env->stats.lock_acquires), __ATOMIC_RELAXED),
+                    (unsigned long long) __atomic_load_n(&(env->stats.lock_wait_ns), __ATOMIC_RELAXED));
+  MYFS_STATS_APPEND("writeback_runs %llu\nwriteback_bytes %llu\nwriteback_ns %llu\n",
+                    (unsigned long long) __atomic_load_n(&(env->stats.writeback_runs), __ATOMIC_RELAXED),
+                    (unsigned long long) __atomic_load_n(&(env->stats.writeback_bytes), __ATOMIC_RELAXED),
+                    (unsigned long long) __atomic_load_n(&(env->stats.writeback_ns), __ATOMIC_RELAXED));
+  MYFS_STATS_APPEND("snapshots %llu\nsnapshot_pause_ns %llu\n",
+                    (unsigned long long) __atomic_load_n(&(env->stats.snapshots), __ATOMIC_RELAXED),
+                    (unsigned long long) __atomic_load_n(&(env->stats.snapshot_pause_ns), __ATOMIC_RELAXED));
+  for (op=0;op<MYFS_OP_COUNT;op++) {
+    stats = &(env->stats.ops[op]);
+    MYFS_STATS_APPEND("op %s calls %llu errors %llu total_ns %llu latency_log2_ns",
+                      __myfs_op_names[op],
+                      (unsigned long long) __atomic_load_n(&(stats->calls), __ATOMIC_RELAXED),
+                      (unsigned long long) __atomic_load_n(&(stats->errors), __ATOMIC_RELAXED),
+                      (unsigned long long) __atomic_load_n(&(stats->total_ns), __ATOMIC_RELAXED));
+    for (i=0;i<MYFS_STATS_BUCKETS;i++) {
+      n = __atomic_load_n(&(stats->buckets[i]), __ATOMIC_RELAXED);
+      if (n != ((uint64_t) 0)) MYFS_STATS_APPEND(" %d:%llu", i, (unsigned long long) n);
+    }
+    MYFS_STATS_APPEND("\n");
+  }
+#undef MYFS_STATS_APPEND
+  return len;
+}
+
+static int __myfs_stats_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset) {
+  stats_snapshot_t *snapshot;
+
+  snapshot = MYFS_SNAPSHOT(fi);
+  if ((snapshot == NULL) || (offset < ((off_t) 0))) return -EINVAL;
+  if (((size_t) offset) >= snapshot->len) return 0;
+  if (size > snapshot->len - ((size_t) offset)) size = snapshot->len - ((size_t) offset);
+  memcpy(buf, snapshot->text + offset, size);
+  return (int) size;
+}
+
+/* End of statistics handling */
+
+/* Lock set handling */
+
+static void __myfs_lockset_init(lockset_t *ls) {
+  memset(ls, 0, sizeof(lockset_t));
+  ls->global = MYFS_LOCK_SHARED;
+}
+
+static void __myfs_lockset_mark(lockset_t *ls, const char *path, size_t len, unsigned char mode) {
+  uint64_t h;
+  size_t i, stripe;
+
+  /* FNV-1a over the path prefix */
+  h = (uint64_t) 14695981039346656037ull;
+  for (i=0;i<len;i++) {
+    h ^= (uint64_t) ((unsigned char) path[i]);
+    h *= (uint64_t) 1099511628211ull;
+  }
+  stripe = (size_t) (h % ((uint64_t) MYFS_LOCK_STRIPES));
+  if (ls->stripes[stripe] < mode) ls->stripes[stripe] = mode;
+}
+
+/* Marks all proper ancestors of path in shared mode, the parent of
+   path in parent_mode and path itself in target_mode. MYFS_LOCK_NONE
+   leaves the parent resp. the target as an ordinary ancestor. The
+   lock set goes to the shard of path.
+*/
+static void __myfs_lockset_add(struct __myfs_environment_struct_t *env, lockset_t *ls, const char *path,
+                               unsigned char parent_mode, unsigned char target_mode) {
+  size_t len, last, i;
+
+  ls->shard = __myfs_shard_of(env, path);
+  len = strlen(path);
+  while ((len > ((size_t) 1)) && (path[len - ((size_t) 1)] == '/')) len--;
+
+  /* The root directory has no parent */
+  if (len <= ((size_t) 1)) {
+    __myfs_lockset_mark(ls, "/", (size_t) 1, 
+                        (target_mode == MYFS_LOCK_NONE) ? MYFS_LOCK_SHARED : target_mode);
+    return;
+  }
+
+  /* Find the slash in front of the last component */
+  for (last=len - ((size_t) 1);(last > ((size_t) 0)) && (path[last] != '/');last--);
+
+  for (i=0;i<last;i++) {
+    if (path[i] == '/') {
+      __myfs_lockset_mark(ls, path, (i == ((size_t) 0)) ? ((size_t) 1) : i, MYFS_LOCK_SHARED);
+    }
+  }
+  __myfs_lockset_mark(ls, path, (last == ((size_t) 0)) ? ((size_t) 1) : last,
+                      (parent_mode == MYFS_LOCK_NONE) ? MYFS_LOCK_SHARED : parent_mode);
+  if (target_mode != MYFS_LOCK_NONE) {
+    __myfs_lockset_mark(ls, path, len, target_mode);
+  }
+}
+
+static void __myfs_lockset_acquire(struct __myfs_environment_struct_t *env, lockset_t *ls) {
+  shard_t *shard;
+  uint64_t start;
+  size_t i;
+
+  shard = MYFS_SHARD(env, ls);
+  start = __myfs_stats_now();
+  if (ls->global == MYFS_LOCK_EXCLUSIVE) {
+    pthread_rwlock_wrlock(&(shard->env_lock));
+  } else {
+    pthread_rwlock_rdlock(&(shard->env_lock));
+  }
+  for (i=0;i<MYFS_LOCK_STRIPES;i++) {
+    if (ls->stripes[i] == MYFS_LOCK_SHARED) {
+      pthread_rwlock_rdlock(&(shard->node_locks[i]));
+    } else if (ls->stripes[i] == MYFS_LOCK_EXCLUSIVE) {
+      pthread_rwlock_wrlock(&(shard->node_locks[i]));
+    }
+  }
+  if (ls->alloc) {
+    pthread_mutex_lock(&(shard->alloc_lock));
+  }
+  __atomic_fetch_add(&(env->stats.lock_acquires), (uint64_t) 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(env->stats.lock_wait_ns), __myfs_stats_now() - start, __ATOMIC_RELAXED);
+}
+
+static void __myfs_lockset_release(struct __myfs_environment_struct_t *env, lockset_t *ls) {
+  shard_t *shard;
+  size_t i;
+
+  shard = MYFS_SHARD(env, ls);
+  if (ls->alloc) {
+    pthread_mutex_unlock(&(shard->alloc_lock));
+  }
+  for (i=MYFS_LOCK_STRIPES;i>((size_t) 0);i--) {
+    if (ls->stripes[i - ((size_t) 1)] != MYFS_LOCK_NONE) {
+      pthread_rwlock_unlock(&(shard->node_locks[i - ((size_t) 1)]));
+    }
+  }
+  pthread_rwlock_unlock(&(shard->env_lock));
+}
+
+/* Releases alloc_lock ahead of the rest of the lock set */
+static void __myfs_lockset_drop_alloc(struct __myfs_environment_struct_t *env, lockset_t *ls) {
+  if (ls->alloc) {
+    pthread_mutex_unlock(&(MYFS_SHARD(env, ls)->alloc_lock));
+    ls->alloc = 0;
+  }
+}
+
+/* Takes alloc_lock again on top of the rest of the lock set; it comes
+   last in the order, so this is fine with the stripes held */
+static void __myfs_lockset_take_alloc(struct __myfs_environment_struct_t *env, lockset_t *ls) {
+  uint64_t start;
+
+  if (!(ls->alloc)) {
+    start = __myfs_stats_now();
+    pthread_mutex_lock(&(MYFS_SHARD(env, ls)->alloc_lock));
+    ls->alloc = 1;
+    __atomic_fetch_add(&(env->stats.lock_acquires), (uint64_t) 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(env->stats.lock_wait_ns), __myfs_stats_now() - start, __ATOMIC_RELAXED);
+  }
+}
+
+/* End of lock set handling */
+
+/* Takes the text of the statistics file for the open file fi; the
+   totals of a shard are taken with its allocator lock held, as they
+   change along with the allocator state */
+static int __myfs_stats_open(struct __myfs_environment_struct_t *env, struct fuse_file_info *fi) {
+  stats_snapshot_t *snapshot;
+  lockset_t ls;
+  size_t len, i;
+  int res;
+
+  snapshot = (stats_snapshot_t *) malloc(sizeof(stats_snapshot_t) + MYFS_STATS_MAX);
+  if (snapshot == NULL) return -ENOMEM;
+  len = __myfs_stats_print(env, snapshot->text, MYFS_STATS_MAX);
+  for (i=((size_t) 0);i<env->num_shards;i++) {
+    if (env->num_shards > ((size_t) 1)) {
+      res = snprintf(snapshot->text + len, MYFS_STATS_MAX - len, "shard %zu\n", i);
+      if (res > 0) len += (((size_t) res) < MYFS_STATS_MAX - len) ? ((size_t) res) : (MYFS_STATS_MAX - len - ((size_t) 1));
+    }
+    __myfs_lockset_init(&ls);
+    ls.shard = i;
+    ls.alloc = 1;
+    __myfs_lockset_acquire(env, &ls);
+    res = fs_handle_print_stats(MYFS_SHARD(env, &ls)->fs, snapshot->text + len, MYFS_STATS_MAX - len);
+    __myfs_lockset_release(env, &ls);
+    if (res > 0) len += (((size_t) res) < MYFS_STATS_MAX - len) ? ((size_t) res) : (MYFS_STATS_MAX - len - ((size_t) 1));
+  }
+  snapshot->len = len;
+  fi->fh = (uint64_t) (uintptr_t) snapshot;
+  fi->direct_io = 1;
+  return 0;
+}
+
+/* Compaction
+
+   A thread of its own looks at the fragmentation of the free memory
+   of each shard every --compact-interval seconds, and compacts the
+   shards above MYFS_COMPACT_THRESHOLD; writing MYFS_COMPACT_COMMAND
+   to MYFS_STATS_PATH has it compact all shards right away. A step
+   walks the whole tree of a shard, so it holds the shard exclusively,
+   and it moves at most MYFS_COMPACT_BUDGET bytes so that operations
+   get in between steps. File data stays in place with --zerocopy, as
+   read replies are spliced out of the image after the locks are
+   released.
+*/
+static void __myfs_compact_shard(struct __myfs_environment_struct_t *env, size_t i) {
+  lockset_t ls;
+  size_t moved;
+  int stop;
+
+  do {
+    __myfs_lockset_init(&ls);
+    ls.shard = i;
+    ls.global = MYFS_LOCK_EXCLUSIVE;
+    ls.alloc = 1;
+    __myfs_lockset_acquire(env, &ls);
+    moved = fs_handle_compact(MYFS_SHARD(env, &ls)->fs, MYFS_COMPACT_BUDGET, !(env->zerocopy));
+    __myfs_lockset_release(env, &ls);
+    stop = __atomic_load_n(&(env->compact_stop), __ATOMIC_RELAXED);
+  } while ((moved > ((size_t) 0)) && (!stop));
+}
+
+static unsigned int __myfs_fragmentation(struct __myfs_environment_struct_t *env, size_t i) {
+  unsigned int fragmentation;
+  lockset_t ls;
+
+  __myfs_lockset_init(&ls);
+  ls.shard = i;
+  ls.alloc = 1;
+  __myfs_lockset_acquire(env, &ls);
+  fragmentation = free_fragmentation(MYFS_SHARD(env, &ls)->memory);
+  __myfs_lockset_release(env, &ls);
+  return fragmentation;
+}
+
+static void *__myfs_compact_thread(void *arg) {
+  struct __myfs_environment_struct_t *env;
+  struct timespec deadline;
+  int forced;
+  size_t i;
+
+  env = (struct __myfs_environment_struct_t *) arg;
+  pthread_mutex_lock(&(env->compact_lock));
+  while (!(env->compact_stop)) {
+    if (!(env->compact_requested)) {
+      if (env->compact_interval == 0u) {
+        pthread_cond_wait(&(env->compact_cond), &(env->compact_lock));
+      } else {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t) env->compact_interval;
+        pthread_cond_timedwait(&(env->compact_cond), &(env->compact_lock), &deadline);
       }
-    } else {
-      if (!(len == ((size_t) 0))) {
-        size = len;
-        if (size < MYFS_MIN_SIZE) {
-          size = MYFS_MIN_SIZE;
-        }
-      } 
+      if (env->compact_stop) break;
     }
-    if (ftruncate(fd, size) != 0) {
-      perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+    forced = env->compact_requested;
+    env->compact_requested = 0;
+    pthread_mutex_unlock(&(env->compact_lock));
+    for (i=((size_t) 0);i<env->num_shards;i++) {
+      if (__atomic_load_n(&(env->compact_stop), __ATOMIC_RELAXED)) break;
+      if (forced || (__myfs_fragmentation(env, i) >= MYFS_COMPACT_THRESHOLD)) {
+        __myfs_compact_shard(env, i);
       }
-      return 0;
     }
-  } else {
-    using_backup = 0;
-    fd = -1;
-    orig_size = 0;
+    pthread_mutex_lock(&(env->compact_lock));
   }
+  pthread_mutex_unlock(&(env->compact_lock));
+  return NULL;
+}
 
-  /* Do the mmap */
-  if (using_backup) {
-    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (memory == MAP_FAILED) {
-      perror("Cannot map backup-file into memory");
-      if (close(fd) != 0) {
-        perror("Cannot close backup-file");
-      }
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+/* Has the compaction thread run over all shards now */
+static int __myfs_compact_request(struct __myfs_environment_struct_t *env) {
+  if (!(env->compact_started)) return -EAGAIN;
+  pthread_mutex_lock(&(env->compact_lock));
+  env->compact_requested = 1;
+  pthread_cond_signal(&(env->compact_cond));
+  pthread_mutex_unlock(&(env->compact_lock));
+  return 0;
+}
+
+static void __myfs_compact_start(struct __myfs_environment_struct_t *env) {
+  if (pthread_mutex_init(&(env->compact_lock), NULL) != 0) {
+    perror("Cannot start compaction");
+    return;
+  }
+  if (pthread_cond_init(&(env->compact_cond), NULL) != 0) {
+    perror("Cannot start compaction");
+    pthread_mutex_destroy(&(env->compact_lock));
+    return;
+  }
+  if (pthread_create(&(env->compact_thread), NULL, __myfs_compact_thread, env) != 0) {
+    perror("Cannot start compaction");
+    pthread_cond_destroy(&(env->compact_cond));
+    pthread_mutex_destroy(&(env->compact_lock));
+    return;
+  }
+  env->compact_started = 1;
+}
+
+static void __myfs_compact_stop(struct __myfs_environment_struct_t *env) {
+  if (!(env->compact_started)) return;
+  pthread_mutex_lock(&(env->compact_lock));
+  __atomic_store_n(&(env->compact_stop), 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&(env->compact_cond));
+  pthread_mutex_unlock(&(env->compact_lock));
+  pthread_join(env->compact_thread, NULL);
+  pthread_cond_destroy(&(env->compact_cond));
+  pthread_mutex_destroy(&(env->compact_lock));
+  env->compact_started = 0;
+}
+
+/* Writeback
+
+   With a backup-file, a thread of its own writes the changed pages of
+   each shard back every --writeback-interval seconds, or as soon as
+   --writeback-dirty bytes have been written since the last time,
+   which bounds how much a crash can lose. The pages are taken off
+   the dirty map with the shard held shared, one word of the map at a
+   time, so operations go on during the scan. They may have marked
+   pages they have yet to change, so taking the shard exclusively and
+   letting it go right away waits for the ones that ran during the
+   scan before any page is written. The writes are started all at once
+   and waited for with no lock of the shard held. The
+   sync lock of the shard is held from taking the pages up to the end
+   of their writeback; fsync takes it before writing back its own, so
+   it cannot return while pages taken here are not on disk yet.
+*/
+static int __myfs_writeback_shard(struct __myfs_environment_struct_t *env, size_t i) {
+  int __myfs_errno, res;
+  uint64_t start, bytes;
+  size_t *ranges;
+  size_t count, j;
+  shard_t *shard;
+  lockset_t ls;
+
+  start = __myfs_stats_now();
+  shard = &(env->shards[i]);
+  pthread_mutex_lock(&(shard->sync_lock));
+  __myfs_errno = EIO;
+  ranges = NULL;
+  count = (size_t) 0;
+  __myfs_lockset_init(&ls);
+  ls.shard = i;
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_fsync_implem(shard->fs, &__myfs_errno, "/", NULL, 0, &ranges, &count);
+  __myfs_lockset_release(env, &ls);
+  ls.global = MYFS_LOCK_EXCLUSIVE;
+  __myfs_lockset_acquire(env, &ls);
+  __myfs_lockset_release(env, &ls);
+  bytes = (uint64_t) 0;
+  if (res >= 0) {
+    for (j=((size_t) 0);j<count;j++) bytes += (uint64_t) ranges[2 * j + 1];
+    __myfs_start_ranges(shard, ranges, count);
+    res = __myfs_sync_ranges(shard, ranges, count);
+    free(ranges);
+  }
+
+  /* Pages taken off the map must not get lost, see __myfs_fsync */
+  if (res < 0) {
+    __myfs_lockset_init(&ls);
+    ls.shard = i;
+    __myfs_lockset_acquire(env, &ls);
+    res = __myfs_sync_shard(env, shard);
+    __myfs_lockset_release(env, &ls);
+    bytes = (uint64_t) shard->size;
+  }
+  pthread_mutex_unlock(&(shard->sync_lock));
+  __atomic_fetch_add(&(env->stats.writeback_runs), (uint64_t) 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(env->stats.writeback_bytes), bytes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(env->stats.writeback_ns), __myfs_stats_now() - start, __ATOMIC_RELAXED);
+  return res;
+}
+
+static void *__myfs_writeback_thread(void *arg) {
+  struct __myfs_environment_struct_t *env;
+  struct timespec deadline;
+  size_t i;
+
+  env = (struct __myfs_environment_struct_t *) arg;
+  pthread_mutex_lock(&(env->writeback_lock));
+  while (!(env->writeback_stop)) {
+    if (!(env->writeback_requested)) {
+      if (env->writeback_interval == 0u) {
+        pthread_cond_wait(&(env->writeback_cond), &(env->writeback_lock));
+      } else {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t) env->writeback_interval;
+        pthread_cond_timedwait(&(env->writeback_cond), &(env->writeback_lock), &deadline);
       }
-      return 0;
+      if (env->writeback_stop) break;
     }
-  } else {
-    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (memory == MAP_FAILED) {
-      perror("Cannot map in memory");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+    env->writeback_requested = 0;
+    pthread_mutex_unlock(&(env->writeback_lock));
+    __atomic_store_n(&(env->writeback_dirty), (uint64_t) 0, __ATOMIC_RELAXED);
+    for (i=((size_t) 0);i<env->num_shards;i++) {
+      if (__myfs_writeback_shard(env, i) < 0) {
+        perror("Cannot write back backup-file");
       }
-      return 0;
     }
+    pthread_mutex_lock(&(env->writeback_lock));
   }
+  pthread_mutex_unlock(&(env->writeback_lock));
+  return NULL;
+}
 
-  /* If the original size is different from the current size, we
-     changed the filesystem and we need to wipe out the old filesystem
-     completely.
-  */
-  if (using_backup) {
-    if (orig_size != size) {
-      if (orig_size != ((size_t) 0)) {
-        memset(memory, 0, orig_size);
+/* Counts bytes written; the write that goes over the threshold wakes
+   the writeback thread, the others take no lock */
+static void __myfs_writeback_note(struct __myfs_environment_struct_t *env, int res) {
+  uint64_t old;
+
+  if ((res <= 0) || (!(env->writeback_started)) || (env->writeback_threshold == ((uint64_t) 0))) return;
+  old = __atomic_fetch_add(&(env->writeback_dirty), (uint64_t) res, __ATOMIC_RELAXED);
+  if ((old < env->writeback_threshold) && (old + ((uint64_t) res) >= env->writeback_threshold)) {
+    pthread_mutex_lock(&(env->writeback_lock));
+    env->writeback_requested = 1;
+    pthread_cond_signal(&(env->writeback_cond));
+    pthread_mutex_unlock(&(env->writeback_lock));
+  }
+}
+
+static void __myfs_writeback_start(struct __myfs_environment_struct_t *env) {
+  if (!(env->using_backup)) return;
+  if ((env->writeback_interval == 0u) && (env->writeback_threshold == ((uint64_t) 0))) return;
+  if (pthread_mutex_init(&(env->writeback_lock), NULL) != 0) {
+    perror("Cannot start writeback");
+    return;
+  }
+  if (pthread_cond_init(&(env->writeback_cond), NULL) != 0) {
+    perror("Cannot start writeback");
+    pthread_mutex_destroy(&(env->writeback_lock));
+    return;
+  }
+  if (pthread_create(&(env->writeback_thread), NULL, __myfs_writeback_thread, env) != 0) {
+    perror("Cannot start writeback");
+    pthread_cond_destroy(&(env->writeback_cond));
+    pthread_mutex_destroy(&(env->writeback_lock));
+    return;
+  }
+  env->writeback_started = 1;
+}
+
+static void __myfs_writeback_stop(struct __myfs_environment_struct_t *env) {
+  if (!(env->writeback_started)) return;
+  pthread_mutex_lock(&(env->writeback_lock));
+  env->writeback_stop = 1;
+  pthread_cond_signal(&(env->writeback_cond));
+  pthread_mutex_unlock(&(env->writeback_lock));
+  pthread_join(env->writeback_thread, NULL);
+  pthread_cond_destroy(&(env->writeback_cond));
+  pthread_mutex_destroy(&(env->writeback_lock));
+  env->writeback_started = 0;
+}
+
+/* Snapshots
+
+   Writing MYFS_SNAPSHOT_COMMAND and a list of files, given like the
+   backup-files and as many of them, to MYFS_STATS_PATH clones each
+   backup-file into a new file with the FICLONE ioctl. The clone shares
+   all blocks with the backup-file until either side changes them, so
+   it takes no room and no time to speak of; the files it makes are
+   images of the whole file system at one point in time, and can be
+   mounted, read-only, alongside it. The changed pages are written
+   back first with no lock held, then all shards are held exclusively
+   at once, so that no operation is halfway done in any of them, while
+   the kernel writes back what has changed since and clones the files.
+   The file systems the backup-files are on must support reflinks
+   (btrfs, XFS, bcachefs, ...), EOPNOTSUPP is returned otherwise.
+*/
+static int __myfs_snapshot(struct __myfs_environment_struct_t *env, char *files) {
+  int fds[MYFS_MAX_SHARDS];
+  char *names[MYFS_MAX_SHARDS];
+  char *next;
+  size_t num, i;
+  uint64_t start;
+  lockset_t ls;
+  int res;
+
+  if (!(env->using_backup)) return -EOPNOTSUPP;
+
+  /* The daemon runs in /, so names must not be relative */
+  num = (size_t) 0;
+  for (next=files;next!=NULL;num++) {
+    if ((num >= env->num_shards) || (*next != '/')) return -EINVAL;
+    names[num] = next;
+    next = strchr(next, MYFS_SHARD_SEP);
+    if (next != NULL) *(next++) = '\0';
+  }
+  if (num != env->num_shards) return -EINVAL;
+  for (i=((size_t) 0);i<num;i++) {
+    fds[i] = open(names[i], O_CREAT | O_EXCL | O_WRONLY, 00644);
+    if (fds[i] < 0) {
+      res = -errno;
+      for (;i>((size_t) 0);i--) {
+        close(fds[i - ((size_t) 1)]);
+        unlink(names[i - ((size_t) 1)]);
       }
+      return res;
     }
   }
-  
-  /* Get uid and gid, write back and succeed */
-  env->uid = getuid();
-  env->gid = getgid();
-  env->memory = memory;
-  env->size = size;
-  env->using_backup = using_backup;
-  env->backup_fd = fd;
-  return 1;
-}
 
-static void __myfs_clear_environment(struct __myfs_environment_struct_t *env) {
-  if (env->using_backup) {
-    if (msync(env->memory, env->size, MS_SYNC) != 0) {
-      perror("Cannot synchronize memory map with backup-file");
+  for (i=((size_t) 0);i<num;i++) {
+    if (__myfs_writeback_shard(env, i) < 0) {
+      perror("Cannot write back backup-file");
     }
   }
-  if (munmap(env->memory, env->size) != 0) {
-    perror("Cannot unmap memory");
+  start = __myfs_stats_now();
+  __myfs_lockset_init(&ls);
+  ls.global = MYFS_LOCK_EXCLUSIVE;
+  for (ls.shard=((size_t) 0);ls.shard<num;ls.shard++) {
+    __myfs_lockset_acquire(env, &ls);
   }
-  if (env->using_backup) {
-    if (close(env->backup_fd) != 0) {
-      perror("Cannot close backup-file");
+  res = 0;
+  for (i=((size_t) 0);i<num;i++) {
+    if (ioctl(fds[i], FICLONE, env->shards[i].backup_fd) != 0) {
+      res = -errno;
+      break;
     }
   }
-  if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-    perror("Cannot destroy mutex");
+  for (ls.shard=num;ls.shard>((size_t) 0);) {
+    ls.shard--;
+    __myfs_lockset_release(env, &ls);
+  }
+  __atomic_fetch_add(&(env->stats.snapshot_pause_ns), __myfs_stats_now() - start, __ATOMIC_RELAXED);
+
+  for (i=((size_t) 0);i<num;i++) {
+    if ((res == 0) && (fsync(fds[i]) != 0)) res = -errno;
+  }
+  for (i=((size_t) 0);i<num;i++) {
+    close(fds[i]);
+    if (res < 0) unlink(names[i]);
+  }
+  if (res < 0) {
+    if ((res == -EINVAL) || (res == -ENOTTY)) res = -EOPNOTSUPP;
+    return res;
+  }
+  __atomic_fetch_add(&(env->stats.snapshots), (uint64_t) 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* Takes a command written to the statistics file, with or without
+   the newline echo puts behind it */
+static int __myfs_stats_write(struct __myfs_environment_struct_t *env, const char *buf, size_t size) {
+  char files[MYFS_COMMAND_MAX];
+  size_t len, prefix;
+  int res;
+
+  len = size;
+  if ((len > ((size_t) 0)) && (buf[len - ((size_t) 1)] == '\n')) len--;
+  prefix = strlen(MYFS_SNAPSHOT_COMMAND);
+  if ((len > prefix) && (len < MYFS_COMMAND_MAX) && (memcmp(buf, MYFS_SNAPSHOT_COMMAND, prefix) == 0)) {
+    memcpy(files, buf + prefix, len - prefix);
+    files[len - prefix] = '\0';
+    if (strlen(files) != len - prefix) return -EINVAL;
+    res = __myfs_snapshot(env, files);
+  } else {
+    if ((len != strlen(MYFS_COMPACT_COMMAND)) || (memcmp(buf, MYFS_COMPACT_COMMAND, len) != 0)) return -EINVAL;
+    res = __myfs_compact_request(env);
   }
+  if (res < 0) return res;
+  return (int) size;
 }
 
-static int __myfs_sync_environment(struct __myfs_environment_struct_t *env) {
-  if (env == NULL) return -1;
-  if (!(env->using_backup)) return 0;
-  if (msync(env->memory, env->size, MS_SYNC) != 0) return -1;
-  if (fsync(env->backup_fd) != 0) return -1;
+/* Root directory handling
+
+   The root directory is found in every shard; its attributes are
+   those of all of them together, its listing goes over the shards
+   one after the other. Readdir offsets carry the shard above
+   MYFS_SHARD_SHIFT, and the entry within its root directory below.
+*/
+
+struct __myfs_root_filler_struct_t {
+  void            *buf;
+  fuse_fill_dir_t filler;
+  size_t          shard;
+  int             full;
+};
+
+static int __myfs_root_filler(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+  struct __myfs_root_filler_struct_t *root;
+
+  root = (struct __myfs_root_filler_struct_t *) buf;
+  if (root->filler(root->buf, name, stbuf, off | (((off_t) root->shard) << MYFS_SHARD_SHIFT)) != 0) {
+    root->full = 1;
+    return 1;
+  }
   return 0;
 }
 
-/* Declaration for the implementations of the operations */
+static void __myfs_latest_time(struct timespec *t, const struct timespec *u) {
+  if ((u->tv_sec > t->tv_sec) || ((u->tv_sec == t->tv_sec) && (u->tv_nsec > t->tv_nsec))) *t = *u;
+}
+
+/* Run getattr, readdir or utimens on the root directory of every
+   shard, taking the locks of one shard at a time */
+static int __myfs_root_getattr(struct __myfs_environment_struct_t *env, int *errnoptr, struct stat *st) {
+  struct stat shard_st;
+  lockset_t ls;
+  size_t i;
+  int res;
+
+  for (i=((size_t) 0);i<env->num_shards;i++) {
+    __myfs_lockset_init(&ls);
+    __myfs_lockset_add(env, &ls, "/", MYFS_LOCK_NONE, MYFS_LOCK_SHARED);
+    ls.shard = i;
+    __myfs_lockset_acquire(env, &ls);
+    memset(&shard_st, 0, sizeof(struct stat));
+    res = __myfs_getattr_implem(MYFS_SHARD(env, &ls)->fs,
+                                errnoptr,
+                                env->uid,
+                                env->gid,
+                                "/",
+                                (i == ((size_t) 0)) ? st : &shard_st);
+    __myfs_lockset_release(env, &ls);
+    if (res < 0) return res;
+    if (i == ((size_t) 0)) continue;
+    st->st_nlink += shard_st.st_nlink - ((nlink_t) 2);
+    st->st_blocks += shard_st.st_blocks;
+    __myfs_latest_time(&(st->st_atim), &(shard_st.st_atim));
+    __myfs_latest_time(&(st->st_mtim), &(shard_st.st_mtim));
+    __myfs_latest_time(&(st->st_ctim), &(shard_st.st_ctim));
+  }
+  return 0;
+}
+
+static int __myfs_root_readdir(struct __myfs_environment_struct_t *env, int *errnoptr,
+                               off_t offset, void *buf, fuse_fill_dir_t filler) {
+  struct __myfs_root_filler_struct_t root;
+  off_t local;
+  lockset_t ls;
+  int res;
+
+  root.buf = buf;
+  root.filler = filler;
+  root.shard = (size_t) (offset >> MYFS_SHARD_SHIFT);
+  root.full = 0;
+  local = offset & ((((off_t) 1) << MYFS_SHARD_SHIFT) - ((off_t) 1));
+  for (;(root.shard < env->num_shards) && !root.full;root.shard++) {
+    /* "." and ".." only come from the first shard */
+    if ((root.shard > ((size_t) 0)) && (local < ((off_t) 2))) local = (off_t) 2;
+    __myfs_lockset_init(&ls);
+    __myfs_lockset_add(env, &ls, "/", MYFS_LOCK_NONE, MYFS_LOCK_SHARED);
+    ls.shard = root.shard;
+    __myfs_lockset_acquire(env, &ls);
+    res = __myfs_readdir_fill_implem(MYFS_SHARD(env, &ls)->fs,
+                                     errnoptr,
+                                     env->uid,
+                                     env->gid,
+                                     "/",
+                                     local,
+                                     &root,
+                                     __myfs_root_filler);
+    __myfs_lockset_release(env, &ls);
+    if (res < 0) return res;
+    local = (off_t) 0;
+  }
+  return 0;
+}
+
+static int __myfs_root_utimens(struct __myfs_environment_struct_t *env, int *errnoptr,
+                               const struct timespec ts[2]) {
+  lockset_t ls;
+  size_t i;
+  int res;
+
+  for (i=((size_t) 0);i<env->num_shards;i++) {
+    __myfs_lockset_init(&ls);
+    __myfs_lockset_add(env, &ls, "/", MYFS_LOCK_NONE, MYFS_LOCK_EXCLUSIVE);
+    ls.shard = i;
+    __myfs_lockset_acquire(env, &ls);
+    res = __myfs_utimens_implem(MYFS_SHARD(env, &ls)->fs,
+                                errnoptr,
+                                "/",
+                                ts);
+    __myfs_lockset_release(env, &ls);
+    if (res < 0) return res;
+  }
+  return 0;
+}
 
-int __myfs_getattr_implem(void *, size_t, int *, uid_t, gid_t, const char *, struct stat *);
-int __myfs_readdir_implem(void *, size_t, int *, const char *, char ***);
-int __myfs_mknod_implem(void *, size_t, int *, const char *);
-int __myfs_unlink_implem(void *, size_t, int *, const char *);
-int __myfs_mkdir_implem(void *, size_t, int *, const char *);
-int __myfs_rmdir_implem(void *, size_t, int *, const char *);
-int __myfs_rename_implem(void *, size_t, int *, const char *, const char*);
-int __myfs_truncate_implem(void *, size_t, int *, const char *, off_t);
-int __myfs_open_implem(void *, size_t, int *, const char *);
-int __myfs_read_implem(void *, size_t, int *, const char *, char *, size_t, off_t);
-int __myfs_write_implem(void *, size_t, int *, const char *, const char *, size_t, off_t);
-int __myfs_statfs_implem(void *, size_t, int *, struct statvfs*);
-int __myfs_utimens_implem(void *, size_t, int *, const char *, const struct timespec [2]);
+/* End of root directory handling */
 
 /* End of declarations */
 
@@ -292,76 +1652,84 @@ static int __myfs_getattr(const char *path, struct stat *st) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  uint64_t start;
+  lockset_t ls;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
 
   memset(st, 0, sizeof(struct stat));
   
+  /* The statistics file is not in the image */
+  if (__myfs_is_stats_path(path)) {
+    st->st_mode = S_IFREG | 0644;
+    st->st_nlink = (nlink_t) 1;
+    st->st_uid = env->uid;
+    st->st_gid = env->gid;
+    return __myfs_stats_record(env, MYFS_OP_GETATTR, start, 0);
+  }
+
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_getattr_implem(env->memory,
-                              env->size,
+  if (__myfs_is_root(path) && (env->num_shards > ((size_t) 1))) {
+    res = __myfs_root_getattr(env, &__myfs_errno, st);
+    return __myfs_stats_record(env, MYFS_OP_GETATTR, start, (res >= 0) ? res : -__myfs_errno);
+  }
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, path, MYFS_LOCK_NONE, MYFS_LOCK_SHARED);
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_getattr_implem(MYFS_SHARD(env, &ls)->fs,
                               &__myfs_errno,
                               env->uid,
                               env->gid,
                               path,
                               st);
-  pthread_mutex_unlock(&(env->env_lock));  
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;
+  __myfs_lockset_release(env, &ls);
+  return __myfs_stats_record(env, MYFS_OP_GETATTR, start, (res >= 0) ? res : -__myfs_errno);
 }
 
 static int __myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                           off_t offset, struct fuse_file_info *fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
-  int __myfs_errno, res, i;
-  char **names;
-  
-  (void) offset;
+  int __myfs_errno, res;
+  uint64_t start;
+  lockset_t ls;
+
   (void) fi;
-  
+
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
 
-  names = NULL;
+  /* The entries go to filler straight from the image, each with the
+     offset FUSE hands back to resume behind it */
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_readdir_implem(env->memory,
-                              env->size,
-                              &__myfs_errno,
-                              path,
-                              &names);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0) {
-    if (res == 0) {
-      filler(buf, ".", NULL, 0);
-      filler(buf, "..", NULL, 0);
-      return 0;
-    } else {
-      if (names != NULL) {
-        filler(buf, ".", NULL, 0);
-        filler(buf, "..", NULL, 0);
-        for (i=0;i<res;i++) {
-          filler(buf, names[i], NULL, 0);
-          free(names[i]);
-        }
-        free(names);
-        return 0;
-      } else {
-        return -ENOENT;
-      }
-    }
+  if (__myfs_is_root(path) && (env->num_shards > ((size_t) 1))) {
+    res = __myfs_root_readdir(env, &__myfs_errno, offset, buf, filler);
+    return __myfs_stats_record(env, MYFS_OP_READDIR, start, (res >= 0) ? res : -__myfs_errno);
   }
-  return -__myfs_errno;
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, path, MYFS_LOCK_NONE, MYFS_LOCK_SHARED);
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_readdir_fill_implem(MYFS_SHARD(env, &ls)->fs,
+                                   &__myfs_errno,
+                                   env->uid,
+                                   env->gid,
+                                   path,
+                                   offset,
+                                   buf,
+                                   filler);
+  __myfs_lockset_release(env, &ls);
+  return __myfs_stats_record(env, MYFS_OP_READDIR, start, (res >= 0) ? res : -__myfs_errno);
 }
 
 static int __myfs_mknod(const char* path, mode_t mode, dev_t dev) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  uint64_t start;
+  lockset_t ls;
 
   (void) dev;
 
@@ -369,125 +1737,190 @@ static int __myfs_mknod(const char* path, mode_t mode, dev_t dev) {
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
+  
+  if (__myfs_is_stats_path(path)) return __myfs_stats_record(env, MYFS_OP_MKNOD, start, -EEXIST);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_mknod_implem(env->memory,
-                            env->size,
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, path, MYFS_LOCK_EXCLUSIVE, MYFS_LOCK_NONE);
+  ls.alloc = 1;
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_mknod_implem(MYFS_SHARD(env, &ls)->fs,
                             &__myfs_errno,
                             path);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;
+  __myfs_lockset_release(env, &ls);
+  return __myfs_stats_record(env, MYFS_OP_MKNOD, start, (res >= 0) ? res : -__myfs_errno);
 }
 
 static int __myfs_unlink(const char* path) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  uint64_t start;
+  lockset_t ls;
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
+  
+  if (__myfs_is_stats_path(path)) return __myfs_stats_record(env, MYFS_OP_UNLINK, start, -EACCES);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_unlink_implem(env->memory,
-                             env->size,
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, path, MYFS_LOCK_EXCLUSIVE, MYFS_LOCK_NONE);
+  ls.alloc = 1;
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_unlink_implem(MYFS_SHARD(env, &ls)->fs,
                              &__myfs_errno,
                              path);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;
+  __myfs_lockset_release(env, &ls);
+  return __myfs_stats_record(env, MYFS_OP_UNLINK, start, (res >= 0) ? res : -__myfs_errno);
 }
 
 static int __myfs_mkdir(const char* path, mode_t mode) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  uint64_t start;
+  lockset_t ls;
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
+  
+  if (__myfs_is_stats_path(path)) return __myfs_stats_record(env, MYFS_OP_MKDIR, start, -EEXIST);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_mkdir_implem(env->memory,
-                            env->size,
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, path, MYFS_LOCK_EXCLUSIVE, MYFS_LOCK_NONE);
+  ls.alloc = 1;
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_mkdir_implem(MYFS_SHARD(env, &ls)->fs,
                             &__myfs_errno,
                             path);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;
+  __myfs_lockset_release(env, &ls);
+  return __myfs_stats_record(env, MYFS_OP_MKDIR, start, (res >= 0) ? res : -__myfs_errno);
 }
 
 static int __myfs_rmdir(const char* path) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  uint64_t start;
+  lockset_t ls;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
+  
+  if (__myfs_is_stats_path(path)) return __myfs_stats_record(env, MYFS_OP_RMDIR, start, -ENOTDIR);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_rmdir_implem(env->memory,
-                            env->size,
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, path, MYFS_LOCK_EXCLUSIVE, MYFS_LOCK_NONE);
+  ls.alloc = 1;
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_rmdir_implem(MYFS_SHARD(env, &ls)->fs,
                             &__myfs_errno,
                             path);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;
+  __myfs_lockset_release(env, &ls);
+  return __myfs_stats_record(env, MYFS_OP_RMDIR, start, (res >= 0) ? res : -__myfs_errno);
 }
 
 static int __myfs_rename(const char* from, const char* to) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  uint64_t start;
+  lockset_t ls;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
+  
+  if (__myfs_is_stats_path(from) || __myfs_is_stats_path(to)) return __myfs_stats_record(env, MYFS_OP_RENAME, start, -EACCES);
+
+  /* Shards are filesystems of their own; mv falls back to copying */
+  if (__myfs_shard_of(env, from) != __myfs_shard_of(env, to)) return __myfs_stats_record(env, MYFS_OP_RENAME, start, -EXDEV);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_rename_implem(env->memory,
-                             env->size,
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, from, MYFS_LOCK_EXCLUSIVE, MYFS_LOCK_NONE);
+  __myfs_lockset_add(env, &ls, to, MYFS_LOCK_EXCLUSIVE, MYFS_LOCK_NONE);
+  ls.alloc = 1;
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_rename_implem(MYFS_SHARD(env, &ls)->fs,
                              &__myfs_errno,
                              from,
                              to);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;
+  __myfs_lockset_release(env, &ls);
+  return __myfs_stats_record(env, MYFS_OP_RENAME, start, (res >= 0) ? res : -__myfs_errno);
 }
 
 static int __myfs_truncate(const char* path, off_t size) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  uint64_t start;
+  lockset_t ls;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
+  
+  /* Shells truncate the statistics file before writing a command to it */
+  if (__myfs_is_stats_path(path)) return __myfs_stats_record(env, MYFS_OP_TRUNCATE, start, (size == ((off_t) 0)) ? 0 : -EACCES);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_truncate_implem(env->memory,
-                               env->size,
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, path, MYFS_LOCK_NONE, MYFS_LOCK_EXCLUSIVE);
+  ls.alloc = 1;
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_truncate_implem(MYFS_SHARD(env, &ls)->fs,
                                &__myfs_errno,
                                path,
+                               NULL,
                                size);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;
+  __myfs_lockset_release(env, &ls);
+  return __myfs_stats_record(env, MYFS_OP_TRUNCATE, start, (res >= 0) ? res : -__myfs_errno);
+}
+
+static int __myfs_ftruncate(const char* path, off_t size, struct fuse_file_info* fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+  uint64_t start;
+  lockset_t ls;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
+  
+  /* Shells truncate the statistics file before writing a command to it */
+  if (__myfs_is_stats_path(path)) return __myfs_stats_record(env, MYFS_OP_TRUNCATE, start, (size == ((off_t) 0)) ? 0 : -EACCES);
+  
+  __myfs_errno = ENOENT;
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, path, MYFS_LOCK_NONE, MYFS_LOCK_EXCLUSIVE);
+  ls.alloc = 1;
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_truncate_implem(MYFS_SHARD(env, &ls)->fs,
+                               &__myfs_errno,
+                               path,
+                               MYFS_HANDLE(fi),
+                               size);
+  __myfs_lockset_release(env, &ls);
+  return __myfs_stats_record(env, MYFS_OP_TRUNCATE, start, (res >= 0) ? res : -__myfs_errno);
 }
 
 static int __myfs_open(const char* path, struct fuse_file_info* fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  file_handle_t *handle;
+  uint64_t start;
+  lockset_t ls;
 
   if (!(((fi->flags & O_ACCMODE) == O_RDONLY) ||
         ((fi->flags & O_ACCMODE) == O_WRONLY) ||
@@ -496,133 +1929,482 @@ static int __myfs_open(const char* path, struct fuse_file_info* fi) {
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
+
+  /* The statistics file gets its text when it is opened, writes to
+     it are commands */
+  if (__myfs_is_stats_path(path)) {
+    res = __myfs_stats_open(env, fi);
+    return __myfs_stats_record(env, MYFS_OP_OPEN, start, res);
+  }
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_open_implem(env->memory,
-                           env->size,
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, path, MYFS_LOCK_NONE, MYFS_LOCK_SHARED);
+  __myfs_lockset_acquire(env, &ls);
+  handle = NULL;
+  res = __myfs_open_implem(MYFS_SHARD(env, &ls)->fs,
                            &__myfs_errno,
-                           path);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;
+                           path,
+                           &handle);
+  __myfs_lockset_release(env, &ls);
+  if (res >= 0) fi->fh = (uint64_t) (uintptr_t) handle;
+  return __myfs_stats_record(env, MYFS_OP_OPEN, start, (res >= 0) ? res : -__myfs_errno);
+}
+
+static int __myfs_release(const char* path, struct fuse_file_info* fi) {
+  /* The handle lives in process memory only, no lock is needed */
+  if (__myfs_is_stats_path(path)) {
+    free(MYFS_SNAPSHOT(fi));
+    fi->fh = (uint64_t) 0;
+    return 0;
+  }
+  file_handle_destroy(MYFS_HANDLE(fi));
+  fi->fh = (uint64_t) 0;
+  return 0;
+}
+
+/* Has the range behind a large read of a backup-file read ahead, as
+   the next read is likely to want it; called with the locks of the
+   read held. Unlike MADV_SEQUENTIAL, which goes for a whole mapping,
+   this does not change how the rest of the image is paged.
+*/
+static void __myfs_readahead(struct __myfs_environment_struct_t *env, shard_t *shard, const char *path,
+                             struct fuse_file_info *fi, size_t size, off_t offset) {
+  int __myfs_errno;
+  size_t *segments;
+  size_t count;
+
+  if (!(env->using_backup) || (size < MYFS_READAHEAD_MIN)) return;
+  if (__myfs_read_extents_implem(shard->fs,
+                                 &__myfs_errno,
+                                 path,
+                                 MYFS_HANDLE(fi),
+                                 size,
+                                 offset,
+                                 &segments,
+                                 &count) > 0) {
+    __myfs_advise_ranges(shard, segments, count);
+  }
+  free(segments);
 }
 
 static int __myfs_read(const char* path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  uint64_t start;
+  lockset_t ls;
 
-  (void) fi;
-  
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
+  
+  if (__myfs_is_stats_path(path)) return __myfs_stats_record(env, MYFS_OP_READ, start, __myfs_stats_read(fi, buf, size, offset));
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_read_implem(env->memory,
-                           env->size,
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, path, MYFS_LOCK_NONE, MYFS_LOCK_SHARED);
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_read_implem(MYFS_SHARD(env, &ls)->fs,
                            &__myfs_errno,
                            path,
+                           MYFS_HANDLE(fi),
                            buf,
                            size,
                            offset);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;
+  if (res > 0) __myfs_readahead(env, MYFS_SHARD(env, &ls), path, fi, size, offset + ((off_t) res));
+  __myfs_lockset_release(env, &ls);
+  return __myfs_stats_record(env, MYFS_OP_READ, start, (res >= 0) ? res : -__myfs_errno);
+}
+
+/* Zero-copy read: the reply refers to the bytes by their position in
+   the backup-file, so that FUSE can splice them to the kernel without
+   them passing through our buffers. Holes and small reads are served
+   from memory.
+
+   The data only moves once the locks are released again, so a read
+   racing a write or truncate on the same range may see the bytes
+   before or after it, or bytes the space got reused for. This is why
+   the mode is only enabled on request (--zerocopy).
+*/
+static int __myfs_read_buf(const char* path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info* fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  struct fuse_bufvec *bufv;
+  int __myfs_errno, res;
+  size_t *segments;
+  size_t count, i;
+  uint64_t start;
+  void *mem;
+  lockset_t ls;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  /* Small reads are cheaper to copy, the statistics file is in memory */
+  if ((size < MYFS_ZEROCOPY_MIN) || __myfs_is_stats_path(path)) {
+    mem = malloc(size > ((size_t) 0) ? size : ((size_t) 1));
+    bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+    if ((mem == NULL) || (bufv == NULL)) {
+      free(mem);
+      free(bufv);
+      return -ENOMEM;
+    }
+    res = __myfs_read(path, (char *) mem, size, offset, fi);
+    if (res < 0) {
+      free(mem);
+      free(bufv);
+      return res;
+    }
+    *bufv = FUSE_BUFVEC_INIT((size_t) res);
+    bufv->buf[0].mem = mem;
+    *bufp = bufv;
+    return 0;
+  }
+
+  start = __myfs_stats_now();
+  __myfs_errno = ENOENT;
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, path, MYFS_LOCK_NONE, MYFS_LOCK_SHARED);
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_read_extents_implem(MYFS_SHARD(env, &ls)->fs,
+                                   &__myfs_errno,
+                                   path,
+                                   MYFS_HANDLE(fi),
+                                   size,
+                                   offset,
+                                   &segments,
+                                   &count);
+  if (res > 0) __myfs_readahead(env, MYFS_SHARD(env, &ls), path, fi, size, offset + ((off_t) res));
+  __myfs_lockset_release(env, &ls);
+  if (res < 0)
+    return __myfs_stats_record(env, MYFS_OP_READ, start, -__myfs_errno);
+
+  /* One buffer per run; fuse frees the memory of each one and the vector */
+  bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec) +
+                                       (count > ((size_t) 0) ? count - ((size_t) 1) : ((size_t) 0)) * sizeof(struct fuse_buf));
+  if (bufv == NULL) {
+    free(segments);
+    return __myfs_stats_record(env, MYFS_OP_READ, start, -ENOMEM);
+  }
+  *bufv = FUSE_BUFVEC_INIT((size_t) 0);
+  bufv->count = count;
+  for (i=0;i<count;i++) {
+    bufv->buf[i].size = segments[2 * i + 1];
+    if (segments[2 * i] != ((size_t) 0)) {
+      bufv->buf[i].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+      bufv->buf[i].mem = NULL;
+      bufv->buf[i].fd = MYFS_SHARD(env, &ls)->backup_fd;
+      bufv->buf[i].pos = (off_t) segments[2 * i];
+    } else {
+      bufv->buf[i].flags = (enum fuse_buf_flags) 0;
+      bufv->buf[i].mem = calloc(segments[2 * i + 1], (size_t) 1);
+      bufv->buf[i].fd = -1;
+      bufv->buf[i].pos = (off_t) 0;
+      if (bufv->buf[i].mem == NULL) {
+        bufv->count = i;
+        for (i=0;i<bufv->count;i++) {
+          free(bufv->buf[i].mem);
+        }
+        free(bufv);
+        free(segments);
+        return __myfs_stats_record(env, MYFS_OP_READ, start, -ENOMEM);
+      }
+    }
+  }
+  free(segments);
+  *bufp = bufv;
+  return __myfs_stats_record(env, MYFS_OP_READ, start, 0);
 }
 
+/* The range is reserved with alloc_lock held, the data is then copied
+   into the reserved runs with only the stripes held, so that large
+   writes to different files do not wait for each other.
+*/
 static int __myfs_write(const char* path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  size_t *segments;
+  size_t count, i, done;
+  off_t old_size;
+  uint64_t start;
+  lockset_t ls;
 
-  (void) fi;
-  
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
+
+  if (__myfs_is_stats_path(path)) return __myfs_stats_record(env, MYFS_OP_WRITE, start, __myfs_stats_write(env, buf, size));
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_write_implem(env->memory,
-                            env->size,
-                            &__myfs_errno,
-                            path,
-                            buf,
-                            size,
-                            offset);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, path, MYFS_LOCK_NONE, MYFS_LOCK_EXCLUSIVE);
+  ls.alloc = 1;
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_write_extents_implem(MYFS_SHARD(env, &ls)->fs,
+                                    &__myfs_errno,
+                                    path,
+                                    MYFS_HANDLE(fi),
+                                    size,
+                                    offset,
+                                    &segments,
+                                    &count,
+                                    &old_size);
+  __myfs_lockset_drop_alloc(env, &ls);
+  if (res > 0) {
+    for (i=0, done=((size_t) 0);i<count;i++) {
+      memcpy(((char *) (MYFS_SHARD(env, &ls)->memory)) + segments[2 * i], buf + done, segments[2 * i + 1]);
+      done += segments[2 * i + 1];
+    }
+  }
+  free(segments);
+  __myfs_lockset_release(env, &ls);
+  __myfs_writeback_note(env, res);
+  return __myfs_stats_record(env, MYFS_OP_WRITE, start, (res >= 0) ? res : -__myfs_errno);
+}
+
+/* Zero-copy write: the range is backed in the image first, then FUSE
+   copies the data straight from its request buffer or pipe into the
+   mapped image, without a bounce buffer in between. Unlike reads, the
+   copy happens while the stripes are held; alloc_lock is only held
+   for the reservation, and taken again if a short copy has to be cut
+   off.
+*/
+static int __myfs_write_buf(const char* path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info* fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  struct fuse_bufvec *dst;
+  int __myfs_errno, res;
+  char command[MYFS_COMMAND_MAX];
+  size_t *segments;
+  size_t count, i;
+  off_t old_size;
+  ssize_t copied;
+  uint64_t start;
+  lockset_t ls;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
+
+  /* Commands are short, anything longer is not one */
+  if (__myfs_is_stats_path(path)) {
+    struct fuse_bufvec cmd = FUSE_BUFVEC_INIT(sizeof(command));
+    cmd.buf[0].mem = command;
+    copied = fuse_buf_copy(&cmd, buf, (enum fuse_buf_copy_flags) 0);
+    if (copied < ((ssize_t) 0)) return __myfs_stats_record(env, MYFS_OP_WRITE, start, (int) copied);
+    if (fuse_buf_size(buf) > sizeof(command)) return __myfs_stats_record(env, MYFS_OP_WRITE, start, -EINVAL);
+    return __myfs_stats_record(env, MYFS_OP_WRITE, start, __myfs_stats_write(env, command, (size_t) copied));
+  }
+
+  __myfs_errno = ENOENT;
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, path, MYFS_LOCK_NONE, MYFS_LOCK_EXCLUSIVE);
+  ls.alloc = 1;
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_write_extents_implem(MYFS_SHARD(env, &ls)->fs,
+                                    &__myfs_errno,
+                                    path,
+                                    MYFS_HANDLE(fi),
+                                    fuse_buf_size(buf),
+                                    offset,
+                                    &segments,
+                                    &count,
+                                    &old_size);
+  __myfs_lockset_drop_alloc(env, &ls);
+  if ((res <= 0) || (count == ((size_t) 0))) {
+    __myfs_lockset_release(env, &ls);
+    return __myfs_stats_record(env, MYFS_OP_WRITE, start, (res >= 0) ? res : -__myfs_errno);
+  }
+
+  /* One destination buffer per run of the image */
+  dst = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec) +
+                                      (count - ((size_t) 1)) * sizeof(struct fuse_buf));
+  copied = (ssize_t) -ENOMEM;
+  if (dst != NULL) {
+    *dst = FUSE_BUFVEC_INIT((size_t) 0);
+    dst->count = count;
+    for (i=0;i<count;i++) {
+      dst->buf[i].size = segments[2 * i + 1];
+      dst->buf[i].flags = (enum fuse_buf_flags) 0;
+      dst->buf[i].mem = ((char *) (MYFS_SHARD(env, &ls)->memory)) + segments[2 * i];
+      dst->buf[i].fd = -1;
+      dst->buf[i].pos = (off_t) 0;
+    }
+    copied = fuse_buf_copy(dst, buf, (enum fuse_buf_copy_flags) 0);
+    free(dst);
+  }
+  free(segments);
+
+  /* Bytes beyond the old end of the file that did not get filled are
+     garbage: cut them off again */
+  if (copied < ((ssize_t) res)) {
+    __myfs_errno = (copied < ((ssize_t) 0)) ? ((int) -copied) : EIO;
+    if (copied < ((ssize_t) 0)) copied = (ssize_t) 0;
+    if ((offset + ((off_t) copied)) > old_size) old_size = offset + ((off_t) copied);
+    __myfs_lockset_take_alloc(env, &ls);
+    __myfs_truncate_implem(MYFS_SHARD(env, &ls)->fs,
+                           &__myfs_errno,
+                           path,
+                           MYFS_HANDLE(fi),
+                           old_size);
+  }
+  __myfs_lockset_release(env, &ls);
+  __myfs_writeback_note(env, (int) copied);
+  return __myfs_stats_record(env, MYFS_OP_WRITE, start, (copied > ((ssize_t) 0)) ? ((int) copied) : -__myfs_errno);
 }
 
 static int __myfs_statfs(const char* path, struct statvfs* stbuf) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  struct statvfs shard_stbuf;
+  uint64_t start;
+  lockset_t ls;
+  size_t i;
 
   (void) path;
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
 
   memset(stbuf, 0, sizeof(struct statvfs));
   
+  /* The shards add up */
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_statfs_implem(env->memory,
-                             env->size,
-                             &__myfs_errno,
-                             stbuf);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;
+  res = 0;
+  for (i=((size_t) 0);(i<env->num_shards) && (res >= 0);i++) {
+    __myfs_lockset_init(&ls);
+    ls.shard = i;
+    ls.alloc = 1;
+    __myfs_lockset_acquire(env, &ls);
+    res = __myfs_statfs_implem(MYFS_SHARD(env, &ls)->fs,
+                               &__myfs_errno,
+                               (i == ((size_t) 0)) ? stbuf : &shard_stbuf);
+    __myfs_lockset_release(env, &ls);
+    if ((res >= 0) && (i > ((size_t) 0))) {
+      stbuf->f_blocks += shard_stbuf.f_blocks;
+      stbuf->f_bfree += shard_stbuf.f_bfree;
+      stbuf->f_bavail += shard_stbuf.f_bavail;
+      stbuf->f_files += shard_stbuf.f_files;
+      stbuf->f_ffree += shard_stbuf.f_ffree;
+      stbuf->f_favail += shard_stbuf.f_favail;
+    }
+  }
+  return __myfs_stats_record(env, MYFS_OP_STATFS, start, (res >= 0) ? res : -__myfs_errno);
 }
 
 static int __myfs_utimens(const char* path, const struct timespec ts[2]) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  uint64_t start;
+  lockset_t ls;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
+  
+  if (__myfs_is_stats_path(path)) return __myfs_stats_record(env, MYFS_OP_UTIMENS, start, -EACCES);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_utimens_implem(env->memory,
-                              env->size,
+  if (__myfs_is_root(path) && (env->num_shards > ((size_t) 1))) {
+    res = __myfs_root_utimens(env, &__myfs_errno, ts);
+    return __myfs_stats_record(env, MYFS_OP_UTIMENS, start, (res >= 0) ? res : -__myfs_errno);
+  }
+  __myfs_lockset_init(&ls);
+  __myfs_lockset_add(env, &ls, path, MYFS_LOCK_NONE, MYFS_LOCK_EXCLUSIVE);
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_utimens_implem(MYFS_SHARD(env, &ls)->fs,
                               &__myfs_errno,
                               path,
                               ts);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;
+  __myfs_lockset_release(env, &ls);
+  return __myfs_stats_record(env, MYFS_OP_UTIMENS, start, (res >= 0) ? res : -__myfs_errno);
 }
 
 static int __myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
-  
-  (void) path;
-  (void) datasync;
-  (void) fi;
+  uint64_t start;
+  lockset_t ls;
+  size_t *ranges;
+  size_t count;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+  start = __myfs_stats_now();
+
+  if (!(env->using_backup) || __myfs_is_stats_path(path)) return 0;
   
+  /* Taking the changed pages off the dirty map must not overlap with
+     an operation that has changed the image but not marked it yet;
+     the pages are written back once everyone may go on again.
+  */
   __myfs_errno = EIO;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_sync_environment(env);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;  
+  ranges = NULL;
+  count = (size_t) 0;
+  __myfs_lockset_init(&ls);
+  ls.shard = __myfs_shard_of(env, path);
+  ls.global = MYFS_LOCK_EXCLUSIVE;
+  __myfs_lockset_acquire(env, &ls);
+  res = __myfs_fsync_implem(MYFS_SHARD(env, &ls)->fs,
+                            &__myfs_errno,
+                            path,
+                            MYFS_HANDLE(fi),
+                            datasync,
+                            &ranges,
+                            &count);
+  __myfs_lockset_release(env, &ls);
+
+  /* Pages the writeback thread took before must be on disk too */
+  pthread_mutex_lock(&(MYFS_SHARD(env, &ls)->sync_lock));
+  if (res >= 0) {
+    res = __myfs_sync_ranges(MYFS_SHARD(env, &ls), ranges, count);
+    free(ranges);
+  }
+
+  /* Runs taken off the map but not written back would be forgotten,
+     so fall back to writing back the whole image
+  */
+  if (res < 0) {
+    __myfs_errno = EIO;
+    __myfs_lockset_init(&ls);
+    ls.shard = __myfs_shard_of(env, path);
+    __myfs_lockset_acquire(env, &ls);
+    res = __myfs_sync_shard(env, MYFS_SHARD(env, &ls));
+    __myfs_lockset_release(env, &ls);
+  }
+  pthread_mutex_unlock(&(MYFS_SHARD(env, &ls)->sync_lock));
+  return __myfs_stats_record(env, MYFS_OP_FSYNC, start, (res >= 0) ? res : -__myfs_errno);
+}
+
+static void *__myfs_init(struct fuse_conn_info *conn) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  /* Let the kernel hand over written data in a pipe, for write_buf */
+  conn->want |= conn->capable & FUSE_CAP_SPLICE_READ;
+
+  /* Let the kernel take zero-copy read replies by splicing */
+  if ((env != NULL) && env->zerocopy) {
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+  }
+
+  /* FUSE has forked into the background by now, the thread must
+     start here to be in the process that serves the mount */
+  if (env != NULL) {
+    __myfs_compact_start(env);
+    __myfs_writeback_start(env);
+  }
+  return env;
 }
 
 static void __myfs_destroy(void *private_data) {
@@ -630,6 +2412,8 @@ static void __myfs_destroy(void *private_data) {
   
   if (private_data == NULL) return;
   env = (struct __myfs_environment_struct_t *) private_data;
+  __myfs_writeback_stop(env);
+  __myfs_compact_stop(env);
   __myfs_clear_environment(env);
 }
 
@@ -642,12 +2426,16 @@ static struct fuse_operations __myfs_operations = {
   .rmdir = __myfs_rmdir,
   .rename = __myfs_rename,
   .truncate = __myfs_truncate,
+  .ftruncate = __myfs_ftruncate,
   .open = __myfs_open,
+  .release = __myfs_release,
   .read = __myfs_read,
   .write = __myfs_write,
+  .write_buf = __myfs_write_buf,
   .statfs = __myfs_statfs,
   .utimens = __myfs_utimens,
   .fsync = __myfs_fsync,
+  .init = __myfs_init,
   .destroy = __myfs_destroy
 };
 
@@ -658,14 +2446,55 @@ static void __myfs_show_help(const char *name) {
         printf("File-system specific options:\n"
                "    --backupfile=<s>        File to read file-system content from and save to\n"
                "                            Default: none, all changes are lost\n"
+               "                            Several files separated by ':' each hold a\n"
+               "                            part of the file system (up to 16); they must\n"
+               "                            always be given in the same order.\n"
+               "                            Backup-files of the original, unversioned\n"
+               "                            layout are converted on their first mount;\n"
+               "                            keep a copy until it is done (see README.md).\n"
+               "                            Writing \"snapshot <s>\" to /.myfs_stats, with\n"
+               "                            as many new files given the same way, clones\n"
+               "                            the backup-files into them; they can be\n"
+               "                            mounted read-only (-o ro) alongside. Needs a\n"
+               "                            file system with reflinks.\n"
                "    --size=<s>              Size of the file system\n"
                "                            Default: 128MB if no backup-file is given.\n"
                "                                     Size of the backup-file otherwise.\n"
                "                            If both a backup-file and a size are specified,\n"
                "                            the actual size is the maximum of the size of the\n"
                "                            backup-file and the size specified.\n"
-               "                            The minimum size of a filesystem is 2kB. If a\n"
-               "                            lesser size is used, it is increased to 2kB.\n"
+               "                            The minimum size of a filesystem is 16kB. If a\n"
+               "                            lesser size is used, it is increased to 16kB.\n"
+               "    --block-size=<s>        Base size of the blocks file data is kept in,\n"
+               "                            a power of two from 64 bytes to 64kB. Blocks\n"
+               "                            grow up to 1024 times that as files grow.\n"
+               "                            Default: 1kB. Only used when a file system is\n"
+               "                            created, an existing one keeps its own.\n"
+               "    --zerocopy              Serve large reads by splicing them out of the\n"
+               "                            backup-file instead of copying them\n"
+               "                            Default: off. Needs a backup-file.\n"
+               "    --hugepages             Back the file system with huge pages\n"
+               "                            Default: off. Transparent huge pages are used\n"
+               "                            for a backup-file, or if the huge page pool\n"
+               "                            is too small.\n"
+               "    --populate              Fault the whole file system in when mounting\n"
+               "                            Default: off\n"
+               "    --numa-node=<n>         Keep the file system in the memory of NUMA\n"
+               "                            node n, or interleave it over all nodes if n\n"
+               "                            is \"all\"\n"
+               "                            Default: the policy of the process\n"
+               "    --compact-interval=<s>  Seconds between looks at how fragmented the\n"
+               "                            free memory is; it is compacted once the\n"
+               "                            largest free block is less than half of it.\n"
+               "                            0 compacts only when \"compact\" is written\n"
+               "                            to /.myfs_stats.\n"
+               "                            Default: 10\n"
+               "    --writeback-interval=<s> Seconds between writebacks of the changed\n"
+               "                            parts of the backup-files, 0 for none\n"
+               "                            Default: 5\n"
+               "    --writeback-dirty=<s>   Bytes written that start a writeback before\n"
+               "                            the interval is over, 0 for no such limit\n"
+               "                            Default: 32MB\n"
                "\n");
 }
 
@@ -678,6 +2507,14 @@ int main(int argc, char *argv[]) {
   /* Initialize defaults */
   __myfs_options.filename = NULL;
   __myfs_options.size = NULL;
+  __myfs_options.block_size = NULL;
+  __myfs_options.zerocopy = 0;
+  __myfs_options.hugepages = 0;
+  __myfs_options.populate = 0;
+  __myfs_options.numa_node = NULL;
+  __myfs_options.compact_interval = NULL;
+  __myfs_options.writeback_interval = NULL;
+  __myfs_options.writeback_dirty = NULL;
   __myfs_options.show_help = 0;
         
   /* Parse options */
@@ -691,6 +2528,15 @@ int main(int argc, char *argv[]) {
     env_ptr = &__myfs_environment;
     if (!__myfs_setup_environment(env_ptr, &__myfs_options))
       return 1;
+    if (env_ptr->zerocopy) {
+      __myfs_operations.read_buf = __myfs_read_buf;
+    } else if (__myfs_options.zerocopy) {
+      fprintf(stderr, "Ignoring --zerocopy: it needs a backup-file\n");
+    }
+    /* Have the kernel send writes in chunks of up to 128kB instead of 4kB */
+    if (fuse_opt_add_arg(&args, "-obig_writes") != 0) {
+      fprintf(stderr, "Cannot enable big writes\n");
+    }
   } else {
     /* Handle displaying of help text */
     __myfs_show_help(argv[0]);
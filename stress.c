@@ -0,0 +1,573 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Concurrency stress and scaling benchmark of a mounted myfs
+
+   Unlike main, which calls the implem layer directly, this goes through
+   the kernel and the FUSE threads of a real mount, with all the locking
+   of myfs.c, using nothing but system calls on the mount point. Every
+   workload runs for a while at 1, 2, 4, ... threads up to the maximum;
+   each run reports its throughput, the speedup over one thread and the
+   latency percentiles of the single operations, and the time spent
+   waiting for the locks of myfs.c per operation, read from /.myfs_stats.
+
+   The workloads are:
+     stat    stats random files of a tree, some of them deep down
+     mixed   reads and writes at random offsets of a set of shared files
+     create  creates files in one directory shared by all threads
+     stream  writes and reads back a large file per thread, sequentially
+
+   usage: stress [-t max threads] [-d seconds per run] [-w workload[,workload...]]
+                 [-i I/O size in bytes] [-f stream file size in MiB] [-r read percentage]
+                 <mount point>
+*/
+
+#define STRESS_DIRS       16                  // Directories of the stat tree
+#define STRESS_DIR_FILES  256                 // Files in each of them
+#define STRESS_DEPTH      16                  // Directories on the path of the deep files
+#define STRESS_SHARED     64                  // Files of the mixed workload
+#define STRESS_SHARED_SIZE ((size_t)1 << 20)  // Size of each of them
+#define STRESS_STREAM_IO  ((size_t)1 << 20)   // Bytes per call of the stream workload
+#define STRESS_STATS      "/.myfs_stats"
+#define STRESS_PATH_MAX   512
+
+enum stress_workload {
+  STRESS_STAT,
+  STRESS_MIXED,
+  STRESS_CREATE,
+  STRESS_STREAM,
+  STRESS_WORKLOADS
+};
+
+static const char *stress_names[STRESS_WORKLOADS] = { "stat", "mixed", "create", "stream" };
+
+typedef struct stress {
+  const char *root;     // Mount point
+  int workload;
+  size_t io_size;       // Bytes per read or write of the mixed workload
+  size_t stream_size;   // Bytes of each file of the stream workload
+  unsigned int reads;   // Percentage of reads in the mixed workload
+  int stop;             // Set once the run is over
+  pthread_barrier_t start;
+} stress_t;
+
+typedef struct worker {
+  stress_t *s;
+  size_t id;
+  uint64_t seed;       // State of the random number generator
+  uint64_t *lat;       // Latencies of the operations, in ns
+  size_t count;        // Used entries of lat
+  size_t capacity;
+  uint64_t bytes;      // Bytes read and written
+  int failed;
+  char *buf;
+} worker_t;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec) * ((uint64_t)1000000000) + ((uint64_t)ts.tv_nsec);
+}
+
+// xorshift64*, as in main.c
+static uint64_t stress_random(worker_t *w) {
+  w->seed ^= w->seed >> 12;
+  w->seed ^= w->seed << 25;
+  w->seed ^= w->seed >> 27;
+  return w->seed * ((uint64_t)0x2545F4914F6CDD1DULL);
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *((const uint64_t *)a);
+  uint64_t y = *((const uint64_t *)b);
+
+  return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t count, unsigned int permille) {
+  size_t i = (count * permille) / ((size_t)1000);
+
+  return sorted[(i < count) ? i : (count - ((size_t)1))];
+}
+
+// Files the latency of an operation that started at start; the first failure of a worker is printed
+static void stress_record(worker_t *w, uint64_t start, int failed, const char *what) {
+  uint64_t lat = now_ns() - start;
+
+  if (w->count == w->capacity) {
+    size_t capacity = (w->capacity == 0) ? ((size_t)65536) : (2 * w->capacity);
+    uint64_t *grown = realloc(w->lat, capacity * sizeof(uint64_t));
+    if (grown == NULL) {
+      return;
+    }
+    w->lat = grown;
+    w->capacity = capacity;
+  }
+  w->lat[w->count++] = lat;
+  if (failed && !w->failed) {
+    fprintf(stderr, "%s failed: %s\n", what, strerror(errno));
+    w->failed = 1;
+  }
+}
+
+static int stress_running(worker_t *w) {
+  return !__atomic_load_n(&w->s->stop, __ATOMIC_RELAXED);
+}
+
+// Puts the path below the mount point given by fmt into path
+static void stress_path(char *path, const stress_t *s, const char *fmt, ...) {
+  int len = snprintf(path, STRESS_PATH_MAX, "%s/", s->root);
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(path + len, STRESS_PATH_MAX - (size_t)len, fmt, ap);
+  va_end(ap);
+}
+
+// Path of the file at the end of the deep path, whose directories are made by stress_setup
+static void stress_deep_path(char *path, const stress_t *s, int depth) {
+  size_t len = (size_t)snprintf(path, STRESS_PATH_MAX, "%s/stress_tree", s->root);
+  int d;
+
+  for (d = 0; d < depth; d++) {
+    len += (size_t)snprintf(path + len, STRESS_PATH_MAX - len, "/deep%02d", d);
+  }
+}
+
+static void stress_stat(worker_t *w) {
+  char path[STRESS_PATH_MAX], deep[STRESS_PATH_MAX];
+  struct stat st;
+
+  stress_deep_path(deep, w->s, STRESS_DEPTH);
+  strcat(deep, "/file");
+  while (stress_running(w)) {
+    uint64_t r = stress_random(w);
+    if ((r % 16) == 0) {
+      strcpy(path, deep);
+    } else {
+      stress_path(path, w->s, "stress_tree/dir%zu/file%zu", (size_t)((r >> 8) % STRESS_DIRS),
+                  (size_t)((r >> 16) % STRESS_DIR_FILES));
+    }
+    uint64_t start = now_ns();
+    int res = stat(path, &st);
+    stress_record(w, start, res != 0, "stat");
+  }
+}
+
+static void stress_mixed(worker_t *w) {
+  int fds[STRESS_SHARED];
+  char path[STRESS_PATH_MAX];
+  size_t i, chunks;
+
+  for (i = 0; i < STRESS_SHARED; i++) {
+    stress_path(path, w->s, "stress_shared%zu", i);
+    if ((fds[i] = open(path, O_RDWR)) < 0) {
+      fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+      w->failed = 1;
+      while (i > 0) {
+        close(fds[--i]);
+      }
+      return;
+    }
+  }
+  chunks = STRESS_SHARED_SIZE / w->s->io_size;
+  if (chunks == 0) {
+    chunks = 1;
+  }
+  while (stress_running(w)) {
+    uint64_t r = stress_random(w);
+    int fd = fds[r % STRESS_SHARED];
+    off_t offset = (off_t)(((r >> 8) % chunks) * w->s->io_size);
+    int is_read = ((unsigned int)((r >> 40) % 100)) < w->s->reads;
+    uint64_t start = now_ns();
+    ssize_t res = is_read ? pread(fd, w->buf, w->s->io_size, offset) : pwrite(fd, w->buf, w->s->io_size, offset);
+    stress_record(w, start, res < 0, is_read ? "read" : "write");
+    if (res > 0) {
+      w->bytes += (uint64_t)res;
+    }
+  }
+  for (i = 0; i < STRESS_SHARED; i++) {
+    close(fds[i]);
+  }
+}
+
+// Creates files until the run is over; they are removed again behind the run, untimed
+static void stress_create(worker_t *w) {
+  char path[STRESS_PATH_MAX];
+  size_t i;
+
+  for (i = 0; stress_running(w); i++) {
+    stress_path(path, w->s, "stress_create/t%zu_f%zu", w->id, i);
+    uint64_t start = now_ns();
+    int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    stress_record(w, start, fd < 0, "create");
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  while (i > 0) {
+    stress_path(path, w->s, "stress_create/t%zu_f%zu", w->id, --i);
+    unlink(path);
+  }
+}
+
+// Writes its own file from start to end, then reads it back, over and over
+static void stress_stream(worker_t *w) {
+  char path[STRESS_PATH_MAX];
+  size_t chunks = w->s->stream_size / STRESS_STREAM_IO;
+  size_t i;
+  int fd;
+
+  stress_path(path, w->s, "stress_stream%zu", w->id);
+  if ((fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0) {
+    fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+    w->failed = 1;
+    return;
+  }
+  if (chunks == 0) {
+    chunks = 1;
+  }
+  while (stress_running(w)) {
+    for (i = 0; (i < chunks) && stress_running(w); i++) {
+      uint64_t start = now_ns();
+      ssize_t res = pwrite(fd, w->buf, STRESS_STREAM_IO, (off_t)(i * STRESS_STREAM_IO));
+      stress_record(w, start, res < 0, "write");
+      w->bytes += (res > 0) ? ((uint64_t)res) : ((uint64_t)0);
+    }
+    for (i = 0; (i < chunks) && stress_running(w); i++) {
+      uint64_t start = now_ns();
+      ssize_t res = pread(fd, w->buf, STRESS_STREAM_IO, (off_t)(i * STRESS_STREAM_IO));
+      stress_record(w, start, res < 0, "read");
+      w->bytes += (res > 0) ? ((uint64_t)res) : ((uint64_t)0);
+    }
+  }
+  close(fd);
+  unlink(path);
+}
+
+static void *stress_worker(void *arg) {
+  worker_t *w = (worker_t *)arg;
+
+  pthread_barrier_wait(&w->s->start);
+  switch (w->s->workload) {
+  case STRESS_STAT:
+    stress_stat(w);
+    break;
+  case STRESS_MIXED:
+    stress_mixed(w);
+    break;
+  case STRESS_CREATE:
+    stress_create(w);
+    break;
+  case STRESS_STREAM:
+    stress_stream(w);
+    break;
+  default:
+    break;
+  }
+  return NULL;
+}
+
+static int stress_make_file(const char *path, size_t size, const char *buf, size_t buf_size) {
+  size_t done;
+  int fd;
+
+  if ((fd = open(path, O_CREAT | O_WRONLY, 0644)) < 0) {
+    return -1;
+  }
+  for (done = 0; done < size; done += buf_size) {
+    size_t len = (size - done < buf_size) ? (size - done) : buf_size;
+    if (pwrite(fd, buf, len, (off_t)done) != (ssize_t)len) {
+      close(fd);
+      return -1;
+    }
+  }
+  return close(fd);
+}
+
+// Makes the files the workloads run on; anything left over from an earlier run is reused
+static int stress_setup(stress_t *s, const char *buf) {
+  char path[STRESS_PATH_MAX];
+  size_t d, i;
+  int depth, fd;
+
+  stress_path(path, s, "stress_tree");
+  mkdir(path, 0755);
+  for (d = 0; d < STRESS_DIRS; d++) {
+    stress_path(path, s, "stress_tree/dir%zu", d);
+    mkdir(path, 0755);
+    for (i = 0; i < STRESS_DIR_FILES; i++) {
+      stress_path(path, s, "stress_tree/dir%zu/file%zu", d, i);
+      if ((fd = open(path, O_CREAT | O_WRONLY, 0644)) < 0) {
+        fprintf(stderr, "create %s: %s\n", path, strerror(errno));
+        return 0;
+      }
+      close(fd);
+    }
+  }
+  for (depth = 1; depth <= STRESS_DEPTH; depth++) {
+    stress_deep_path(path, s, depth);
+    mkdir(path, 0755);
+  }
+  strcat(path, "/file");
+  if ((fd = open(path, O_CREAT | O_WRONLY, 0644)) < 0) {
+    fprintf(stderr, "create %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+  close(fd);
+
+  for (i = 0; i < STRESS_SHARED; i++) {
+    stress_path(path, s, "stress_shared%zu", i);
+    if (stress_make_file(path, STRESS_SHARED_SIZE, buf, STRESS_STREAM_IO) != 0) {
+      fprintf(stderr, "create %s: %s\n", path, strerror(errno));
+      return 0;
+    }
+  }
+  stress_path(path, s, "stress_create");
+  mkdir(path, 0755);
+  return 1;
+}
+
+// Reads a counter of the statistics file of the mount, 0 if there is none
+static uint64_t stress_counter(const stress_t *s, const char *name) {
+  char path[STRESS_PATH_MAX], text[4096];
+  size_t len = strlen(name);
+  ssize_t n;
+  char *p;
+  int fd;
+
+  stress_path(path, s, "%s", STRESS_STATS + 1);
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    return 0;
+  }
+  n = read(fd, text, sizeof(text) - 1);
+  close(fd);
+  if (n <= 0) {
+    return 0;
+  }
+  text[n] = '\0';
+  for (p = text; (p = strstr(p, name)) != NULL; p += len) {
+    if (((p == text) || (p[-1] == '\n')) && (p[len] == ' ')) {
+      return strtoull(p + len + 1, NULL, 10);
+    }
+  }
+  return 0;
+}
+
+// Runs the workload of s on threads threads for duration ns and prints a line; returns the throughput
+static double stress_run(stress_t *s, size_t threads, uint64_t duration, double base) {
+  worker_t *workers = calloc(threads, sizeof(worker_t));
+  pthread_t *ids = calloc(threads, sizeof(pthread_t));
+  size_t buf_size = (s->io_size > STRESS_STREAM_IO) ? s->io_size : STRESS_STREAM_IO;
+  uint64_t *all, bytes = 0, start, wall, waited, acquired;
+  size_t count = 0, i;
+  int failed = 0;
+  double rate;
+
+  if ((workers == NULL) || (ids == NULL)) {
+    free(workers);
+    free(ids);
+    return 0.0;
+  }
+  s->stop = 0;
+  pthread_barrier_init(&s->start, NULL, (unsigned int)(threads + 1));
+  for (i = 0; i < threads; i++) {
+    workers[i].s = s;
+    workers[i].id = i;
+    workers[i].seed = ((uint64_t)88172645463325252ULL) + ((uint64_t)i) * ((uint64_t)0x9E3779B97F4A7C15ULL);
+    if ((workers[i].buf = malloc(buf_size)) != NULL) {
+      memset(workers[i].buf, 'a' + (int)(i % 26), buf_size);
+    }
+
+    // The others would wait at the barrier for good
+    if ((workers[i].buf == NULL) || (pthread_create(&ids[i], NULL, stress_worker, &workers[i]) != 0)) {
+      fprintf(stderr, "cannot start thread %zu\n", i);
+      exit(1);
+    }
+  }
+
+  waited = stress_counter(s, "lock_wait_ns");
+  acquired = stress_counter(s, "lock_acquires");
+  start = now_ns();
+  pthread_barrier_wait(&s->start);
+  while (now_ns() - start < duration) {
+    usleep(10000);
+  }
+  __atomic_store_n(&s->stop, 1, __ATOMIC_RELAXED);
+  wall = now_ns() - start;  // Not counting the cleanup of the workers
+  for (i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+  }
+  waited = stress_counter(s, "lock_wait_ns") - waited;
+  acquired = stress_counter(s, "lock_acquires") - acquired;
+  pthread_barrier_destroy(&s->start);
+
+  for (i = 0; i < threads; i++) {
+    count += workers[i].count;
+  }
+  all = malloc(((count > 0) ? count : ((size_t)1)) * sizeof(uint64_t));
+  count = 0;
+  for (i = 0; i < threads; i++) {
+    if (all != NULL) {
+      memcpy(all + count, workers[i].lat, workers[i].count * sizeof(uint64_t));
+    }
+    count += workers[i].count;
+    bytes += workers[i].bytes;
+    failed |= workers[i].failed;
+    free(workers[i].lat);
+    free(workers[i].buf);
+  }
+  free(workers);
+  free(ids);
+
+  rate = ((double)count) * 1e9 / ((double)wall);
+  if ((all == NULL) || (count == 0)) {
+    printf("%-7s %3zu threads  no operations\n", stress_names[s->workload], threads);
+    free(all);
+    return 0.0;
+  }
+  qsort(all, count, sizeof(uint64_t), compare_u64);
+  printf("%-7s %3zu threads %11.0f ops/s  x%5.2f", stress_names[s->workload], threads, rate,
+         (base > 0.0) ? (rate / base) : 1.0);
+  if (bytes > 0) {
+    printf(" %8.1f MiB/s", ((double)bytes) * 1e9 / ((double)wall) / ((double)(1 << 20)));
+  }
+  printf("  p50 %8llu  p99 %8llu  p99.9 %9llu  max %10llu ns",
+         (unsigned long long)percentile(all, count, 500),
+         (unsigned long long)percentile(all, count, 990),
+         (unsigned long long)percentile(all, count, 999),
+         (unsigned long long)all[count - ((size_t)1)]);
+  if (acquired > 0) {
+    printf("  lock wait %6.0f ns/op", ((double)waited) / ((double)count));
+  }
+  printf("%s\n", failed ? "  (failures)" : "");
+  free(all);
+  return rate;
+}
+
+static size_t parse_arg(const char *str, size_t min) {
+  char *end;
+  unsigned long long val = strtoull(str, &end, 0);
+
+  if ((*str == '\0') || (*end != '\0') || (val < ((unsigned long long)min))) {
+    return 0;
+  }
+  return (size_t)val;
+}
+
+// Sets a bit per workload named in list, 0 if a name is unknown
+static unsigned int parse_workloads(const char *list) {
+  unsigned int mask = 0;
+  const char *p = list;
+  int w;
+
+  while (*p != '\0') {
+    size_t len = strcspn(p, ",");
+    for (w = 0; w < STRESS_WORKLOADS; w++) {
+      if ((strlen(stress_names[w]) == len) && (strncmp(p, stress_names[w], len) == 0)) {
+        break;
+      }
+    }
+    if (w == STRESS_WORKLOADS) {
+      return 0;
+    }
+    mask |= 1u << w;
+    p += len;
+    if (*p == ',') {
+      p++;
+    }
+  }
+  return mask;
+}
+
+int main(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t max_threads = (cpus > 0) ? ((size_t)cpus) : ((size_t)1);
+  size_t seconds = 2, reads = 80, threads;
+  unsigned int workloads = (1u << STRESS_WORKLOADS) - 1u;
+  stress_t s;
+  char *buf;
+  int opt, w;
+
+  memset(&s, 0, sizeof(s));
+  s.io_size = 4096;
+  s.stream_size = ((size_t)64) << 20;
+  while ((opt = getopt(argc, argv, "t:d:w:i:f:r:")) != -1) {
+    switch (opt) {
+    case 't':
+      max_threads = parse_arg(optarg, 1);
+      break;
+    case 'd':
+      seconds = parse_arg(optarg, 1);
+      break;
+    case 'w':
+      workloads = parse_workloads(optarg);
+      break;
+    case 'i':
+      s.io_size = parse_arg(optarg, 1);
+      break;
+    case 'f':
+      s.stream_size = parse_arg(optarg, 1) << 20;
+      break;
+    case 'r':
+      reads = (strcmp(optarg, "0") == 0) ? ((size_t)0) : parse_arg(optarg, 1);
+      if (reads == 0) {
+        reads = (strcmp(optarg, "0") == 0) ? ((size_t)0) : ((size_t)101);
+      }
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-t max threads] [-d seconds per run] [-w workload[,workload...]] "
+              "[-i I/O size in bytes] [-f stream file size in MiB] [-r read percentage] <mount point>\n", argv[0]);
+      return 1;
+    }
+  }
+  if ((optind + 1 != argc) || (max_threads == 0) || (seconds == 0) || (workloads == 0) || (s.io_size == 0) ||
+      (s.stream_size == 0) || (reads > 100)) {
+    fprintf(stderr, "%s: bad argument, see -h\n", argv[0]);
+    return 1;
+  }
+  s.root = argv[optind];
+  s.reads = (unsigned int)reads;
+
+  if ((buf = malloc((s.io_size > STRESS_STREAM_IO) ? s.io_size : STRESS_STREAM_IO)) == NULL) {
+    return 1;
+  }
+  memset(buf, 's', (s.io_size > STRESS_STREAM_IO) ? s.io_size : STRESS_STREAM_IO);
+  if (!stress_setup(&s, buf)) {
+    free(buf);
+    return 1;
+  }
+  free(buf);
+
+  printf("%s: up to %zu threads, %zu s per run, %zu-byte I/O, %zu MiB streams, %u%% reads\n", s.root,
+         max_threads, seconds, s.io_size, s.stream_size >> 20, s.reads);
+  for (w = 0; w < STRESS_WORKLOADS; w++) {
+    if (!(workloads & (1u << w))) {
+      continue;
+    }
+    double base = 0.0;
+    s.workload = w;
+    for (threads = 1; ; threads = (2 * threads < max_threads) ? (2 * threads) : max_threads) {
+      double rate = stress_run(&s, threads, ((uint64_t)seconds) * ((uint64_t)1000000000), base);
+      if (threads == 1) {
+        base = rate;
+      }
+      if (threads == max_threads) {
+        break;
+      }
+    }
+  }
+  return 0;
+}